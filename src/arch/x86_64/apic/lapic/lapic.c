@@ -62,8 +62,13 @@ void lapic_init() {
     debugf_debug("LAPIC base: %llx\n", lapic_msr_phys);
 
     lapic_base = PHYS_TO_VIRTUAL(lapic_msr_phys + HHDM_OFFSET);
-    map_region_to_page((uint64_t *)PHYS_TO_VIRTUAL(_get_pml4()), lapic_msr_phys,
-                       lapic_base, 0x1000, PMLE_KERNEL_READ_WRITE);
+    // CR3 might have a PCID in its low bits
+    uint64_t pml4 = PG_GET_ADDR((uint64_t)_get_pml4());
+    if (!map_region_to_page((uint64_t *)PHYS_TO_VIRTUAL(pml4), lapic_msr_phys,
+                            lapic_base, 0x1000, PMLE_KERNEL_READ_WRITE)) {
+        kprintf_panic("Out of memory for mapping the LAPIC!\n");
+        _hcf();
+    }
 
     pic_disable();
     // TODO: remap all PIC IRQs
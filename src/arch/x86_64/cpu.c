@@ -54,6 +54,19 @@ bool check_fxsr() {
     return edx & CPUID_FEAT_EDX_FXSR;
 }
 
+// 1GiB pages
+bool check_pdpe1gb() {
+    uint32_t edx, unused;
+    __get_cpuid(0x80000001, &unused, &unused, &unused, &edx);
+    return (edx & (1 << 26)) ? 1 : 0;
+}
+
+bool check_pcid() {
+    uint32_t ecx, unused;
+    __get_cpuid(1, &unused, &unused, &ecx, &unused);
+    return ecx & CPUID_FEAT_ECX_PCID;
+}
+
 void cpu_reg_write(uint32_t *reg, uint32_t value) {
     *reg = value;
 }
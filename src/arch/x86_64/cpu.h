@@ -106,6 +106,12 @@
 #define CPUID_FEAT_EDX_IA64    1 << 30
 #define CPUID_FEAT_EDX_PBE     1 << 31
 
+// data written by different CPUs should never share one of these
+#define CACHE_LINE_SIZE 64
+
+#define CR4_PGE   (1 << 7)  // global pages
+#define CR4_PCIDE (1 << 17) // process-context identifiers
+
 // gets a value from a CRX register
 // by
 // https://github.com/Tix3Dev/apoptOS/blob/370fd34a6d3c87a9d1a16d1a2ec072bd1836ba6c/src/kernel/utility/utils.h#L26
@@ -115,6 +121,9 @@
         asm volatile("mov %%cr" #reg ", %0" : "=r"(val));                      \
         val;                                                                   \
     })
+// writes a value to a CRX register
+#define cpu_set_cr(reg, val)                                                   \
+    asm volatile("mov %0, %%cr" #reg : : "r"((uint64_t)(val)) : "memory")
 
 bool check_pae();
 bool check_msr();
@@ -125,6 +134,8 @@ bool check_sse();
 bool check_fpu();
 bool check_sse2();
 bool check_fxsr();
+bool check_pdpe1gb();
+bool check_pcid();
 
 const char *get_cpu_vendor();
 
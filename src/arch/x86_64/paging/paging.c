@@ -1,19 +1,23 @@
 /*
-        Page fault "handler"
+        Page fault handler
 
-        When a page fault exception is fired, the _hcf screen will print
-   information about the given error code.
+        Faults on non-present pages of a demand paged VMO get a page frame
+   mapped in, and writes to copy-on-write pages get a copy of their own. Any
+   other page fault fires the _hcf screen, which will print information about
+   the given error code.
 
         (C) RepubblicaTech 2024
 */
 
 #include "paging.h"
-#include "smp/ipi.h"
+#include "smp/tlb.h"
 
 #include <stdint.h>
 #include <stdio.h>
 
 #include <memory/pmm/pmm.h>
+#include <memory/vmm/vma.h>
+#include <memory/vmm/vmm.h>
 
 #include <util/string.h>
 #include <util/util.h>
@@ -78,13 +82,30 @@ unrelated to ordinary paging.
         (C) RepubblicaTech 2024
 */
 void pf_handler(void *ctx) {
-    stdio_panic_init();
-    bsod_init();
-
     registers_t *regs = ctx;
 
     uint64_t pf_error_code = (uint64_t)regs->error;
 
+    // CR2 contains the address that caused the fault
+    uint64_t cr2 = cpu_get_cr(2);
+
+    vmm_context_t *vmm_ctx = get_current_ctx();
+    if (vmm_ctx != NULL) {
+        bool write = PG_WR_RD(pf_error_code);
+        bool user  = PG_RING(pf_error_code);
+
+        // the page might just not have been touched yet, or be shared with
+        // another context until it gets written to
+        if (!PG_PRESENT(pf_error_code) && vma_fault(vmm_ctx, cr2, write, user))
+            return;
+        if (PG_PRESENT(pf_error_code) && write &&
+            vma_cow_fault(vmm_ctx, cr2, user))
+            return;
+    }
+
+    stdio_panic_init();
+    bsod_init();
+
     debugf(ANSI_COLOR_BLUE);
     mprintf("--- PANIC! ---\n");
     mprintf("Page fault code %016b\n\n-------------------------------\n",
@@ -105,8 +126,6 @@ void pf_handler(void *ctx) {
         break;
     }
 
-    // CR2 contains the address that caused the fault
-    uint64_t cr2 = cpu_get_cr(2);
     mprintf("\nAttempt to access address %llx\n\n", cr2);
 
     mprintf("RESERVED WRITE: %d\n", PG_RESERVED(pf_error_code));
@@ -134,6 +153,7 @@ uint64_t *get_pmlt(uint64_t *pml_table, uint64_t pml_index) {
     return (uint64_t *)(PHYS_TO_VIRTUAL(actual_page_addr));
 }
 
+// @returns NULL if the table wasn't there and there's no memory for one
 uint64_t *get_create_pmlt(uint64_t *pml_table, uint64_t pmlt_index,
                           uint64_t flags) {
     // is there something at pml_table[pmlt_index]?
@@ -141,7 +161,12 @@ uint64_t *get_create_pmlt(uint64_t *pml_table, uint64_t pmlt_index,
         /*debugf_debug("Table %llp entry %llx is not present, creating
            it...\n", pml_table, pmlt_index);*/
 
-        pml_table[pmlt_index] = (uint64_t)pmm_alloc_page() | flags;
+        uint64_t *table = pmm_alloc_page();
+        if (table == NULL)
+            return NULL;
+        page_tag(table, 1, PAGE_OWNER_PAGING, PAGE_PAGETABLE);
+
+        pml_table[pmlt_index] = (uint64_t)table | flags;
     }
 
     // kprintf_info("Table %llp entry %llx contents:%llx flags:%llx\n",
@@ -150,19 +175,126 @@ uint64_t *get_create_pmlt(uint64_t *pml_table, uint64_t pmlt_index,
     return get_pmlt(pml_table, pmlt_index);
 }
 
+/*
+        Huge pages
+
+        map_region_to_page() maps with 1GiB and 2MiB pages wherever the
+   addresses are aligned enough and the region is long enough, so that the
+   HHDM and the kernel take a handful of entries instead of one for every
+   4KiB. Huge pages only go where there's no table already.
+
+        Whenever a 4KiB entry is needed inside a huge page, pg_create_entry()
+   or the cursor below splits it into a table of smaller pages mapping the
+   same memory, so mapping or unmapping part of one just works.
+*/
+
+static bool pdpe1gb; // whether the CPU can do 1GiB pages
+
+// how much memory an entry maps, for every level of tables. A table maps as
+// much as an entry of the level above it
+static const uint64_t level_page_size[] = {1ull << 39, PAGE_1G, PAGE_2M,
+                                           PFRAME_SIZE};
+
+// @returns the entry that maps `virtual`, whatever the size of its page, NULL
+// if there's none. `page_size` is set to the size of the page
+static uint64_t *find_leaf(uint64_t *pml4_table, uint64_t virtual,
+                           uint64_t *page_size) {
+    uint64_t *table    = pml4_table;
+    uint64_t indexes[] = {PML4_INDEX(virtual), PDP_INDEX(virtual),
+                          PDIR_INDEX(virtual), PTAB_INDEX(virtual)};
+
+    for (size_t i = 0; i < sizeof(indexes) / sizeof(indexes[0]); i++) {
+        uint64_t *entry = &table[indexes[i]];
+        if (!(*entry & PMLE_PRESENT))
+            return NULL;
+
+        // bit 7 of a page table entry is PAT, not PMLE_HUGE
+        if (i == 3 || (*entry & PMLE_HUGE)) {
+            *page_size = level_page_size[i];
+            return entry;
+        }
+
+        table = get_pmlt(table, indexes[i]);
+    }
+
+    return NULL;
+}
+
+// turns a huge page entry into a table of pages one level smaller, mapping
+// the same memory with the same flags
+// @returns false if there's no memory for the table, the entry is left as is
+static bool split_huge_page(uint64_t *entry, uint64_t page_size) {
+    uint64_t *table = pmm_alloc_page_nozero();
+    if (table == NULL)
+        return false;
+    page_tag(table, 1, PAGE_OWNER_PAGING, PAGE_PAGETABLE);
+
+    uint64_t small_size = page_size / PMLT_ENTRIES;
+    uint64_t flags      = PG_FLAGS(*entry);
+    if (small_size == PFRAME_SIZE)
+        flags &= ~PMLE_HUGE;
+
+    uint64_t *small = (uint64_t *)PHYS_TO_VIRTUAL(table);
+    for (size_t i = 0; i < PMLT_ENTRIES; i++)
+        small[i] = (PG_GET_ADDR(*entry) + i * small_size) | flags;
+
+    *entry = (uint64_t)table | 0b111;
+    return true;
+}
+
 // given the PML4 table and a virtual address, returns the page entry with its
-// flags
+// flags, 0 if there's none. For huge pages it's the entry a 4KiB page mapping
+// the same memory would have
 uint64_t get_page_entry(uint64_t *pml4_table, uint64_t virtual) {
-    uint64_t pml4_index = PML4_INDEX(virtual);
-    uint64_t pdp_index  = PDP_INDEX(virtual);
-    uint64_t pdir_index = PDIR_INDEX(virtual);
-    uint64_t ptab_index = PTAB_INDEX(virtual);
+    uint64_t size;
+    uint64_t *entry = find_leaf(pml4_table, virtual, &size);
+    if (entry == NULL)
+        return 0;
+    if (size == PFRAME_SIZE)
+        return *entry;
+
+    uint64_t offset = virtual & (size - 1) & PG_ADDR_MASK;
+    return (PG_GET_ADDR(*entry) + offset) | (PG_FLAGS(*entry) & ~PMLE_HUGE);
+}
+
+// @returns a pointer to the page entry of `virtual`, NULL if one of the tables
+// on the way there isn't present or `virtual` is in a huge page
+uint64_t *pg_find_entry(uint64_t *pml4_table, uint64_t virtual) {
+    uint64_t *table    = pml4_table;
+    uint64_t indexes[] = {PML4_INDEX(virtual), PDP_INDEX(virtual),
+                          PDIR_INDEX(virtual)};
 
-    uint64_t *pdp_table  = get_pmlt(pml4_table, pml4_index);
-    uint64_t *pdir_table = get_pmlt(pdp_table, pdp_index);
-    uint64_t *page_table = get_pmlt(pdir_table, pdir_index);
+    for (size_t i = 0; i < sizeof(indexes) / sizeof(indexes[0]); i++) {
+        if (!(table[indexes[i]] & PMLE_PRESENT) ||
+            (table[indexes[i]] & PMLE_HUGE))
+            return NULL;
 
-    return page_table[ptab_index];
+        table = get_pmlt(table, indexes[i]);
+    }
+
+    return &table[PTAB_INDEX(virtual)];
+}
+
+// like pg_find_entry(), but creates the tables that are missing and splits the
+// huge pages in the way
+// @returns NULL if there's no memory for a table
+uint64_t *pg_create_entry(uint64_t *pml4_table, uint64_t virtual) {
+    uint64_t *table    = pml4_table;
+    uint64_t indexes[] = {PML4_INDEX(virtual), PDP_INDEX(virtual),
+                          PDIR_INDEX(virtual)};
+
+    for (size_t i = 0; i < sizeof(indexes) / sizeof(indexes[0]); i++) {
+        if ((table[indexes[i]] & PMLE_PRESENT) &&
+            (table[indexes[i]] & PMLE_HUGE) &&
+            !split_huge_page(&table[indexes[i]], level_page_size[i]))
+            return NULL;
+
+        table = get_create_pmlt(table, indexes[i], 0b111);
+        if (table == NULL)
+            return NULL;
+    }
+
+    return &table[PTAB_INDEX(virtual)];
 }
 
 // given the PML4 table and a virtual address, returns its physical address
@@ -170,87 +302,286 @@ uint64_t pg_virtual_to_phys(uint64_t *pml4_table, uint64_t virtual) {
     return PG_GET_ADDR(get_page_entry(pml4_table, virtual));
 }
 
-// map a page frame to a physical address that gets mapped to a virtual one
-void map_phys_to_page(uint64_t *pml4_table, uint64_t physical, uint64_t virtual,
-                      uint64_t flags) {
-    // if (virtual % PFRAME_SIZE) {
-    // 	kprintf_panic("Attempted to map non-aligned addresses (phys)%llx
-    // (virt)%llx!\n", physical, virtual); 	_hcf();
-    // }
+/*
+        Page table cursors
+
+        A pg_cursor_t remembers the tables on the way to the last address it
+   went to, and going somewhere else only walks down from the deepest of them
+   that maps that address too. Maps and unmaps fill or clear page table
+   entries one run after the other, walking again only when they cross into
+   another table, and flush the TLBs once at the end.
+
+        Unmapping frees the lower half tables that only mapped addresses in
+   the unmapped range, as soon as the cursor leaves them. They go in a list
+   and pg_cursor_flush() frees them after committing the TLB batch, because
+   a CPU could still reach them through its paging-structure caches until
+   then. Higher half tables are shared by every context and could be cached
+   under any PCID, they always stay.
+*/
 
-    uint64_t pml4_index = PML4_INDEX(virtual);
-    uint64_t pdp_index  = PDP_INDEX(virtual);
-    uint64_t pdir_index = PDIR_INDEX(virtual);
-    uint64_t ptab_index = PTAB_INDEX(virtual);
+#define LEVEL_INDEX(a, level) (((a) >> (39 - 9 * (level))) & PMLT_MASK)
 
-    uint64_t *pdp_table  = get_create_pmlt(pml4_table, pml4_index, 0b111);
-    uint64_t *pdir_table = get_create_pmlt(pdp_table, pdp_index, 0b111);
-    uint64_t *page_table = get_create_pmlt(pdir_table, pdir_index, 0b111);
+void pg_cursor_init(pg_cursor_t *cur, uint64_t *pml4_table) {
+    cur->pml4_table = (uint64_t *)PHYS_TO_VIRTUAL(pml4_table);
+    cur->tables[0]  = cur->pml4_table;
+    for (size_t i = 1; i < 4; i++)
+        cur->tables[i] = NULL;
 
-    page_table[ptab_index] = PG_GET_ADDR(physical) | flags;
-    // debugf_debug("Page table %llp entry %llu mapped to (virt)%llx
-    // (phys)%llx \n", page_table, ptab_index, virtual, physical);
-    // debugf_debug("\tcontents of table[entry]: %llx\n",
-    // page_table[ptab_index]);
+    cur->freed = NULL;
+    tlb_batch_begin(&cur->batch, pml4_table);
+}
 
-    _invalidate(virtual);
-    if (get_bootloader_data()->smp_enabled) {
-        tlb_shootdown(virtual);
+// walks down to the level `level` table that maps `virtual`
+// @returns the level it got to. Without `create` it stops at missing tables
+// and huge pages, with it those are created or split, and it only stops short
+// when there's no memory for a table
+static int cursor_walk(pg_cursor_t *cur, uint64_t virtual, int level,
+                       bool create) {
+    // the deepest table we're in that maps `virtual` too
+    int i = level;
+    while (i > 0 && (cur->tables[i] == NULL ||
+                     virtual - cur->bases[i] >= level_page_size[i - 1]))
+        i--;
+
+    for (; i < level; i++) {
+        uint64_t *entry = &cur->tables[i][LEVEL_INDEX(virtual, i)];
+        if (!create && (!(*entry & PMLE_PRESENT) || (*entry & PMLE_HUGE)))
+            break;
+
+        if ((*entry & PMLE_PRESENT) && (*entry & PMLE_HUGE) &&
+            !split_huge_page(entry, level_page_size[i]))
+            break;
+
+        uint64_t *table =
+            get_create_pmlt(cur->tables[i], LEVEL_INDEX(virtual, i), 0b111);
+        if (table == NULL)
+            break;
+
+        cur->tables[i + 1] = table;
+        cur->bases[i + 1]  = ROUND_DOWN(virtual, level_page_size[i]);
+        // the ones below it were somewhere else
+        for (int j = i + 2; j < 4; j++)
+            cur->tables[j] = NULL;
     }
+
+    return i;
 }
 
-void unmap_page(uint64_t *pml4_table, uint64_t virtual) {
-    uint64_t pml4_index = PML4_INDEX(virtual);
-    uint64_t pdp_index  = PDP_INDEX(virtual);
-    uint64_t pdir_index = PDIR_INDEX(virtual);
-    uint64_t ptab_index = PTAB_INDEX(virtual);
+uint64_t *pg_cursor_find(pg_cursor_t *cur, uint64_t virtual) {
+    if (cursor_walk(cur, virtual, 3, false) != 3)
+        return NULL;
+
+    return &cur->tables[3][PTAB_INDEX(virtual)];
+}
+
+// kernel mappings are the same in every context, the TLB can keep them across
+// CR3 loads
+static uint64_t leaf_flags(uint64_t virtual, uint64_t flags) {
+    if (virtual >= HIGHER_HALF)
+        flags |= PMLE_GLOBAL;
+
+    return flags;
+}
 
-    uint64_t *pdp_table  = get_pmlt(pml4_table, pml4_index);
-    uint64_t *pdir_table = get_pmlt(pdp_table, pdp_index);
-    uint64_t *page_table = get_pmlt(pdir_table, pdir_index);
+bool pg_cursor_map(pg_cursor_t *cur, uint64_t physical, uint64_t virtual,
+                   uint64_t len, uint64_t flags) {
+    uint64_t end = virtual + ROUND_UP(len, PFRAME_SIZE);
+    while (virtual < end) {
+        uint64_t size = PFRAME_SIZE;
+        for (int level = 1; level < 3 && size == PFRAME_SIZE; level++) {
+            uint64_t huge = level_page_size[level];
+            if ((huge == PAGE_1G && !pdpe1gb) || virtual % huge != 0 ||
+                physical % huge != 0 || end - virtual < huge)
+                continue;
+
+            if (cursor_walk(cur, virtual, level, true) != level)
+                return false;
+            uint64_t *entry = &cur->tables[level][LEVEL_INDEX(virtual, level)];
+
+            // huge pages only go where there's no table already
+            if ((*entry & PMLE_PRESENT) && !(*entry & PMLE_HUGE))
+                continue;
+
+            if (*entry & PMLE_PRESENT)
+                tlb_batch_add(&cur->batch, virtual, huge);
+            *entry =
+                PG_GET_ADDR(physical) | leaf_flags(virtual, flags) | PMLE_HUGE;
+            size = huge;
+        }
+
+        if (size != PFRAME_SIZE) {
+            virtual  += size;
+            physical += size;
+            continue;
+        }
+
+        // huge pages start on a table boundary, the rest of this one can only
+        // take 4KiB pages
+        if (cursor_walk(cur, virtual, 3, true) != 3)
+            return false;
+        uint64_t *table = cur->tables[3];
+        for (size_t i = PTAB_INDEX(virtual); i < PMLT_ENTRIES && virtual < end;
+             i++) {
+            uint64_t new = PG_GET_ADDR(physical) | leaf_flags(virtual, flags);
+
+            // TLBs don't keep non-present entries, only replacing a page
+            // needs a flush
+            if ((table[i] & PMLE_PRESENT) &&
+                ((table[i] ^ new) & ~(PMLE_ACCESSED | PMLE_DIRTY)))
+                tlb_batch_add(&cur->batch, virtual, PFRAME_SIZE);
+            table[i] = new;
+
+            virtual  += PFRAME_SIZE;
+            physical += PFRAME_SIZE;
+        }
+    }
+
+    return true;
+}
+
+// lets go of the tables the cursor is out of, freeing those that only mapped
+// addresses in [start, end)
+static void cursor_leave(pg_cursor_t *cur, uint64_t virtual, uint64_t start,
+                         uint64_t end) {
+    for (int level = 3; level > 0; level--) {
+        uint64_t *table = cur->tables[level];
+        uint64_t base   = cur->bases[level];
+        uint64_t span   = level_page_size[level - 1];
+        if (table == NULL || virtual - base < span)
+            continue;
+
+        cur->tables[level] = NULL;
+        if (base < start || base >= LOWER_HALF_END || end - base < span)
+            continue;
+
+        cur->tables[level - 1][LEVEL_INDEX(base, level - 1)] = 0x0;
+        tlb_batch_add(&cur->batch, base, PFRAME_SIZE);
+
+        // with the present bit clear, a CPU walking it sees nothing there
+        table[0]   = (uint64_t)cur->freed;
+        cur->freed = table;
+    }
+}
 
-    page_table[ptab_index] = 0x0;
+// unmapping part of a huge page splits it
+void pg_cursor_unmap(pg_cursor_t *cur, uint64_t virtual, uint64_t len) {
+    uint64_t start = virtual;
+    uint64_t end   = virtual + ROUND_UP(len, PFRAME_SIZE);
+
+    while (virtual < end) {
+        int level       = cursor_walk(cur, virtual, 3, false);
+        uint64_t *entry = &cur->tables[level][LEVEL_INDEX(virtual, level)];
+        uint64_t size   = level_page_size[level];
+
+        if (level == 3) {
+            // the rest of the page table in one go
+            uint64_t run    = virtual;
+            bool unmapped   = false;
+            uint64_t *table = cur->tables[3];
+            for (size_t i = PTAB_INDEX(virtual);
+                 i < PMLT_ENTRIES && virtual < end; i++) {
+                if (table[i] & PMLE_PRESENT)
+                    unmapped = true;
+                table[i]  = 0x0;
+                virtual  += PFRAME_SIZE;
+            }
+
+            if (unmapped)
+                tlb_batch_add(&cur->batch, run, virtual - run);
+        } else if (!(*entry & PMLE_PRESENT)) {
+            // demand paged regions can have holes with no tables at all
+            virtual = ROUND_DOWN(virtual, size) + size;
+        } else if (virtual % size == 0 && end - virtual >= size) {
+            *entry = 0x0;
+            tlb_batch_add(&cur->batch, virtual, size);
+            virtual += size;
+        } else {
+            // the rest of the huge page has to stay mapped, and what we were
+            // asked to unmap is about to be freed
+            if (cursor_walk(cur, virtual, 3, true) != 3) {
+                kprintf_panic("Out of memory for splitting a huge page!\n");
+                _hcf();
+            }
+            continue;
+        }
+
+        cursor_leave(cur, virtual, start, end);
+    }
+}
 
-    _invalidate(virtual);
-    if (get_bootloader_data()->smp_enabled) {
-        tlb_shootdown(virtual);
+void pg_cursor_flush(pg_cursor_t *cur) {
+    tlb_batch_commit(&cur->batch);
+    tlb_batch_begin(&cur->batch, cur->pml4_table);
+
+    while (cur->freed != NULL) {
+        uint64_t *table = cur->freed;
+        cur->freed      = (uint64_t *)table[0];
+        pmm_free(table, 1);
     }
 }
 
+// map a page frame to a physical address that gets mapped to a virtual one
+// @returns false if there's no memory for the page tables
+bool map_phys_to_page(uint64_t *pml4_table, uint64_t physical, uint64_t virtual,
+                      uint64_t flags) {
+    // if (virtual % PFRAME_SIZE) {
+    // 	kprintf_panic("Attempted to map non-aligned addresses (phys)%llx
+    // (virt)%llx!\n", physical, virtual); 	_hcf();
+    // }
+
+    pg_cursor_t cur;
+    pg_cursor_init(&cur, pml4_table);
+    bool mapped = pg_cursor_map(&cur, physical, virtual, PFRAME_SIZE, flags);
+    pg_cursor_flush(&cur);
+
+    return mapped;
+}
+
+void unmap_page(uint64_t *pml4_table, uint64_t virtual) {
+    pg_cursor_t cur;
+    pg_cursor_init(&cur, pml4_table);
+    pg_cursor_unmap(&cur, virtual, PFRAME_SIZE);
+    pg_cursor_flush(&cur);
+}
+
 // maps a page region to its physical range
-void map_region_to_page(uint64_t *pml4_table, uint64_t physical_start,
+// @returns false if there's no memory for the page tables. Part of the region
+// might be mapped then
+bool map_region_to_page(uint64_t *pml4_table, uint64_t physical_start,
                         uint64_t virtual_start, uint64_t len, uint64_t flags) {
 
-    uint64_t pages = ROUND_UP(len, PFRAME_SIZE) / PFRAME_SIZE;
 #ifdef CONFIG_PAGING_DEBUG
     debugf_debug("Mapping address range (phys)%llx-%llx (virt)%llx-%llx\n",
                  physical_start, physical_start + len, virtual_start,
                  virtual_start + len);
 #endif
 
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t phys = physical_start + (i * PFRAME_SIZE);
-        uint64_t virt = virtual_start + (i * PFRAME_SIZE);
-        map_phys_to_page(pml4_table, phys, virt, flags);
-    }
+    pg_cursor_t cur;
+    pg_cursor_init(&cur, pml4_table);
+    bool mapped =
+        pg_cursor_map(&cur, physical_start, virtual_start, len, flags);
+    pg_cursor_flush(&cur);
+
+    return mapped;
 }
 
 void unmap_region(uint64_t *pml4_table, uint64_t virtual_start, uint64_t len) {
 
-    uint64_t pages = ROUND_UP(len, PFRAME_SIZE) / PFRAME_SIZE;
 #ifdef CONFIG_PAGING_DEBUG
     debugf_debug("Unmapping address range (virt)%llx-%llx\n", virtual_start,
                  virtual_start + len);
 #endif
-    for (uint64_t i = 0; i < pages; i++) {
-        uint64_t virt = virtual_start + (i * PFRAME_SIZE);
-        unmap_page(pml4_table, virt);
-    }
+
+    pg_cursor_t cur;
+    pg_cursor_init(&cur, pml4_table);
+    pg_cursor_unmap(&cur, virtual_start, len);
+    pg_cursor_flush(&cur);
 }
 
 // Copy a virtual address range of a pagemap to another one
 // The virtual-to-physical mappings will be copied
-void copy_range_to_pagemap(uint64_t *dst_pml4, uint64_t *src_pml4,
+// @returns false if there's no memory for the page tables
+bool copy_range_to_pagemap(uint64_t *dst_pml4, uint64_t *src_pml4,
                            uint64_t virt_start, size_t len) {
 
     uint64_t phys_start =
@@ -258,8 +589,8 @@ void copy_range_to_pagemap(uint64_t *dst_pml4, uint64_t *src_pml4,
     uint64_t page_entry_flags = PG_FLAGS(
         get_page_entry((uint64_t *)PHYS_TO_VIRTUAL(src_pml4), virt_start));
 
-    map_region_to_page((uint64_t *)PHYS_TO_VIRTUAL(dst_pml4), phys_start,
-                       virt_start, len, page_entry_flags);
+    return map_region_to_page((uint64_t *)PHYS_TO_VIRTUAL(dst_pml4), phys_start,
+                              virt_start, len, page_entry_flags);
 }
 
 // Paging initialization
@@ -282,6 +613,10 @@ void paging_init(uint64_t *kernel_pml4) {
     if (kernel_pml4 == NULL) {
         kernel_pml4 = pmm_alloc_page();
     }
+    page_tag(kernel_pml4, 1, PAGE_OWNER_PAGING, PAGE_PAGETABLE);
+
+    pdpe1gb = check_pdpe1gb();
+    debugf_debug("1GiB pages are %ssupported\n", pdpe1gb ? "" : "not ");
 
     limine_pml4 = _get_pml4();
     debugf_debug("Limine's PML4 sits at %llp\n", limine_pml4);
@@ -307,36 +642,42 @@ void paging_init(uint64_t *kernel_pml4) {
     uint64_t a_kernel_text_start = (uint64_t)&__kernel_text_start;
     uint64_t a_kernel_text_end   = (uint64_t)&__kernel_text_end;
     uint64_t kernel_text_len     = a_kernel_text_end - a_kernel_text_start;
+    // nothing can be done about running out of memory this early, so it's only
+    // checked once at the end
+    bool mapped = true;
+
     kprintf_info("Mapping section .text\n");
-    map_region_to_page(kernel_pml4, a_kernel_text_start - VIRT_BASE + PHYS_BASE,
-                       a_kernel_text_start, kernel_text_len,
-                       PMLE_KERNEL_READ_WRITE);
+    mapped &= map_region_to_page(
+        kernel_pml4, a_kernel_text_start - VIRT_BASE + PHYS_BASE,
+        a_kernel_text_start, kernel_text_len, PMLE_KERNEL_READ_WRITE);
 
     uint64_t a_kernel_rodata_start = (uint64_t)&__kernel_rodata_start;
     uint64_t a_kernel_rodata_end   = (uint64_t)&__kernel_rodata_end;
     uint64_t kernel_rodata_len = a_kernel_rodata_end - a_kernel_rodata_start;
     kprintf_info("Mapping section .rodata\n");
-    map_region_to_page(kernel_pml4,
-                       a_kernel_rodata_start - VIRT_BASE + PHYS_BASE,
-                       a_kernel_rodata_start, kernel_rodata_len,
-                       PMLE_KERNEL_READ | PMLE_NOT_EXECUTABLE);
+    mapped &= map_region_to_page(
+        kernel_pml4, a_kernel_rodata_start - VIRT_BASE + PHYS_BASE,
+        a_kernel_rodata_start, kernel_rodata_len,
+        PMLE_KERNEL_READ | PMLE_NOT_EXECUTABLE);
 
     uint64_t a_kernel_data_start = (uint64_t)&__kernel_data_start;
     uint64_t a_kernel_data_end   = (uint64_t)&__kernel_data_end;
     uint64_t kernel_data_len     = a_kernel_data_end - a_kernel_data_start;
     uint64_t kernel_other_len    = a_kernel_end - a_kernel_data_end;
     kprintf_info("Mapping section .data\n");
-    map_region_to_page(kernel_pml4, a_kernel_data_start - VIRT_BASE + PHYS_BASE,
-                       a_kernel_data_start, kernel_data_len + kernel_other_len,
-                       PMLE_KERNEL_READ_WRITE | PMLE_NOT_EXECUTABLE);
+    mapped &= map_region_to_page(
+        kernel_pml4, a_kernel_data_start - VIRT_BASE + PHYS_BASE,
+        a_kernel_data_start, kernel_data_len + kernel_other_len,
+        PMLE_KERNEL_READ_WRITE | PMLE_NOT_EXECUTABLE);
 
     uint64_t a_limine_reqs_start = (uint64_t)&__limine_reqs_start;
     uint64_t a_limine_reqs_end   = (uint64_t)&__limine_reqs_end;
     uint64_t limine_reqs_len     = a_limine_reqs_end - a_limine_reqs_start;
     kprintf_info("Mapping section .requests\n");
-    map_region_to_page(kernel_pml4, a_limine_reqs_start - VIRT_BASE + PHYS_BASE,
-                       a_limine_reqs_start, limine_reqs_len,
-                       PMLE_KERNEL_READ_WRITE | PMLE_NOT_EXECUTABLE);
+    mapped &= map_region_to_page(
+        kernel_pml4, a_limine_reqs_start - VIRT_BASE + PHYS_BASE,
+        a_limine_reqs_start, limine_reqs_len,
+        PMLE_KERNEL_READ_WRITE | PMLE_NOT_EXECUTABLE);
 
     // map the whole memory
     kprintf_info("Mapping all the memory\n");
@@ -345,11 +686,16 @@ void paging_init(uint64_t *kernel_pml4) {
 
         // we won't identity map
 
-        map_region_to_page(kernel_pml4, memmap_entry->base,
-                           PHYS_TO_VIRTUAL(memmap_entry->base),
-                           memmap_entry->length, PMLE_KERNEL_READ_WRITE);
+        mapped &= map_region_to_page(kernel_pml4, memmap_entry->base,
+                                     PHYS_TO_VIRTUAL(memmap_entry->base),
+                                     memmap_entry->length,
+                                     PMLE_KERNEL_READ_WRITE);
     }
 
+    if (!mapped) {
+        kprintf_panic("Out of memory for the kernel's page tables!\n");
+        _hcf();
+    }
     kprintf_info("All mappings done.\n");
 
     debugf_debug("Our PML4 sits at %llp\n", kernel_pml4);
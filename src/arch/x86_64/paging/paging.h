@@ -4,6 +4,9 @@
         - Paging utilities
 */
 
+#ifndef PAGING_H
+#define PAGING_H 1
+
 #include <interrupts/isr.h>
 
 /*
@@ -21,6 +24,7 @@
 */
 
 #include <memory/pmm/pmm.h>
+#include <smp/tlb.h>
 
 #define VIRT_BASE limine_parsed_data.kernel_base_virtual
 #define PHYS_BASE limine_parsed_data.kernel_base_physical
@@ -28,6 +32,10 @@
 // PMLT entry is 8-bytes wide instead of 4, so the entries are halved
 #define PMLT_ENTRIES 512
 
+// where the kernel's mappings start, they're the same in every context
+#define HIGHER_HALF    0xffff800000000000
+#define LOWER_HALF_END 0x0000800000000000 // every context has its own
+
 // PMLE Flags
 // from
 // https://github.com/tyler-ottman/tellurium-os/blob/01cf40ba4ab872e81bc98d6c740174c42b029376/kernel/memory/vmm.h#L15
@@ -37,6 +45,12 @@
 #define PMLE_PWT            (1 << 3)
 #define PMLE_PCD            (1 << 4)
 #define PMLE_ACCESSED       (1 << 5)
+#define PMLE_DIRTY          (1 << 6)
+#define PMLE_HUGE           (1 << 7) // PDPT/PD entry mapping a 1GiB/2MiB page
+#define PMLE_GLOBAL         (1 << 8) // stays in the TLB across CR3 loads
+#define PMLE_COW            (1 << 9) // ignored by the CPU, see vma_cow_fault()
+// ignored by the CPU too, a clone's reference to the frame. See vmm_ctx_clone()
+#define PMLE_SHARED         (1 << 10)
 #define PMLE_NOT_EXECUTABLE (1ull << 63)
 
 // Page privileges attributes
@@ -96,20 +110,56 @@ extern void _invalidate(uint64_t virtual);
 
 uint64_t *get_pmlt(uint64_t *pml_table, uint64_t pml_index);
 uint64_t get_page_entry(uint64_t *pml4_table, uint64_t virtual);
+uint64_t *pg_find_entry(uint64_t *pml4_table, uint64_t virtual);
+uint64_t *pg_create_entry(uint64_t *pml4_table, uint64_t virtual);
 uint64_t pg_virtual_to_phys(uint64_t *pml4_table, uint64_t virtual);
 
+// @returns NULL if there's no memory for a new table
 uint64_t *get_create_pmlt(uint64_t *pml_table, uint64_t pmlt_index,
                           uint64_t flags);
 
 void unmap_page(uint64_t *pml4_table, uint64_t virtual);
 void unmap_region(uint64_t *pml4_table, uint64_t virtual_start, uint64_t len);
 
-void map_phys_to_page(uint64_t *pml4_table, uint64_t physical, uint64_t virtual,
+// the map functions return false if there's no memory for the page tables
+bool map_phys_to_page(uint64_t *pml4_table, uint64_t physical, uint64_t virtual,
                       uint64_t flags);
-void map_region_to_page(uint64_t *pml4_table, uint64_t physical_start,
+bool map_region_to_page(uint64_t *pml4_table, uint64_t physical_start,
                         uint64_t virtual_start, uint64_t len, uint64_t flags);
 
-void copy_range_to_pagemap(uint64_t *dst_pml4, uint64_t *src_pml4,
+bool copy_range_to_pagemap(uint64_t *dst_pml4, uint64_t *src_pml4,
                            uint64_t virt_start, size_t len);
 
+// walks the page tables keeping track of the tables it went through, so bulk
+// maps and unmaps only walk down again when they cross into another table.
+// Changes go in `batch` until pg_cursor_flush()
+typedef struct pg_cursor {
+    uint64_t *pml4_table;
+    // tables[i] is the level i table (0 is the PML4) the cursor is in, NULL
+    // if none. Each one is the child of the one before
+    uint64_t *tables[4];
+    uint64_t bases[4]; // first address each of them maps
+
+    // tables to free once no TLB can reach them, linked by their first entry
+    uint64_t *freed;
+    tlb_batch_t batch;
+} pg_cursor_t;
+
+// @param pml4_table an HHDM address
+void pg_cursor_init(pg_cursor_t *cur, uint64_t *pml4_table);
+// @returns the 4KiB entry of `virtual`, NULL if there's no table for it or
+// it's in a huge page
+uint64_t *pg_cursor_find(pg_cursor_t *cur, uint64_t virtual);
+// @returns false if there's no memory for the page tables, what got mapped
+// up to there is still in the batch
+bool pg_cursor_map(pg_cursor_t *cur, uint64_t physical, uint64_t virtual,
+                   uint64_t len, uint64_t flags);
+// lower half tables that only map addresses in the range get freed too
+void pg_cursor_unmap(pg_cursor_t *cur, uint64_t virtual, uint64_t len);
+// commits the changes made so far and frees the tables that went away, the
+// cursor can keep going after that
+void pg_cursor_flush(pg_cursor_t *cur);
+
 void paging_init(uint64_t *kernel_pml4);
+
+#endif
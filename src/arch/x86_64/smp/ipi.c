@@ -48,8 +48,4 @@ void ipi_self(uint8_t vector) {
     uint32_t icr0 = vector | (0 << 8) | (0 << 11) | (1 << 14) | (0 << 15) |
                     (LDT_SEND_TO_US << 18);
     lapic_write_reg(LAPIC_ICR0_REG, icr0);
-}
-
-void tlb_shootdown(uint64_t virtual) {
-    ipi_broadcast(IPI_VECTOR_TLB_FLUSH);
 }
\ No newline at end of file
@@ -15,6 +15,4 @@ void ipi_send(uint8_t vector, uint8_t cpu);
 void ipi_broadcast(uint8_t vector);
 void ipi_self(uint8_t vector);
 
-void tlb_shootdown(uint64_t virtual);
-
 #endif // IPI_H
\ No newline at end of file
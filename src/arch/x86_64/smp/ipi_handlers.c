@@ -1,6 +1,5 @@
 #include <smp/ipi.h>
-
-#include <memory/vmm/vmm.h>
+#include <smp/tlb.h>
 
 #include <stdio.h>
 
@@ -28,13 +27,10 @@ void ipi_handler_halt(void *ctx) {
         asm("hlt");
 }
 
+// this one happens a lot, it stays quiet
 void ipi_handler_tlb_flush(void *ctx) {
-    uint64_t cpu = get_cpu();
-
-    debugf_debug("Processor %lu flushed TLB @ %llx\n", cpu,
-                 ((registers_t *)ctx)->rip);
-
-    asm("mov %0, %%cr3" : : "r"(get_current_ctx()->pml4_table));
+    (void)ctx;
+    tlb_flush_pending();
     lapic_send_eoi();
 }
 
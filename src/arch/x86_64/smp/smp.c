@@ -1,6 +1,7 @@
 #include <smp/smp.h>
 #include <tsc/tsc.h>
 
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -9,15 +10,23 @@
 #include <idt/idt.h>
 #include <interrupts/isr.h>
 #include <kernel.h>
-#include <memory/heap/kheap.h>
 #include <memory/vmm/vmm.h>
 #include <paging/paging.h>
 #include <scheduler/scheduler.h>
 #include <smp/ipi.h>
+#include <smp/tlb.h>
 
 #include <util/util.h>
 
-struct tlb_shootdown_event **events;
+// APs that were sent to mp_trampoline, and those that made it to the end
+static atomic_uint aps_started;
+static atomic_uint aps_ready;
+
+// work handed out by smp_run_on_all(), picked up when `work_gen` changes
+static smp_work_t ap_work;
+static void *ap_work_arg;
+static atomic_uint work_gen;
+static atomic_uint work_done;
 
 extern vmm_context_t *kernel_vmm_ctx;
 
@@ -32,10 +41,6 @@ int smp_init() {
         return 0;
     }
 
-    events = (struct tlb_shootdown_event **)kcalloc(
-        sizeof(struct tlb_shootdown_event *) * bootloader_data->cpu_count,
-        sizeof(struct tlb_shootdown_event));
-
     kprintf_info("SMP init: %d CPUs detected\n", bootloader_data->cpu_count);
     for (uint64_t i = 0; i < bootloader_data->cpu_count; i++) {
         struct limine_smp_info *cpu = bootloader_data->cpus[i];
@@ -47,6 +52,7 @@ int smp_init() {
 
         kprintf_info("Starting CPU %lu...\n", cpu->processor_id);
 
+        atomic_fetch_add(&aps_started, 1);
         cpu->goto_address = mp_trampoline;
     }
 
@@ -59,24 +65,58 @@ void mp_trampoline(struct limine_smp_info *cpu) {
     idt_init();
     isr_init();
 
-    vmm_switch_ctx(kernel_vmm_ctx);
-
     lapic_init();
 
+    // vmm_switch_ctx() needs the LAPIC ID to tell us apart from the BSP
+    vmm_switch_ctx(kernel_vmm_ctx);
+    _load_pml4(get_kernel_pml4());
+
     register_ipi();
 
     tsc_init();
 
     asm("sti");
+    tlb_cpu_init();
 
     lapic_timer_init();
 
     debugf_ok("CPU %lu initialized and ready.\n", lapic_get_id());
 
-    for (;;)
-        ;
+    unsigned int seen = atomic_load(&work_gen);
+    atomic_fetch_add(&aps_ready, 1);
+
+    for (;;) {
+        unsigned int gen = atomic_load(&work_gen);
+        if (gen == seen) {
+            asm("pause");
+            continue;
+        }
+
+        seen = gen;
+        ap_work(ap_work_arg);
+        atomic_fetch_add(&work_done, 1);
+    }
+}
+
+int smp_run_on_all(smp_work_t work, void *arg) {
+    unsigned int aps = atomic_load(&aps_started);
+    while (atomic_load(&aps_ready) < aps)
+        asm("pause");
+
+    ap_work     = work;
+    ap_work_arg = arg;
+    atomic_store(&work_done, 0);
+    atomic_fetch_add(&work_gen, 1);
+
+    work(arg);
+
+    while (atomic_load(&work_done) < aps)
+        asm("pause");
+
+    return aps + 1;
 }
 
+// the APIC ID lives in bits 24-31 of the LAPIC ID register
 uint8_t get_cpu() {
-    return lapic_get_id();
+    return lapic_get_id() >> 24;
 }
\ No newline at end of file
@@ -3,17 +3,16 @@
 
 #include <limine.h>
 
-
-struct tlb_shootdown_event {
-    uint64_t virtual;
-    uint64_t length;
-};
-
-extern struct tlb_shootdown_event **events;
+typedef void (*smp_work_t)(void *arg);
 
 int smp_init();
 void mp_trampoline(struct limine_smp_info *cpu);
 
+// runs `work` on the calling CPU and on every AP started by smp_init(), and
+// waits for all of them to return
+// @returns how many CPUs ran it
+int smp_run_on_all(smp_work_t work, void *arg);
+
 uint8_t get_cpu();
 
 #endif
\ No newline at end of file
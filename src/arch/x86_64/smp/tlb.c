@@ -0,0 +1,404 @@
+/*
+        TLB shootdowns
+
+        Page table changes are collected in a batch and flushed once, instead
+   of once for every page. Committing a batch flushes it on the calling CPU
+   and appends its ranges to the flush queue of every other CPU that might
+   have them cached: all of them for higher half addresses, only those in a
+   context using the same PML4 otherwise. Those CPUs get a flush IPI each,
+   and the commit only returns once they all acknowledged it.
+
+        A CPU flushes page by page with invlpg, unless there's more than
+   LIMIT_TLB_FLUSH_PAGES pages to flush or its queue overflowed, then it
+   drops the whole TLB of the context it's in. Kernel mappings are global
+   pages, so that takes toggling CR4.PGE when some of them changed.
+
+        Two CPUs could end up waiting for each other's acknowledgement with
+   interrupts off, so while waiting a CPU runs its own queue too.
+
+        PCIDs
+
+        When the CPU supports them, every CPU tags the TLB entries of the
+   address spaces it runs with one of LIMIT_TLB_PCIDS PCIDs, and tlb_switch()
+   keeps them around across CR3 loads. An address space that has no PCID
+   gets the one that was switched to the longest ago, each CPU counting its
+   switches as generations.
+
+        A CPU that switched away from an address space doesn't get flush IPIs
+   for it anymore, but it still has its translations. Committing a batch
+   takes the PML4's PCID away from every CPU that isn't in that address space,
+   so their next switch to it starts from an empty TLB. The ones that are keep
+   it and flush it when they get the IPI; if by then they already switched
+   away, they give up the PCID themselves.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "tlb.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <smp/ipi.h>
+#include <smp/smp.h>
+
+#include <memory/pmm/pmm.h>
+#include <memory/vmm/vmm.h>
+#include <paging/paging.h>
+
+#include <cpu.h>
+#include <spinlock.h>
+
+#include <util/util.h>
+
+#include <autoconf.h>
+
+#define CR3_NOFLUSH (1ull << 63) // keep what the TLB has for the new PCID
+
+typedef struct tlb_cpu {
+    // flushes other CPUs asked for
+    tlb_range_t ranges[LIMIT_TLB_QUEUE_RANGES];
+    size_t count;
+    bool flush_all;
+    bool global; // some of the ranges are kernel mappings
+
+    // PML4s the queued lower half flushes are for, since they only reach the
+    // PCID the CPU is on. Past LIMIT_TLB_PCIDS of them, all PCIDs go
+    uint64_t pml4s[LIMIT_TLB_PCIDS];
+    size_t pml4_count;
+
+    atomic_uint_fast64_t queued; // requests ever queued
+    atomic_uint_fast64_t done;   // requests flushed
+
+    bool online;
+    lock_t lock;
+
+    bool pcid; // CR4.PCIDE is set
+    // physical address of the PML4 PCID i + 1 belongs to, 0 if none. Other
+    // CPUs clear these when the translations go stale
+    _Atomic uint64_t pcid_pml4[LIMIT_TLB_PCIDS];
+    uint64_t pcid_gen[LIMIT_TLB_PCIDS]; // when each one was last switched to
+    uint64_t generation;
+} __attribute__((aligned(CACHE_LINE_SIZE))) tlb_cpu_t;
+
+// indexed by LAPIC ID
+static tlb_cpu_t cpus[LIMIT_CPU_MAX];
+
+// takes `pml4`'s PCID away from `cpu`. Without a `pml4`, every PCID but the
+// one of `keep` goes
+static void pcid_drop(size_t cpu, uint64_t pml4, uint64_t keep) {
+    if (!cpus[cpu].pcid)
+        return;
+
+    for (size_t i = 0; i < LIMIT_TLB_PCIDS; i++) {
+        uint64_t owner = atomic_load(&cpus[cpu].pcid_pml4[i]);
+        if (owner == 0 || owner == keep || (pml4 && owner != pml4))
+            continue;
+
+        atomic_compare_exchange_strong(&cpus[cpu].pcid_pml4[i], &owner, 0);
+    }
+}
+
+void tlb_cpu_init() {
+    uint8_t cpu = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX)
+        return;
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    // every x86_64 CPU has global pages
+    uint64_t cr4 = cpu_get_cr(4) | CR4_PGE;
+    // CR4.PCIDE can only be set while CR3 is on PCID 0
+    if (check_pcid() && (cpu_get_cr(3) & 0xfff) == 0) {
+        cr4            |= CR4_PCIDE;
+        cpus[cpu].pcid  = true;
+    }
+    cpu_set_cr(4, cr4);
+
+    cpus[cpu].online = true;
+
+    _set_cpu_flags(flags);
+
+    debugf_debug("CPU %hhu: PCIDs are %sin use\n", cpu,
+                 cpus[cpu].pcid ? "" : "not ");
+}
+
+void tlb_batch_begin(tlb_batch_t *batch, uint64_t *pml4_table) {
+    batch->pml4      = VIRT_TO_PHYSICAL(pml4_table);
+    batch->count     = 0;
+    batch->flush_all = false;
+    batch->kernel    = false;
+    batch->user      = false;
+}
+
+// @returns false if there's no room for another range
+static bool range_add(tlb_range_t *ranges, size_t *count, size_t max,
+                      uint64_t start, uint64_t pages) {
+    // maps and unmaps mostly go one page after the other
+    tlb_range_t *last = *count ? &ranges[*count - 1] : NULL;
+    if (last && last->start + last->pages * PFRAME_SIZE == start) {
+        last->pages += pages;
+        return true;
+    }
+
+    if (*count == max)
+        return false;
+
+    ranges[*count].start = start;
+    ranges[*count].pages = pages;
+    (*count)++;
+
+    return true;
+}
+
+void tlb_batch_add(tlb_batch_t *batch, uint64_t virtual, uint64_t length) {
+    uint64_t start = ROUND_DOWN(virtual, PFRAME_SIZE);
+    uint64_t pages =
+        (ROUND_UP(virtual + length, PFRAME_SIZE) - start) / PFRAME_SIZE;
+
+    if (start >= HIGHER_HALF)
+        batch->kernel = true;
+    else
+        batch->user = true;
+
+    if (!batch->flush_all &&
+        !range_add(batch->ranges, &batch->count, LIMIT_TLB_BATCH_RANGES, start,
+                   pages))
+        batch->flush_all = true;
+}
+
+// @param global whether some of the ranges are kernel mappings
+static void flush_ranges(tlb_range_t *ranges, size_t count, bool flush_all,
+                         bool global) {
+    size_t pages = 0;
+    for (size_t i = 0; i < count; i++)
+        pages += ranges[i].pages;
+
+    if (flush_all || pages > LIMIT_TLB_FLUSH_PAGES) {
+        uint64_t cr4 = cpu_get_cr(4);
+        if (global && (cr4 & CR4_PGE)) {
+            // the only way to drop global pages, it drops every PCID too
+            cpu_set_cr(4, cr4 & ~CR4_PGE);
+            cpu_set_cr(4, cr4);
+        } else {
+            // CR3 never reads back with the no-flush bit set
+            cpu_set_cr(3, cpu_get_cr(3));
+        }
+        return;
+    }
+
+    // invlpg drops global entries too
+    for (size_t i = 0; i < count; i++) {
+        for (uint64_t p = 0; p < ranges[i].pages; p++)
+            _invalidate(ranges[i].start + p * PFRAME_SIZE);
+    }
+}
+
+void tlb_flush_pending() {
+    uint8_t cpu = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX)
+        return;
+
+    tlb_cpu_t *c = &cpus[cpu];
+    tlb_range_t ranges[LIMIT_TLB_QUEUE_RANGES];
+    uint64_t pml4s[LIMIT_TLB_PCIDS];
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&c->lock);
+
+    size_t count      = c->count;
+    bool flush_all    = c->flush_all;
+    bool global       = c->global;
+    size_t pml4_count = c->pml4_count;
+    uint64_t seq      = atomic_load(&c->queued);
+    for (size_t i = 0; i < count; i++)
+        ranges[i] = c->ranges[i];
+    for (size_t i = 0; i < pml4_count && i < LIMIT_TLB_PCIDS; i++)
+        pml4s[i] = c->pml4s[i];
+
+    c->count      = 0;
+    c->flush_all  = false;
+    c->global     = false;
+    c->pml4_count = 0;
+
+    spinlock_release(&c->lock);
+
+    if (seq != atomic_load(&c->done)) {
+        flush_ranges(ranges, count, flush_all, global);
+
+        // the flush didn't reach the PCIDs we aren't on
+        uint64_t current = PG_GET_ADDR(cpu_get_cr(3));
+        if (pml4_count > LIMIT_TLB_PCIDS)
+            pcid_drop(cpu, 0, current);
+        for (size_t i = 0; i < pml4_count && i < LIMIT_TLB_PCIDS; i++) {
+            if (pml4s[i] != current)
+                pcid_drop(cpu, pml4s[i], 0);
+        }
+
+        atomic_store(&c->done, seq);
+    }
+
+    _set_cpu_flags(flags);
+}
+
+// @returns whether `cpu` is in the context using `pml4`
+static bool cpu_runs(uint8_t cpu, uint64_t pml4) {
+    vmm_context_t *ctx = get_cpu_ctx(cpu);
+    return ctx != NULL && VIRT_TO_PHYSICAL(ctx->pml4_table) == pml4;
+}
+
+// @returns whether `cpu` might have the batch's translations cached
+static bool cpu_uses(uint8_t cpu, tlb_batch_t *batch) {
+    return batch->kernel || cpu_runs(cpu, batch->pml4);
+}
+
+static void queue_batch(tlb_cpu_t *c, tlb_batch_t *batch) {
+    spinlock_acquire(&c->lock);
+
+    if (batch->flush_all)
+        c->flush_all = true;
+    if (batch->kernel)
+        c->global = true;
+    for (size_t i = 0; i < batch->count && !c->flush_all; i++) {
+        if (!range_add(c->ranges, &c->count, LIMIT_TLB_QUEUE_RANGES,
+                       batch->ranges[i].start, batch->ranges[i].pages))
+            c->flush_all = true;
+    }
+
+    if (batch->user || batch->flush_all) {
+        bool queued = false;
+        for (size_t i = 0; i < c->pml4_count && i < LIMIT_TLB_PCIDS; i++)
+            queued |= c->pml4s[i] == batch->pml4;
+
+        if (!queued) {
+            if (c->pml4_count < LIMIT_TLB_PCIDS)
+                c->pml4s[c->pml4_count] = batch->pml4;
+            c->pml4_count++;
+        }
+    }
+    atomic_fetch_add(&c->queued, 1);
+
+    spinlock_release(&c->lock);
+}
+
+void tlb_batch_commit(tlb_batch_t *batch) {
+    if (batch->count == 0 && !batch->flush_all)
+        return;
+
+    uint64_t targets[(LIMIT_CPU_MAX + 63) / 64] = {0};
+    uint64_t running[(LIMIT_CPU_MAX + 63) / 64] = {0};
+
+    // we can't be moved to another CPU halfway through
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    uint8_t self = get_cpu();
+    bool here    = PG_GET_ADDR(cpu_get_cr(3)) == batch->pml4;
+    if (batch->kernel || here)
+        flush_ranges(batch->ranges, batch->count, batch->flush_all,
+                     batch->kernel);
+
+    // CPUs in the context keep its PCID and flush it when they get the IPI,
+    // the flush above already took care of our own
+    if (batch->user || batch->flush_all) {
+        for (size_t cpu = 0; cpu < LIMIT_CPU_MAX; cpu++) {
+            if (cpu == self ? here : cpu_runs(cpu, batch->pml4))
+                running[cpu / 64] |= 1ull << (cpu % 64);
+            else
+                pcid_drop(cpu, batch->pml4, 0);
+        }
+    }
+
+    // a CPU switches context before loading CR3. Either we see it in the new
+    // context, or it will see the new page table entries and the PCIDs we
+    // took away. The ones we let keep theirs have to flush even if they left
+    // the context since
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (size_t cpu = 0; cpu < LIMIT_CPU_MAX; cpu++) {
+        bool kept = running[cpu / 64] & (1ull << (cpu % 64));
+        if (cpu == self || !cpus[cpu].online ||
+            !(kept || cpu_uses(cpu, batch)))
+            continue;
+
+        queue_batch(&cpus[cpu], batch);
+        ipi_send(IPI_VECTOR_TLB_FLUSH, cpu);
+        targets[cpu / 64] |= 1ull << (cpu % 64);
+    }
+
+    // a CPU flushes all it has queued at once, so it's done with our request
+    // once it catches up with whatever was queued by now
+    for (size_t cpu = 0; cpu < LIMIT_CPU_MAX; cpu++) {
+        if (!(targets[cpu / 64] & (1ull << (cpu % 64))))
+            continue;
+
+        tlb_cpu_t *c = &cpus[cpu];
+        while (atomic_load(&c->done) < atomic_load(&c->queued)) {
+            tlb_flush_pending();
+            asm("pause");
+        }
+    }
+
+    _set_cpu_flags(flags);
+}
+
+void tlb_shootdown(uint64_t *pml4_table, uint64_t virtual) {
+    tlb_batch_t batch;
+    tlb_batch_begin(&batch, pml4_table);
+    tlb_batch_add(&batch, virtual, PFRAME_SIZE);
+    tlb_batch_commit(&batch);
+}
+
+void tlb_switch(uint64_t *pml4_table) {
+    uint64_t pml4 = VIRT_TO_PHYSICAL(pml4_table);
+    uint8_t cpu   = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX || !cpus[cpu].pcid) {
+        _load_pml4((uint64_t *)pml4);
+        return;
+    }
+
+    tlb_cpu_t *c = &cpus[cpu];
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    // pairs with the fence in tlb_batch_commit()
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // our own PCID if we still have one, else a free one or the oldest
+    size_t slot     = 0;
+    uint64_t oldest = UINT64_MAX;
+    bool kept       = false;
+    for (size_t i = 0; i < LIMIT_TLB_PCIDS; i++) {
+        uint64_t owner = atomic_load(&c->pcid_pml4[i]);
+        if (owner == pml4) {
+            slot = i;
+            kept = true;
+            break;
+        }
+
+        uint64_t gen = owner ? c->pcid_gen[i] : 0;
+        if (gen < oldest) {
+            oldest = gen;
+            slot   = i;
+        }
+    }
+
+    c->pcid_gen[slot] = ++c->generation;
+
+    uint64_t cr3 = pml4 | (slot + 1);
+    if (kept)
+        cr3 |= CR3_NOFLUSH;
+    else
+        atomic_store(&c->pcid_pml4[slot], pml4);
+    cpu_set_cr(3, cr3);
+
+    _set_cpu_flags(flags);
+}
+
+void tlb_forget(uint64_t *pml4_table) {
+    for (size_t cpu = 0; cpu < LIMIT_CPU_MAX; cpu++)
+        pcid_drop(cpu, VIRT_TO_PHYSICAL(pml4_table), 0);
+}
@@ -0,0 +1,51 @@
+#ifndef TLB_H
+#define TLB_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits.h>
+
+typedef struct tlb_range {
+    uint64_t start;
+    uint64_t pages;
+} tlb_range_t;
+
+// page table changes to flush from the TLBs, all made to the same PML4
+typedef struct tlb_batch {
+    uint64_t pml4; // physical address
+
+    tlb_range_t ranges[LIMIT_TLB_BATCH_RANGES];
+    size_t count;
+
+    bool flush_all; // too many ranges to keep track of
+    bool kernel;    // some of them are in the higher half, every CPU has it
+    bool user;      // some of them aren't
+} tlb_batch_t;
+
+// enables global pages and PCIDs, and marks the calling CPU as ready to take
+// flush requests
+// @note CR3 has to be on PCID 0 for PCIDs to be enabled
+void tlb_cpu_init();
+
+// @param pml4_table either a physical or an HHDM address
+void tlb_batch_begin(tlb_batch_t *batch, uint64_t *pml4_table);
+void tlb_batch_add(tlb_batch_t *batch, uint64_t virtual, uint64_t length);
+// flushes the batch here and on every CPU using the PML4, and waits for all
+// of them to be done
+void tlb_batch_commit(tlb_batch_t *batch);
+
+// flushes a single page everywhere it's needed
+void tlb_shootdown(uint64_t *pml4_table, uint64_t virtual);
+
+// runs the flushes other CPUs queued for this one
+void tlb_flush_pending();
+
+// loads `pml4_table` into CR3, keeping whatever the TLB still has of it
+// @note call vmm_switch_ctx() first, or this CPU could miss flushes for it
+void tlb_switch(uint64_t *pml4_table);
+// call before freeing a PML4, so its PCIDs don't outlive it
+void tlb_forget(uint64_t *pml4_table);
+
+#endif
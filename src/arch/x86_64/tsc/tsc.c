@@ -79,6 +79,10 @@ uint64_t get_cpu_freq_msr() {
     return tsc_diff;
 }
 
+uint64_t tsc_get_freq() {
+    return cpu_frequency_hz1;
+}
+
 void tsc_init() {
     isr_registerHandler(238, tsc_tick_handler);
 
@@ -12,6 +12,8 @@ extern uint64_t _get_tsc();
 void tsc_tick_handler(void *ctx);
 void tsc_sleep(uint64_t microseconds);
 uint64_t get_cpu_freq_msr();
+// @returns how many times a second the TSC ticks, 0 before tsc_init()
+uint64_t tsc_get_freq();
 
 void tsc_init();
 
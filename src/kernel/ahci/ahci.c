@@ -3,6 +3,9 @@
 #include <stdio.h>
 #include <util/string.h>
 
+#include <memory/dma/dma.h>
+#include <memory/pmm/pmm.h>
+
 void probe_port(HBA_MEM *abar)
 {
     uint32_t pi = abar->pi;
@@ -60,28 +63,68 @@ static int check_type(HBA_PORT *port)
     }
 }
 
+// the HBA only knows about physical addresses, split in two halves
+static void *hba_to_virt(uint32_t low, uint32_t high)
+{
+    uint64_t phys = ((uint64_t)high << 32) | low;
+    return (void *)PHYS_TO_VIRTUAL(phys);
+}
+
 void port_rebase(HBA_PORT *port, int portno)
 {
     stop_cmd(port);
-    port->clb = AHCI_BASE + (portno << 10);
-    port->clbu = 0;
-    memset((void *)(port->clb), 0, 1024);
-    port->fb = AHCI_BASE + (32 << 10) + (portno << 8);
-    port->fbu = 0;
-    memset((void *)(port->fb), 0, 256);
-
-    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)(port->clb);
-    for (int i = 0; i < 32; i++)
+
+    // command list (1K), received FIS (256 bytes), then the command tables
+    uint64_t phys;
+    uint8_t *mem = dma_alloc_coherent(AHCI_PORT_MEM_SIZE, &phys);
+    if (mem == NULL)
     {
-        cmdheader[i].prdtl = 8;
-        cmdheader[i].ctba = AHCI_BASE + (40 << 10) + (portno << 13) + (i << 8);
-        cmdheader[i].ctbau = 0;
-        memset((void *)cmdheader[i].ctba, 0, 256);
+        kprintf_warn("No DMA memory left for AHCI port %d\n", portno);
+        return;
+    }
+
+    port->clb = (uint32_t)phys;
+    port->clbu = (uint32_t)(phys >> 32);
+    port->fb = (uint32_t)(phys + 1024);
+    port->fbu = (uint32_t)((phys + 1024) >> 32);
+
+    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)mem;
+    for (int i = 0; i < CMD_SLOTS; i++)
+    {
+        uint64_t ctba = phys + 1024 + 256 + i * AHCI_CMD_TBL_SIZE;
+        cmdheader[i].prdtl = AHCI_PRDT_ENTRIES;
+        cmdheader[i].ctba = (uint32_t)ctba;
+        cmdheader[i].ctbau = (uint32_t)(ctba >> 32);
     }
 
     start_cmd(port);
 }
 
+// 16 sectors (8KiB) per entry, the last one takes what's left
+// @param buf has to come from dma_alloc_coherent()
+static bool fill_prdt(HBA_CMD_TBL *cmdtbl, uint16_t prdtl, void *buf, uint32_t count)
+{
+    if (prdtl > AHCI_PRDT_ENTRIES)
+    {
+        debugf_warn("Can't transfer %u sectors at once\n", count);
+        return false;
+    }
+
+    uint64_t phys = VIRT_TO_PHYSICAL(buf);
+    for (int i = 0; i < prdtl; i++)
+    {
+        uint32_t sectors = i < prdtl - 1 ? 16 : count;
+        cmdtbl->prdt_entry[i].dba = (uint32_t)phys;
+        cmdtbl->prdt_entry[i].dbau = (uint32_t)(phys >> 32);
+        cmdtbl->prdt_entry[i].dbc = (sectors << 9) - 1;
+        cmdtbl->prdt_entry[i].i = 1;
+        phys += sectors << 9;
+        count -= sectors;
+    }
+
+    return true;
+}
+
 void start_cmd(HBA_PORT *port)
 {
     while (port->cmd & HBA_PxCMD_CR)
@@ -112,28 +155,17 @@ bool READ(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint
     if (slot == -1)
         return false;
 
-    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)port->clb;
+    HBA_CMD_HEADER *cmdheader = hba_to_virt(port->clb, port->clbu);
     cmdheader += slot;
     cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
     cmdheader->w = 0;
     cmdheader->prdtl = (uint16_t)((count - 1) >> 4) + 1;
 
-    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL *)(cmdheader->ctba);
-    memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) + (cmdheader->prdtl - 1) * sizeof(HBA_PRDT_ENTRY));
-
-    for (int i = 0; i < cmdheader->prdtl - 1; i++)
-    {
-        cmdtbl->prdt_entry[i].dba = (uint32_t)buf;
-        cmdtbl->prdt_entry[i].dbc = 8 * 1024 - 1;
-        cmdtbl->prdt_entry[i].i = 1;
-        buf += 4 * 1024;
-        count -= 16;
-    }
+    HBA_CMD_TBL *cmdtbl = hba_to_virt(cmdheader->ctba, cmdheader->ctbau);
+    memset(cmdtbl, 0, AHCI_CMD_TBL_SIZE);
 
-    int i;
-    cmdtbl->prdt_entry[i].dba = (uint32_t)buf;
-    cmdtbl->prdt_entry[i].dbc = (count << 9) - 1;
-    cmdtbl->prdt_entry[i].i = 1;
+    if (!fill_prdt(cmdtbl, cmdheader->prdtl, buf, count))
+        return false;
 
     FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
     cmdfis->fis_type = FIS_TYPE_REG_H2D;
@@ -211,11 +243,13 @@ void detect_disk(HBA_MEM *abar)
     probe_port(abar);
 }
 
+// @param buffer has to come from dma_alloc_coherent()
 bool ahci_read(HBA_PORT *port, uint64_t lba, uint32_t count, void *buffer)
 {
     return READ(port, (uint32_t)lba, (uint32_t)(lba >> 32), count, (uint16_t *)buffer);
 }
 
+// @param buffer has to come from dma_alloc_coherent()
 bool ahci_write(HBA_PORT *port, uint64_t lba, uint32_t count, void *buffer)
 {
     port->is = (uint32_t)-1;
@@ -223,27 +257,17 @@ bool ahci_write(HBA_PORT *port, uint64_t lba, uint32_t count, void *buffer)
     if (slot == -1)
         return false;
 
-    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)port->clb;
+    HBA_CMD_HEADER *cmdheader = hba_to_virt(port->clb, port->clbu);
     cmdheader += slot;
     cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
     cmdheader->w = 1;
     cmdheader->prdtl = (uint16_t)((count - 1) >> 4) + 1;
 
-    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL *)(cmdheader->ctba);
-    memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) + (cmdheader->prdtl - 1) * sizeof(HBA_PRDT_ENTRY));
-
-    for (int i = 0; i < cmdheader->prdtl - 1; i++)
-    {
-        cmdtbl->prdt_entry[i].dba = (uint32_t)buffer;
-        cmdtbl->prdt_entry[i].dbc = 8 * 1024 - 1;
-        cmdtbl->prdt_entry[i].i = 1;
-        buffer += 4 * 1024;
-        count -= 16;
-    }
+    HBA_CMD_TBL *cmdtbl = hba_to_virt(cmdheader->ctba, cmdheader->ctbau);
+    memset(cmdtbl, 0, AHCI_CMD_TBL_SIZE);
 
-    cmdtbl->prdt_entry[cmdheader->prdtl - 1].dba = (uint32_t)buffer;
-    cmdtbl->prdt_entry[cmdheader->prdtl - 1].dbc = (count << 9) - 1;
-    cmdtbl->prdt_entry[cmdheader->prdtl - 1].i = 1;
+    if (!fill_prdt(cmdtbl, cmdheader->prdtl, buffer, count))
+        return false;
 
     FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
     cmdfis->fis_type = FIS_TYPE_REG_H2D;
@@ -291,7 +315,10 @@ void test_ahci_operations(HBA_MEM *abar)
 {
     detect_disk(abar);
 
-    char buffer[512] = {0};
+    char *buffer = dma_alloc_coherent(512, NULL);
+    if (buffer == NULL)
+        return;
+
     if (ahci_read(&abar->ports[0], 0, 1, buffer))
         debugf_debug("Read successful!\n");
     else
@@ -302,4 +329,6 @@ void test_ahci_operations(HBA_MEM *abar)
         debugf_debug("Write successful!\n");
     else
         debugf_warn("Write failed!\n");
+
+    dma_free_coherent(buffer, 512);
 }
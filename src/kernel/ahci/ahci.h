@@ -16,7 +16,6 @@
 #define HBA_PORT_IPM_ACTIVE 1
 #define HBA_PORT_DET_PRESENT 3
 #define ATA_CMD_READ_DMA_EX 0x25
-#define AHCI_BASE 0x400000
 #define HBA_PxCMD_ST 0x0001
 #define HBA_PxCMD_FRE 0x0010
 #define HBA_PxCMD_FR 0x4000
@@ -25,6 +24,9 @@
 #define ATA_DEV_DRQ 0x08
 #define CMD_SLOTS 32
 #define ATA_CMD_IDENTIFY 0xEC
+#define AHCI_PRDT_ENTRIES 8
+#define AHCI_CMD_TBL_SIZE (0x80 + AHCI_PRDT_ENTRIES * 16)
+#define AHCI_PORT_MEM_SIZE (1024 + 256 + CMD_SLOTS * AHCI_CMD_TBL_SIZE)
 
 typedef enum
 {
@@ -1,12 +1,28 @@
 #include "device.h"
 
-#include <memory/heap/kheap.h>
+#include <memory/slab/slab.h>
 #include <stdio.h>
 #include <util/string.h>
 
 static device_t *device_table[DEVICES_MAX];
 static int device_count = 0;
 
+static kmem_cache_t *device_cache;
+
+extern void _hcf();
+
+void device_init() {
+    device_cache = kmem_cache_create("device", sizeof(device_t), 0, NULL);
+    if (device_cache == NULL) {
+        kprintf_panic("Couldn't create the device cache!\n");
+        _hcf();
+    }
+}
+
+device_t *device_alloc() {
+    return kmem_cache_zalloc(device_cache);
+}
+
 int register_device(device_t *dev) {
     if (device_count >= DEVICES_MAX) {
         kprintf_warn("Device table full!\n");
@@ -35,7 +51,7 @@ int unregister_device(const char *name) {
         return -1;
     }
 
-    kfree(dev);
+    kmem_cache_free(device_cache, dev);
 
     return 0;
 }
@@ -22,6 +22,11 @@ typedef struct device {
     void *data;
 } device_t;
 
+// creates the cache devices come from, before any device_alloc()
+void device_init();
+
+// @returns a zeroed device_t, NULL if there's no memory for it
+device_t *device_alloc();
 int register_device(device_t *dev);
 device_t *get_device(const char *name);
 int unregister_device(const char *name);
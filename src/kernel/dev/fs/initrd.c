@@ -2,7 +2,7 @@
 #include <memory/heap/kheap.h>
 
 void dev_initrd_init(void *ramfs_disk) {
-    device_t *dev = kmalloc(sizeof(device_t));
+    device_t *dev = device_alloc();
     memcpy(dev->name, "initrd", DEVICE_NAME_MAX);
     dev->type  = DEVICE_TYPE_BLOCK;
     dev->read  = dev_initrd_read;
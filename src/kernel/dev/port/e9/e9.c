@@ -1,7 +1,7 @@
 #include "e9.h"
 
 void dev_e9_init() {
-    device_t *dev = kmalloc(sizeof(device_t));
+    device_t *dev = device_alloc();
     memcpy(dev->name, "e9", DEVICE_NAME_MAX);
     dev->type  = DEVICE_TYPE_CHAR;
     dev->read  = dev_e9_read;
@@ -78,7 +78,7 @@ void dev_parallel_init() {
         memcpy(lpt1_info, "lpt1;spp", sizeof(lpt1_info));
     }
 
-    device_t *lpt1 = kmalloc(sizeof(device_t));
+    device_t *lpt1 = device_alloc();
     memcpy(lpt1->name, "lpt1", DEVICE_NAME_MAX);
     lpt1->type  = DEVICE_TYPE_CHAR;
     lpt1->read  = dev_lpt1_read;
@@ -79,7 +79,7 @@ int com1_ioctl(struct device *dev, int request, void *arg) {
 void dev_serial_init() {
     serial_init(COM1);
 
-    device_t *dev = kmalloc(sizeof(device_t));
+    device_t *dev = device_alloc();
     memcpy(dev->name, "com1", DEVICE_NAME_MAX);
     dev->write = com1_write;
     dev->read  = com1_read;
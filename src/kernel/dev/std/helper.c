@@ -1,7 +1,15 @@
 #include "helper.h"
 
+#include "kheapprof/kheapprof.h"
 #include "null/null.h"
+#include "pmmstat/pmmstat.h"
+
+#include <autoconf.h>
 
 void register_std_devices() {
     dev_null_init();
+    dev_pmmstat_init();
+#ifdef CONFIG_KHEAP_PROFILE
+    dev_kheapprof_init();
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+#include "kheapprof.h"
+
+#include <memory/heap/kheap_profile.h>
+
+#include <autoconf.h>
+
+// the profiler is only there with CONFIG_KHEAP_PROFILE
+#ifdef CONFIG_KHEAP_PROFILE
+
+void dev_kheapprof_init() {
+    device_t *dev = device_alloc();
+    memcpy(dev->name, "kheapprof", DEVICE_NAME_MAX);
+    dev->type  = DEVICE_TYPE_CHAR;
+    dev->read  = dev_kheapprof_read;
+    dev->write = dev_kheapprof_write;
+    dev->ioctl = dev_kheapprof_ioctl;
+    dev->data  = NULL;
+    register_device(dev);
+}
+
+// every read takes a fresh snapshot of the per call site statistics
+// @returns how many bytes of the report were copied
+int dev_kheapprof_read(struct device *dev, void *buffer, size_t size,
+                       size_t offset) {
+    (void)dev;
+
+    char *report = kmalloc(KHEAP_PROFILE_REPORT_SIZE);
+    if (report == NULL)
+        return 0;
+
+    size_t len = kheap_profile_format(report, KHEAP_PROFILE_REPORT_SIZE);
+    if (len >= KHEAP_PROFILE_REPORT_SIZE)
+        len = KHEAP_PROFILE_REPORT_SIZE - 1;
+
+    size_t count = 0;
+    if (offset < len) {
+        count = len - offset < size ? len - offset : size;
+        memcpy(buffer, report + offset, count);
+    }
+
+    kfree(report);
+    return count;
+}
+
+// writing anything dumps the report over debugcon
+int dev_kheapprof_write(struct device *dev, const void *buffer, size_t size,
+                        size_t offset) {
+    (void)dev;
+    (void)buffer;
+    (void)offset;
+
+    kheap_profile_dump();
+    return size;
+}
+
+int dev_kheapprof_ioctl(struct device *dev, int request, void *arg) {
+    (void)dev;
+    (void)request;
+    (void)arg;
+    return 0;
+}
+
+#endif // CONFIG_KHEAP_PROFILE
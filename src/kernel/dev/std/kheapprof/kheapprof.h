@@ -0,0 +1,17 @@
+#ifndef DEV_KHEAPPROF_H
+#define DEV_KHEAPPROF_H
+
+#include <dev/device.h>
+#include <memory/heap/kheap.h>
+#include <stddef.h>
+#include <util/string.h>
+
+void dev_kheapprof_init();
+
+int dev_kheapprof_read(struct device *dev, void *buffer, size_t size,
+                       size_t offset);
+int dev_kheapprof_write(struct device *dev, const void *buffer, size_t size,
+                        size_t offset);
+int dev_kheapprof_ioctl(struct device *dev, int request, void *arg);
+
+#endif // DEV_KHEAPPROF_H
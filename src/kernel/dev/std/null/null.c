@@ -1,7 +1,7 @@
 #include "null.h"
 
 void dev_null_init() {
-    device_t *dev = kmalloc(sizeof(device_t));
+    device_t *dev = device_alloc();
     memcpy(dev->name, "null", DEVICE_NAME_MAX);
     dev->type  = DEVICE_TYPE_CHAR;
     dev->read  = dev_null_read;
@@ -0,0 +1,54 @@
+#include "pmmstat.h"
+
+#include <memory/pmm/pmm.h>
+
+void dev_pmmstat_init() {
+    device_t *dev = device_alloc();
+    memcpy(dev->name, "pmmstat", DEVICE_NAME_MAX);
+    dev->type  = DEVICE_TYPE_CHAR;
+    dev->read  = dev_pmmstat_read;
+    dev->write = dev_pmmstat_write;
+    dev->ioctl = dev_pmmstat_ioctl;
+    dev->data  = NULL;
+    register_device(dev);
+}
+
+// every read takes a fresh snapshot of the PMM statistics
+// @returns how many bytes of the report were copied
+int dev_pmmstat_read(struct device *dev, void *buffer, size_t size,
+                     size_t offset) {
+    (void)dev;
+
+    char *report = kmalloc(PMM_STATS_REPORT_SIZE);
+    if (report == NULL)
+        return 0;
+
+    size_t len = pmm_stats_format(report, PMM_STATS_REPORT_SIZE);
+    if (len >= PMM_STATS_REPORT_SIZE)
+        len = PMM_STATS_REPORT_SIZE - 1;
+
+    size_t count = 0;
+    if (offset < len) {
+        count = len - offset < size ? len - offset : size;
+        memcpy(buffer, report + offset, count);
+    }
+
+    kfree(report);
+    return count;
+}
+
+int dev_pmmstat_write(struct device *dev, const void *buffer, size_t size,
+                      size_t offset) {
+    (void)dev;
+    (void)buffer;
+    (void)size;
+    (void)offset;
+    return 0;
+}
+
+int dev_pmmstat_ioctl(struct device *dev, int request, void *arg) {
+    (void)dev;
+    (void)request;
+    (void)arg;
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef DEV_PMMSTAT_H
+#define DEV_PMMSTAT_H
+
+#include <dev/device.h>
+#include <memory/heap/kheap.h>
+#include <stddef.h>
+#include <util/string.h>
+
+void dev_pmmstat_init();
+
+int dev_pmmstat_read(struct device *dev, void *buffer, size_t size,
+                     size_t offset);
+int dev_pmmstat_write(struct device *dev, const void *buffer, size_t size,
+                      size_t offset);
+int dev_pmmstat_ioctl(struct device *dev, int request, void *arg);
+
+#endif // DEV_PMMSTAT_H
@@ -44,7 +44,11 @@ static int fake_write(fs_node_t *node, const char *buf, size_t len,
 
     size_t new_size = offset + len;
     if (new_size > data->size) {
-        data->content = krealloc(data->content, new_size);
+        char *content = krealloc(data->content, new_size);
+        if (!content)
+            return -1;
+
+        data->content = content;
         data->size    = new_size;
     }
 
@@ -57,7 +61,7 @@ static int fake_mkdir(fs_node_t *dir, const char *name, int flags) {
         return -1;
     if (avl_find(dir->children, (void *)name))
         return -1;
-    fs_node_t *child = kcalloc(1, sizeof(fs_node_t));
+    fs_node_t *child = vfs_node_alloc();
     child->name      = strdup(name);
     child->type      = VDIR;
     child->ops       = dir->ops;
@@ -83,7 +87,7 @@ static int fake_unlink(fs_node_t *dir, const char *name) {
     if (child->type == VDIR && child->children) {
         // TODO: recursively free children
     }
-    kfree(child);
+    vfs_node_free(child);
     return 0;
 }
 
@@ -104,7 +108,7 @@ static int fake_create_node(fs_vfs_t *vfs, fs_node_t *dir, const char *name,
         return -1;
     if (avl_find(dir->children, (void *)name))
         return -1;
-    fs_node_t *child = kcalloc(1, sizeof(fs_node_t));
+    fs_node_t *child = vfs_node_alloc();
     child->name      = strdup(name);
     child->type      = type;
     child->ops       = dir->ops;
@@ -172,7 +176,7 @@ fs_vfs_t *fakefs_create(void) {
     vfs->type     = FS_TMP;
     vfs->ops      = &fake_vfs_ops;
 
-    fs_node_t *root = kcalloc(1, sizeof(fs_node_t));
+    fs_node_t *root = vfs_node_alloc();
     root->name      = strdup("/");
     root->type      = VDIR;
     root->ops       = &fake_node_ops;
@@ -1,5 +1,6 @@
 #include "ustar.h"
 
+#include <memory/arena/arena.h>
 #include <memory/heap/kheap.h>
 
 #include <util/string.h>
@@ -59,9 +60,24 @@ ustar_fs_t *ramfs_init(void *ramfs) {
     return ustar_structure;
 }
 
+// room for a handful of matches on the stack, lookups that find more than that
+// spill to the heap
+#define USTAR_SCRATCH_SIZE 64
+
+// matches are collected in a scratch arena first, so that the array we return
+// gets allocated only once, with the right size
+typedef struct ustar_match {
+    ustar_file_t *file;
+    struct ustar_match *next;
+} ustar_match_t;
+
 // returns a struct with all the found files
 ustar_file_tree_t *file_lookup(ustar_fs_t *fs, char *path) {
-    ustar_file_t **found_files = kmalloc(sizeof(ustar_file_t));
+    uint8_t scratch_buf[USTAR_SCRATCH_SIZE];
+    arena_t scratch;
+    arena_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
+    ustar_match_t *matches = NULL;
     ustar_file_header *file_header;
     size_t found       = 0;
     ustar_file_t *file = NULL;
@@ -100,13 +116,25 @@ ustar_file_tree_t *file_lookup(ustar_fs_t *fs, char *path) {
             break;
         }
 
-        // we found a file, we're going to save it to our array
+        // we found a file, we're going to save it to our list
+        ustar_match_t *match = arena_alloc(&scratch, sizeof(ustar_match_t));
+        if (!match)
+            break;
+        match->file = file;
+        match->next = matches;
+        matches     = match;
         found++;
-        found_files = krealloc(found_files, sizeof(ustar_file_t) * found);
-
-        found_files[found - 1] = file;
     }
 
+    // the list is in reverse order
+    ustar_file_t **found_files = kmalloc(sizeof(ustar_file_t *) * found);
+    if (!found_files)
+        found = 0;
+    for (size_t i = found; i > 0; i--, matches = matches->next)
+        found_files[i - 1] = matches->file;
+
+    arena_destroy(&scratch);
+
     ustar_file_tree_t *file_tree = kmalloc(sizeof(ustar_file_tree_t));
     file_tree->count             = found;
     file_tree->found_files       = found_files;
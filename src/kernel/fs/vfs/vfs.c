@@ -1,10 +1,22 @@
 #include "vfs.h"
+#include <memory/arena/arena.h>
 #include <memory/heap/kheap.h>
+#include <memory/slab/slab.h>
 #include <util/string.h>
 
+#include <stdio.h>
+
+// paths are copied to the stack as long as they fit in here, longer ones go to
+// the heap. Process stacks are a single page, so this only has to fit the
+// paths we actually see
+#define VFS_SCRATCH_SIZE 64
+
 static fs_node_t *vfs_root_node = NULL;
 static AVLTree *vfs_mount_table = NULL;
 
+static kmem_cache_t *node_cache = NULL;
+static kmem_cache_t *file_cache = NULL;
+
 static int vfs_mount_compare(const void *a, const void *b) {
     return strcmp((const char *)a, (const char *)b);
 }
@@ -13,6 +25,26 @@ fs_node_t *vfs_root(void) {
     return vfs_root_node;
 }
 
+extern void _hcf();
+
+void vfs_init(void) {
+    node_cache = kmem_cache_create("fs_node", sizeof(fs_node_t), 0, NULL);
+    file_cache =
+        kmem_cache_create("fs_open_file", sizeof(fs_open_file_t), 0, NULL);
+    if (node_cache == NULL || file_cache == NULL) {
+        kprintf_panic("Couldn't create the VFS caches!\n");
+        _hcf();
+    }
+}
+
+fs_node_t *vfs_node_alloc(void) {
+    return kmem_cache_zalloc(node_cache);
+}
+
+void vfs_node_free(fs_node_t *node) {
+    kmem_cache_free(node_cache, node);
+}
+
 int vfs_register(fs_vfs_t *vfs) {
     if (!vfs_mount_table)
         vfs_mount_table = avl_create(vfs_mount_compare);
@@ -60,37 +92,66 @@ static fs_mount_t *vfs_resolve_mount(const char *path) {
     return best;
 }
 
-int vfs_lookup(const char *path, fs_node_t **out) {
-    fs_mount_t *mnt = vfs_resolve_mount(path);
-    if (!mnt)
-        return -1;
-    fs_node_t *current = mnt->node;
-    char *dup          = strdup(path + strlen(mnt->prefix));
-    char *token        = strtok(dup, "/");
+// @param path gets cut up by strtok()
+static int vfs_walk(fs_node_t *current, char *path, fs_node_t **out) {
+    char *token = strtok(path, "/");
     while (token) {
-        if (!current->ops || !current->ops->lookup) {
-            kfree(dup);
+        if (!current->ops || !current->ops->lookup)
             return -1;
-        }
-        if (current->ops->lookup(current, token, &current) != 0) {
-            kfree(dup);
+        if (current->ops->lookup(current, token, &current) != 0)
             return -1;
-        }
         token = strtok(NULL, "/");
     }
     *out = current;
-    kfree(dup);
     return 0;
 }
 
+// splits a copy of `path` into its parent directory and its last component
+// @returns the parent, NULL if `path` doesn't have one
+static char *vfs_split_path(arena_t *scratch, const char *path, char **base) {
+    char *dup = arena_strdup(scratch, path);
+    if (!dup)
+        return NULL;
+    char *slash = strrchr(dup, '/');
+    if (!slash || slash == dup)
+        return NULL;
+    *slash = 0;
+    *base  = slash + 1;
+    return dup;
+}
+
+// copies `path` to the caller's arena, so that lookups done on behalf of
+// another VFS call don't stack a second scratch buffer on top of its own
+static int vfs_lookup_in(arena_t *scratch, const char *path, fs_node_t **out) {
+    fs_mount_t *mnt = vfs_resolve_mount(path);
+    if (!mnt)
+        return -1;
+
+    char *dup = arena_strdup(scratch, path + strlen(mnt->prefix));
+    return dup ? vfs_walk(mnt->node, dup, out) : -1;
+}
+
+int vfs_lookup(const char *path, fs_node_t **out) {
+    uint8_t scratch_buf[VFS_SCRATCH_SIZE];
+    arena_t scratch;
+    arena_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
+    int res = vfs_lookup_in(&scratch, path, out);
+
+    arena_destroy(&scratch);
+    return res;
+}
+
 int vfs_open(const char *path, int flags, fs_open_file_t **out) {
     fs_node_t *node;
     if (vfs_lookup(path, &node) != 0)
         return -1;
-    fs_open_file_t *file = kmalloc(sizeof(fs_open_file_t));
-    file->node           = node;
-    file->offset         = 0;
-    file->flags          = flags;
+    fs_open_file_t *file = kmem_cache_zalloc(file_cache);
+    if (!file)
+        return -1;
+    file->node   = node;
+    file->offset = 0;
+    file->flags  = flags;
     if (node->ops && node->ops->open)
         node->ops->open(node, file);
     *out = file;
@@ -100,7 +161,7 @@ int vfs_open(const char *path, int flags, fs_open_file_t **out) {
 int vfs_close(fs_open_file_t *file) {
     if (file->node->ops && file->node->ops->close)
         file->node->ops->close(file->node, file);
-    kfree(file);
+    kmem_cache_free(file_cache, file);
     return 0;
 }
 
@@ -138,72 +199,58 @@ int vfs_stat(const char *path, stat_t *st) {
 }
 
 int vfs_mkdir(const char *path, int flags) {
+    uint8_t scratch_buf[VFS_SCRATCH_SIZE];
+    arena_t scratch;
+    arena_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
     fs_node_t *dir;
-    char *dup  = strdup(path);
-    char *base = strrchr(dup, '/');
-    if (!base || base == dup)
-        return -1;
-    *base = 0;
-    base++;
-    if (vfs_lookup(dup, &dir) != 0) {
-        kfree(dup);
-        return -1;
-    }
-    if (!dir->ops || !dir->ops->mkdir) {
-        kfree(dup);
-        return -1;
-    }
-    int res = dir->ops->mkdir(dir, base, flags);
-    kfree(dup);
+    char *base;
+    char *parent = vfs_split_path(&scratch, path, &base);
+
+    int res = -1;
+    if (parent && vfs_lookup_in(&scratch, parent, &dir) == 0 && dir->ops &&
+        dir->ops->mkdir)
+        res = dir->ops->mkdir(dir, base, flags);
+
+    arena_destroy(&scratch);
     return res;
 }
 
 int vfs_unlink(const char *path) {
+    uint8_t scratch_buf[VFS_SCRATCH_SIZE];
+    arena_t scratch;
+    arena_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
     fs_node_t *dir;
-    char *dup  = strdup(path);
-    char *base = strrchr(dup, '/');
-    if (!base || base == dup)
-        return -1;
-    *base = 0;
-    base++;
-    if (vfs_lookup(dup, &dir) != 0) {
-        kfree(dup);
-        return -1;
-    }
-    if (!dir->ops || !dir->ops->unlink) {
-        kfree(dup);
-        return -1;
-    }
-    int res = dir->ops->unlink(dir, base);
-    kfree(dup);
+    char *base;
+    char *parent = vfs_split_path(&scratch, path, &base);
+
+    int res = -1;
+    if (parent && vfs_lookup_in(&scratch, parent, &dir) == 0 && dir->ops &&
+        dir->ops->unlink)
+        res = dir->ops->unlink(dir, base);
+
+    arena_destroy(&scratch);
     return res;
 }
 
 int vfs_rename(const char *oldpath, const char *newpath) {
+    uint8_t scratch_buf[VFS_SCRATCH_SIZE];
+    arena_t scratch;
+    arena_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
     fs_node_t *old_dir, *new_dir;
-    char *old      = strdup(oldpath);
-    char *new      = strdup(newpath);
-    char *old_base = strrchr(old, '/');
-    char *new_base = strrchr(new, '/');
-    if (!old_base || !new_base)
-        return -1;
-    *old_base = 0;
-    *new_base = 0;
-    old_base++;
-    new_base++;
-    if (vfs_lookup(old, &old_dir) != 0 || vfs_lookup(new, &new_dir) != 0) {
-        kfree(old);
-        kfree(new);
-        return -1;
-    }
-    if (!old_dir->ops || !old_dir->ops->rename) {
-        kfree(old);
-        kfree(new);
-        return -1;
-    }
-    int res = old_dir->ops->rename(old_dir, old_base, new_dir, new_base);
-    kfree(old);
-    kfree(new);
+    char *old_base, *new_base;
+    char *old = vfs_split_path(&scratch, oldpath, &old_base);
+    char *new = vfs_split_path(&scratch, newpath, &new_base);
+
+    int res = -1;
+    if (old && new && vfs_lookup_in(&scratch, old, &old_dir) == 0 &&
+        vfs_lookup_in(&scratch, new, &new_dir) == 0 && old_dir->ops &&
+        old_dir->ops->rename)
+        res = old_dir->ops->rename(old_dir, old_base, new_dir, new_base);
+
+    arena_destroy(&scratch);
     return res;
 }
 
@@ -219,33 +266,20 @@ int vfs_sync(void) {
 }
 
 int vfs_create(const char *path, fs_node_type type, int flags) {
+    uint8_t scratch_buf[VFS_SCRATCH_SIZE];
+    arena_t scratch;
+    arena_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
     fs_node_t *parent;
-    char *dup  = strdup(path);
-    char *name = strrchr(dup, '/');
-    if (!name || name == dup) {
-        kfree(dup);
-        return -1;
-    }
-    *name = 0;
-    name++;
-    if (strlen(name) == 0) {
-        kfree(dup);
-        return -1;
-    }
-    if (vfs_lookup(dup, &parent) != 0) {
-        kfree(dup);
-        return -1;
-    }
-    if (parent->vfs && parent->vfs->ops && parent->vfs->ops->create) {
-        if (parent->vfs->ops->create(parent->vfs, parent, name, type, flags) !=
-            0) {
-            kfree(dup);
-            return -1;
-        }
-    } else {
-        kfree(dup);
-        return -1;
-    }
-    kfree(dup);
-    return 0;
-}
\ No newline at end of file
+    char *name;
+    char *dir = vfs_split_path(&scratch, path, &name);
+
+    int res = -1;
+    if (dir && strlen(name) > 0 && vfs_lookup_in(&scratch, dir, &parent) == 0 &&
+        parent->vfs && parent->vfs->ops && parent->vfs->ops->create &&
+        parent->vfs->ops->create(parent->vfs, parent, name, type, flags) == 0)
+        res = 0;
+
+    arena_destroy(&scratch);
+    return res;
+}
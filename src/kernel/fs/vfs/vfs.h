@@ -131,6 +131,9 @@ typedef struct stat {
     uint64_t st_ctime; // Last status change time
 } stat_t;
 
+// creates the caches nodes and open files come from, before anything else
+void vfs_init(void);
+
 // Core VFS functions
 int vfs_register(fs_vfs_t *vfs);
 int vfs_unregister(fs_vfs_t *vfs);
@@ -150,4 +153,8 @@ int vfs_sync(void);
 int vfs_create(const char *path, fs_node_type type, int flags);
 fs_node_t *vfs_root(void);
 
+// nodes for filesystems to fill in, zeroed
+fs_node_t *vfs_node_alloc(void);
+void vfs_node_free(fs_node_t *node);
+
 #endif // VFS_H
@@ -19,7 +19,12 @@
 #include <time.h>
 
 #include <memory/heap/kheap.h>
+#include <memory/heap/kheap_bench.h>
+#include <memory/heap/kheap_profile.h>
+#include <memory/percpu/percpu.h>
+#include <memory/pmm/numa.h>
 #include <memory/pmm/pmm.h>
+#include <memory/slab/slab.h>
 #include <memory/vmm/vma.h>
 #include <memory/vmm/vmm.h>
 #include <paging/paging.h>
@@ -27,6 +32,7 @@
 #include <scheduler/scheduler.h>
 #include <smp/ipi.h>
 #include <smp/smp.h>
+#include <smp/tlb.h>
 
 #include <acpi/acpi.h>
 
@@ -290,6 +296,11 @@ void kstart(void) {
     pmm_init();
     kprintf_ok("Initialized PMM\n");
 
+    kmem_cache_init();
+    avl_init();
+    device_init();
+    vfs_init();
+
     if (paging_mode_request.response == NULL) {
         kprintf_panic("We've got no paging!\n");
         _hcf();
@@ -316,6 +327,7 @@ void kstart(void) {
     uint64_t *kernel_pml4 = (uint64_t *)pmm_alloc_page();
     paging_init((uint64_t *)PHYS_TO_VIRTUAL(kernel_pml4));
 
+    vmm_caches_init();
     kernel_vmm_ctx = vmm_ctx_init(kernel_pml4, VMO_KERNEL_RW);
     vmm_init(kernel_vmm_ctx);
     vmm_switch_ctx(kernel_vmm_ctx);
@@ -357,6 +369,8 @@ void kstart(void) {
         }
     }
 
+    numa_init();
+
 #ifdef CONFIG_ENABLE_APIC
 #if defined(__x86_64__)
 #include <apic/ioapic/ioapic.h>
@@ -378,6 +392,9 @@ void kstart(void) {
 #endif
 #endif
 
+    // CR3 is still on PCID 0, and get_cpu() knows who we are by now
+    tlb_cpu_init();
+
     {
         char *cpu_name = kmalloc(49);
 
@@ -482,7 +499,7 @@ void kstart(void) {
         kprintf_warn("Failed to create /myfile.txt\n");
     }
 
-    fs_open_file_t *file = kcalloc(1, sizeof(fs_open_file_t));
+    fs_open_file_t *file;
     if (vfs_open("/myfile.txt", 0, &file) == 0) {
         const char *text = "Hello, fakefs!";
         vfs_write(file, text, strlen(text));
@@ -505,6 +522,7 @@ void kstart(void) {
     device_t *dev_parallel = get_device("lpt1");
     device_t *dev_initrd   = get_device("initrd");
     device_t *dev_null     = get_device("null");
+    device_t *dev_pmmstat  = get_device("pmmstat");
 
 #ifdef CONFIG_DEVFS_ENABLE_E9
     // devfs_add_dev(dev_e9);
@@ -520,11 +538,29 @@ void kstart(void) {
 #ifdef CONFIG_DEVFS_ENABLE_NULL
     // devfs_add_dev(dev_null);
 #endif
+    // devfs_add_dev(dev_pmmstat);
 #endif
 
     limine_parsed_data.cpu_count = smp_request.response->cpu_count;
     limine_parsed_data.cpus      = smp_request.response->cpus;
 
+    percpu_init();
+    pmm_pcp_init();
+
+#ifdef CONFIG_PMM_DEBUG
+    pmm_stats_dump();
+    kmem_cache_dump();
+#endif
+
+#ifdef CONFIG_KHEAP_BENCH
+    smp_init();
+    kheap_bench();
+#endif
+
+#ifdef CONFIG_KHEAP_PROFILE
+    kheap_profile_dump();
+#endif
+
     scheduler_init();
 
     // smp_init();
@@ -0,0 +1,124 @@
+/*
+        Arena allocator
+
+        For short-lived allocations that all die together: allocating bumps a
+   pointer, and arena_reset() or arena_destroy() give everything back at once.
+   There's no way to free a single allocation.
+
+        An arena can start out on memory it's given, usually a small array on
+   the caller's stack, so that the common case doesn't touch the heap at all.
+   When that runs out, or for arenas made by arena_create(), memory comes
+   from the heap in chunks of at least `chunk_size` bytes.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "arena.h"
+
+#include <memory/heap/kheap.h>
+
+#include <util/string.h>
+#include <util/util.h>
+
+static void arena_use(arena_t *arena, uint8_t *start, uint8_t *end) {
+    arena->cur = (uint8_t *)ROUND_UP((uintptr_t)start, ARENA_ALIGN);
+    arena->end = end;
+    if (arena->cur > arena->end)
+        arena->cur = arena->end;
+}
+
+static void arena_rewind(arena_t *arena) {
+    if (arena->chunks)
+        arena_use(arena, arena->chunks->data,
+                  arena->chunks->data + arena->chunks->size);
+    else
+        arena_use(arena, arena->base, arena->base + arena->base_size);
+}
+
+void arena_init(arena_t *arena, void *buf, size_t size) {
+    memset(arena, 0, sizeof(arena_t));
+    arena->base       = buf;
+    arena->base_size  = buf ? size : 0;
+    arena->chunk_size = ARENA_CHUNK_SIZE;
+    arena_rewind(arena);
+}
+
+arena_t *arena_create(size_t chunk_size) {
+    arena_t *arena = kmalloc(sizeof(arena_t));
+    if (arena == NULL)
+        return NULL;
+
+    arena_init(arena, NULL, 0);
+    arena->heap = true;
+    if (chunk_size > 0)
+        arena->chunk_size = chunk_size;
+
+    return arena;
+}
+
+// @returns false if the heap is out of memory
+static bool arena_grow(arena_t *arena, size_t size) {
+    size_t chunk_size = sizeof(arena_chunk_t) + size;
+    if (chunk_size < arena->chunk_size)
+        chunk_size = arena->chunk_size;
+
+    arena_chunk_t *chunk = kmalloc(chunk_size);
+    if (chunk == NULL)
+        return false;
+
+    chunk->next   = arena->chunks;
+    chunk->size   = chunk_size - sizeof(arena_chunk_t);
+    arena->chunks = chunk;
+    arena_rewind(arena);
+
+    return true;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = ROUND_UP(size, ARENA_ALIGN);
+    if (size > (size_t)(arena->end - arena->cur) && !arena_grow(arena, size))
+        return NULL;
+
+    void *ptr   = arena->cur;
+    arena->cur += size;
+    return ptr;
+}
+
+char *arena_strdup(arena_t *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *dup  = arena_alloc(arena, len);
+    if (dup)
+        memcpy(dup, str, len);
+
+    return dup;
+}
+
+// arenas without memory of their own keep their first chunk, so that reusing
+// them doesn't go to the heap every time
+void arena_reset(arena_t *arena) {
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        if (next == NULL && arena->base == NULL)
+            break;
+
+        kfree(chunk);
+        chunk = next;
+    }
+
+    arena->chunks = chunk;
+    arena_rewind(arena);
+}
+
+void arena_destroy(arena_t *arena) {
+    while (arena->chunks) {
+        arena_chunk_t *next = arena->chunks->next;
+        kfree(arena->chunks);
+        arena->chunks = next;
+    }
+
+    if (arena->heap)
+        kfree(arena);
+    else
+        arena_rewind(arena);
+}
@@ -0,0 +1,47 @@
+#ifndef ARENA_H
+#define ARENA_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN      16   // every allocation is aligned to this
+#define ARENA_CHUNK_SIZE 4096 // what an arena grows by when it runs out
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size; // usable bytes after the header
+    uint8_t data[];
+} arena_chunk_t;
+
+typedef struct arena {
+    uint8_t *cur; // next free byte
+    uint8_t *end;
+
+    arena_chunk_t *chunks; // taken from the heap, newest first
+
+    // the memory the arena was given by arena_init(), if any
+    uint8_t *base;
+    size_t base_size;
+
+    size_t chunk_size;
+    bool heap; // made by arena_create()
+} arena_t;
+
+// sets up an arena over `buf` (for example an array on the stack), which
+// only goes to the heap once `buf` is full
+void arena_init(arena_t *arena, void *buf, size_t size);
+// @param chunk_size 0 for ARENA_CHUNK_SIZE
+// @returns NULL if there's no memory for the arena itself
+arena_t *arena_create(size_t chunk_size);
+
+// @returns NULL if the arena needed to grow and the heap is out of memory
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+
+// frees everything allocated from the arena at once
+void arena_reset(arena_t *arena);
+// frees the arena's memory, and the arena itself if arena_create() made it
+void arena_destroy(arena_t *arena);
+
+#endif
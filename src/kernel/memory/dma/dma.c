@@ -0,0 +1,47 @@
+/*
+        DMA buffers
+
+        Buffers come from the PMM's DMA zone, so they are physically
+   contiguous and sit below 4GiB. They are handed out through the HHDM: x86
+   keeps DMA coherent with the caches, so the regular write-back mapping is
+   fine and there's nothing to flush before or after a transfer.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "dma.h"
+
+#include <memory/pmm/pmm.h>
+
+#include <util/util.h>
+
+#include <stdio.h>
+
+/*
+        Allocates a zeroed buffer that devices can access.
+   Buffers are page aligned (and so cache line aligned too).
+
+        @param phys where to store the physical address for the device
+        @returns the HHDM address for the CPU, NULL if the DMA zone is full
+*/
+void *dma_alloc_coherent(size_t size, uint64_t *phys) {
+    if (size == 0)
+        return NULL;
+
+    void *frames = pmm_alloc_dma(ROUND_UP(size, PFRAME_SIZE) / PFRAME_SIZE);
+    if (frames == NULL)
+        return NULL;
+
+    if (phys)
+        *phys = (uint64_t)frames;
+
+    return (void *)PHYS_TO_VIRTUAL(frames);
+}
+
+// @param size the same size passed to dma_alloc_coherent()
+void dma_free_coherent(void *virt, size_t size) {
+    if (virt == NULL)
+        return;
+
+    pmm_free(virt, ROUND_UP(size, PFRAME_SIZE) / PFRAME_SIZE);
+}
@@ -0,0 +1,10 @@
+#ifndef DMA_H
+#define DMA_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+void *dma_alloc_coherent(size_t size, uint64_t *phys);
+void dma_free_coherent(void *virt, size_t size);
+
+#endif
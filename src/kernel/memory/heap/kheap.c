@@ -1,213 +1,677 @@
+/*
+        Kernel heap
+
+        Small allocations (up to KHEAP_MAX_SMALL bytes) come in power of two
+   size classes. Objects of a class are carved out of spans, runs of
+   KHEAP_SPAN_PAGES pages, and carry no header: every frame of a span has
+   PAGE_KHEAP set, and page_t.private pointing to the per-CPU cache of the CPU
+   that carved it (its "home"), which tells kfree() both the size class and
+   where the object belongs.
+
+        Every CPU keeps a magazine of free objects per size class, only ever
+   touched by that CPU with interrupts disabled, so the common kmalloc() and
+   kfree() take no lock at all. Magazines are refilled from and flushed to a
+   per-class depot in batches, and the depot carves new spans when it runs
+   dry.
+
+        An object freed by a CPU other than its home is pushed onto the home's
+   remote-free queue, a lock-free list the home drains on its next refill.
+   This way objects flow back to the CPU whose cache they are likely still
+   in, and nobody ever writes to another CPU's magazine.
+
+        Spans go back to the PMM only when asked: kheap_trim() frees those
+   whose objects are all sitting in a depot. Objects in a magazine or a
+   remote-free queue keep their span alive until kheap_drain_cpu() is run on
+   the CPU they belong to.
+
+        Anything bigger is rounded up to whole pages and handed out as is, page
+   aligned and without a header: the first frame has PAGE_KHEAP set too, and
+   its page_t.private holds the length of the allocation. Either way kfree()
+   knows what it's dealing with from a single page database lookup.
+
+        kmalloc_aligned() only has to pick the right size: small objects are
+   aligned to their size class, since spans are page aligned and classes are
+   powers of two, and buddy blocks are aligned to their own size too.
+
+        Allocations of exactly 2MiB or 1GiB get a huge frame from
+   pmm_alloc_huge(), so the HHDM maps them with a single huge page, and they
+   can still be had once physical memory is fragmented. Their first frame has
+   PAGE_HUGE set.
+
+        krealloc() resizes large allocations in place whenever the frames
+   after them are free. Since the heap lives in the HHDM there is no mapping
+   to move pages around in, so when they aren't the data gets copied.
+
+        All memory comes straight from the PMM, spans and large allocations
+   alike, and is accessed through the HHDM.
+
+        (C) RepubblicaTech 2024
+*/
+
 #include "kheap.h"
-#include "memory/vmm/vmm.h"
-#include <memory/vmm/vma.h>
+#include "kheap_profile.h"
+
+#include <memory/pmm/pmm.h>
+#include <smp/smp.h>
+
 #include <util/string.h>
+#include <util/util.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <cpu.h>
+#include <limits.h>
+#include <spinlock.h>
+
+#include <autoconf.h>
+
+#ifdef CONFIG_KHEAP_PROFILE
+#define PROFILE_ALLOC(ptr, size)                                               \
+    kheap_profile_alloc(ptr, size, __builtin_return_address(0))
+#define PROFILE_FREE(ptr) kheap_profile_free(ptr)
+#else
+#define PROFILE_ALLOC(ptr, size)
+#define PROFILE_FREE(ptr)
+#endif
+
+#define CLASS_SIZE(cls) ((size_t)KHEAP_MIN_SIZE << (cls))
+#define SPAN_SIZE       (KHEAP_SPAN_PAGES * PAGE_SIZE)
+
+// the free list link lives in the first word of a free object
+#define NEXT_FREE(obj) (*(void **)(obj))
+
+typedef struct kheap_cache {
+    void *objs[KHEAP_MAG_SIZE];
+    size_t count;
+
+    uint8_t cls;
+    uint8_t cpu;
+} kheap_cache_t;
 
-#define ALIGN8(x)      (((x) + 7) & ~7)
-#define MIN_BLOCK_SIZE 16
-#define MAX_BLOCK_SIZE (PAGE_SIZE * MAX_PAGES)
+typedef struct kheap_cpu {
+    kheap_cache_t caches[KHEAP_CLASS_COUNT];
+    heap_stats stats;
 
-typedef struct block_header {
-    struct block_header *next;
-    size_t size;
-    bool free;
-} block_header_t;
+    // written to by other CPUs, so it gets its own cache line
+    _Atomic(void *) remote[KHEAP_CLASS_COUNT] __attribute__((
+        aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE))) kheap_cpu_t;
 
-static block_header_t *free_lists[SIZE_CLASS_COUNT] = {0};
-static heap_stats stats                             = {0};
+// CPUs without a cache of their own go straight to the depot, and the spans
+// they carve belong to this extra entry
+#define KHEAP_NO_CPU LIMIT_CPU_MAX
+
+static kheap_cpu_t heap_cpus[LIMIT_CPU_MAX + 1];
+
+typedef struct kheap_depot {
+    lock_t lock;
+    void *head;
+    size_t count;
+} __attribute__((aligned(CACHE_LINE_SIZE))) kheap_depot_t;
+
+static kheap_depot_t depots[KHEAP_CLASS_COUNT];
+
+// page_t.private of the first frame of a large allocation holds its length
+// in pages, tagged with bit 0 so it can't be mistaken for the (aligned) home
+// pointer of a span frame
+#define LARGE_TAG(pages)  ((void *)(((uintptr_t)(pages) << 1) | 1))
+#define IS_LARGE(page)    ((uintptr_t)(page)->private & 1)
+#define LARGE_PAGES(page) ((uintptr_t)(page)->private >> 1)
+
+static size_t size_class(size_t size) {
+    size_t cls = 0;
+    while (CLASS_SIZE(cls) < size)
+        cls++;
+
+    return cls;
+}
+
+/*
+        Backend
+*/
+
+// heap memory is used through the HHDM, which already maps all of RAM, so
+// growing the heap never touches the page tables (and never needs a TLB
+// shootdown)
+static void *backend_alloc(size_t pages, bool zero) {
+    void *phys = zero ? pmm_alloc_pages(pages) : pmm_alloc_pages_nozero(pages);
+    if (phys == NULL)
+        return NULL;
+
+    page_tag(phys, pages, PAGE_OWNER_HEAP, 0);
+    return (void *)PHYS_TO_VIRTUAL(phys);
+}
+
+static void backend_free(void *ptr, size_t pages) {
+    pmm_free((void *)VIRT_TO_PHYSICAL(ptr), pages);
+}
+
+// @returns the descriptor of the frame `ptr` is in, or NULL if kmalloc()
+// didn't hand it out
+static page_t *heap_page(void *ptr) {
+    page_t *page = phys_to_page(ptr);
+    if (page == NULL || !(page->flags & PAGE_KHEAP))
+        return NULL;
+
+    return page;
+}
+
+static size_t alloc_size(page_t *page) {
+    if (IS_LARGE(page))
+        return LARGE_PAGES(page) * PAGE_SIZE;
+
+    return CLASS_SIZE(((kheap_cache_t *)page->private)->cls);
+}
 
-static inline size_t size_class_index(size_t size) {
-    size_t cls_size = MIN_BLOCK_SIZE;
-    for (size_t i = 0; i < SIZE_CLASS_COUNT; i++) {
-        if (size <= cls_size)
-            return i;
-        cls_size <<= 1;
+/*
+        Depot
+*/
+
+// @param count how many objects `head` holds
+static void depot_put(size_t cls, void *head, void *tail, size_t count) {
+    kheap_depot_t *depot = &depots[cls];
+
+    spinlock_acquire(&depot->lock);
+    NEXT_FREE(tail) = depot->head;
+    depot->head     = head;
+    depot->count   += count;
+    spinlock_release(&depot->lock);
+}
+
+// @returns how many objects were put in `objs`
+static size_t depot_take(size_t cls, void **objs, size_t max) {
+    kheap_depot_t *depot = &depots[cls];
+    size_t n             = 0;
+
+    spinlock_acquire(&depot->lock);
+    for (; n < max && depot->head; n++) {
+        objs[n]     = depot->head;
+        depot->head = NEXT_FREE(depot->head);
     }
-    return SIZE_CLASS_COUNT - 1;
+    depot->count -= n;
+    spinlock_release(&depot->lock);
+
+    return n;
 }
 
-static inline size_t size_class_size(size_t index) {
-    return MIN_BLOCK_SIZE << index;
+// hands the objects of a list we don't have room for to the depot
+static void depot_put_list(size_t cls, void *list) {
+    void *tail   = list;
+    size_t count = 1;
+    for (; NEXT_FREE(tail); tail = NEXT_FREE(tail))
+        count++;
+
+    depot_put(cls, list, tail, count);
 }
 
-static void add_block_to_free_list(block_header_t *block) {
-    size_t idx      = size_class_index(block->size);
-    block->free     = true;
-    block->next     = free_lists[idx];
-    free_lists[idx] = block;
+// carves a new span for `home`, puts up to `max` objects in `objs` and gives
+// the rest to the depot
+// @returns how many objects were put in `objs`
+static size_t span_carve(kheap_cache_t *home, void **objs, size_t max) {
+    // the objects get overwritten anyway, no need for zeroed frames
+    uint8_t *span = backend_alloc(KHEAP_SPAN_PAGES, false);
+    if (span == NULL)
+        return 0;
+
+    page_t *page = phys_to_page(span);
+    for (size_t i = 0; i < KHEAP_SPAN_PAGES; i++) {
+        page[i].flags  |= PAGE_KHEAP;
+        page[i].private = home;
+    }
+    heap_cpus[home->cpu].stats.current_pages_used += KHEAP_SPAN_PAGES;
+
+    size_t size  = CLASS_SIZE(home->cls);
+    size_t total = KHEAP_SPAN_PAGES * PAGE_SIZE / size;
+
+    size_t n = 0;
+    for (; n < max && n < total; n++)
+        objs[n] = span + n * size;
+
+    if (n < total) {
+        for (size_t i = n; i < total - 1; i++)
+            NEXT_FREE(span + i * size) = span + (i + 1) * size;
+
+        depot_put(home->cls, span + n * size, span + (total - 1) * size,
+                  total - n);
+    }
+
+    return n;
+}
+
+/*
+        Per-CPU caches
+*/
+
+// @note interrupts must be disabled
+static bool cache_refill(kheap_cache_t *c) {
+    // what other CPUs gave back comes first, it's ours anyway
+    void *list = atomic_exchange_explicit(&heap_cpus[c->cpu].remote[c->cls],
+                                          NULL, memory_order_acquire);
+    for (; list && c->count < KHEAP_MAG_SIZE; list = NEXT_FREE(list))
+        c->objs[c->count++] = list;
+    if (list)
+        depot_put_list(c->cls, list);
+
+    if (c->count == 0)
+        c->count = depot_take(c->cls, c->objs, KHEAP_MAG_BATCH);
+    if (c->count == 0)
+        c->count = span_carve(c, c->objs, KHEAP_MAG_BATCH);
+
+    return c->count > 0;
 }
 
-static void remove_block_from_free_list(block_header_t **list_head,
-                                        block_header_t *block) {
-    block_header_t *prev = NULL;
-    block_header_t *cur  = *list_head;
-    while (cur) {
-        if (cur == block) {
-            if (prev)
-                prev->next = cur->next;
-            else
-                *list_head = cur->next;
-            cur->next = NULL;
-            return;
+// @note interrupts must be disabled
+static void cache_flush(kheap_cache_t *c, size_t objects) {
+    if (objects > c->count)
+        objects = c->count;
+    if (objects == 0)
+        return;
+
+    void **batch = &c->objs[c->count - objects];
+    for (size_t i = 0; i < objects - 1; i++)
+        NEXT_FREE(batch[i]) = batch[i + 1];
+
+    depot_put(c->cls, batch[0], batch[objects - 1], objects);
+    c->count -= objects;
+}
+
+static void remote_free(kheap_cache_t *home, void *obj) {
+    _Atomic(void *) *queue = &heap_cpus[home->cpu].remote[home->cls];
+
+    void *head = atomic_load_explicit(queue, memory_order_relaxed);
+    do {
+        NEXT_FREE(obj) = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        queue, &head, obj, memory_order_release, memory_order_relaxed));
+}
+
+/*
+        Trimming
+*/
+
+// spans are buddy blocks of their own size, so they're aligned to it
+static page_t *span_head(void *obj) {
+    return phys_to_page((void *)ROUND_DOWN((uintptr_t)obj, SPAN_SIZE));
+}
+
+// the free objects of a span are counted in the buddy list link of its first
+// frame, which the PMM doesn't use while the frame is allocated
+#define SPAN_FREE(head) ((uintptr_t)(head)->next)
+
+// gives the spans whose objects are all in the depot of `cls` to the PMM
+// @returns how many spans were freed
+static size_t depot_trim(size_t cls) {
+    kheap_depot_t *depot = &depots[cls];
+    size_t total         = SPAN_SIZE / CLASS_SIZE(cls);
+    void *spans          = NULL; // linked through their first object
+
+    spinlock_acquire(&depot->lock);
+    for (void *obj = depot->head; obj; obj = NEXT_FREE(obj))
+        span_head(obj)->next = NULL;
+    for (void *obj = depot->head; obj; obj = NEXT_FREE(obj)) {
+        page_t *head = span_head(obj);
+        head->next   = (page_t *)(SPAN_FREE(head) + 1);
+    }
+
+    void **link = &depot->head;
+    while (*link) {
+        void *obj = *link;
+        if (SPAN_FREE(span_head(obj)) < total) {
+            link = &NEXT_FREE(obj);
+            continue;
+        }
+
+        *link = NEXT_FREE(obj);
+        depot->count--;
+
+        // the first object of a span sits at its very start
+        if (((uintptr_t)obj & (SPAN_SIZE - 1)) == 0) {
+            NEXT_FREE(obj) = spans;
+            spans          = obj;
         }
-        prev = cur;
-        cur  = cur->next;
     }
+    spinlock_release(&depot->lock);
+
+    size_t freed = 0;
+    while (spans) {
+        void *span = spans;
+        spans      = NEXT_FREE(span);
+        backend_free(span, KHEAP_SPAN_PAGES);
+        freed++;
+    }
+
+    return freed;
 }
 
-static block_header_t *split_block(block_header_t *block, size_t size) {
-    if (block->size >= size + sizeof(block_header_t) + MIN_BLOCK_SIZE) {
-        block_header_t *new_block =
-            (block_header_t *)((char *)(block + 1) + size);
-        new_block->size = block->size - size - sizeof(block_header_t);
-        new_block->free = true;
-        new_block->next = NULL;
-        block->size     = size;
-        add_block_to_free_list(new_block);
-        return block;
+/*
+        Small allocations
+*/
+
+static void *small_alloc(size_t cls) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    uint8_t cpu = get_cpu();
+    void *obj   = NULL;
+
+    if (cpu < LIMIT_CPU_MAX) {
+        kheap_cache_t *c = &heap_cpus[cpu].caches[cls];
+        if (c->count > 0 || cache_refill(c))
+            obj = c->objs[--c->count];
+    } else {
+        cpu = KHEAP_NO_CPU;
+        if (depot_take(cls, &obj, 1) == 0)
+            span_carve(&heap_cpus[KHEAP_NO_CPU].caches[cls], &obj, 1);
     }
-    return block;
+
+    if (obj) {
+        heap_cpus[cpu].stats.total_allocs++;
+        heap_cpus[cpu].stats.total_bytes_allocated += CLASS_SIZE(cls);
+    }
+
+    _set_cpu_flags(flags);
+    return obj;
 }
 
-static block_header_t *request_new_page(size_t size_class_idx) {
-    size_t block_size      = size_class_size(size_class_idx);
-    size_t blocks_per_page = PAGE_SIZE / (block_size + sizeof(block_header_t));
-    if (blocks_per_page == 0)
-        blocks_per_page = 1; // at least 1 block per page
+static void small_free(kheap_cache_t *home, void *obj) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
 
-    void *page = vma_alloc(get_current_ctx(), 1, NULL);
-    if (!page)
-        return NULL;
+    uint8_t cpu = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX)
+        cpu = KHEAP_NO_CPU;
+
+    if (home->cpu == KHEAP_NO_CPU) {
+        depot_put(home->cls, obj, obj, 1);
+    } else if (home->cpu == cpu) {
+        if (home->count == KHEAP_MAG_SIZE)
+            cache_flush(home, KHEAP_MAG_BATCH);
 
-    // Create blocks in page and add them to free list
-    char *ptr = (char *)page;
-    for (size_t i = 0; i < blocks_per_page; i++) {
-        block_header_t *block =
-            (block_header_t *)(ptr + i * (block_size + sizeof(block_header_t)));
-        block->size = block_size;
-        block->free = true;
-        block->next = NULL;
-        add_block_to_free_list(block);
-        stats.current_pages_used++;
+        home->objs[home->count++] = obj;
+    } else {
+        remote_free(home, obj);
     }
-    return free_lists[size_class_idx]; // return first free block in this size
-                                       // class
+
+    heap_cpus[cpu].stats.total_frees++;
+    heap_cpus[cpu].stats.total_bytes_freed += CLASS_SIZE(home->cls);
+
+    _set_cpu_flags(flags);
 }
 
-void kmalloc_init() {
-    memset(free_lists, 0, sizeof(free_lists));
-    memset(&stats, 0, sizeof(stats));
+/*
+        Large allocations
+*/
+
+static heap_stats *local_stats() {
+    uint8_t cpu = get_cpu();
+    return &heap_cpus[cpu < LIMIT_CPU_MAX ? cpu : KHEAP_NO_CPU].stats;
 }
 
-// Find suitable free block for size, or request page if none found
-static block_header_t *find_block(size_t size) {
-    size_t idx = size_class_index(size);
-    for (size_t i = idx; i < SIZE_CLASS_COUNT; i++) {
-        block_header_t *list = free_lists[i];
-        if (list) {
-            // take first block in list
-            remove_block_from_free_list(&free_lists[i], list);
-            if (list->size > size) {
-                // split block and add remainder back
-                split_block(list, size);
-            }
-            list->free = false;
-            return list;
+// large allocations are page aligned and have no header, their size is
+// kept in the page database
+// @param huge whether it can be a huge frame, those can't be shrunk
+static void *large_alloc(size_t size, bool huge) {
+    size_t pages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    size_t bytes = pages * PAGE_SIZE;
+
+    void *ptr;
+    if (huge && (bytes == PAGE_2M || bytes == PAGE_1G)) {
+        ptr = pmm_alloc_huge(bytes);
+        if (ptr != NULL) {
+            page_tag(ptr, pages, PAGE_OWNER_HEAP, 0);
+            ptr = (void *)PHYS_TO_VIRTUAL(ptr);
         }
-        // no free block in this class, try next larger size class
+    } else {
+        ptr = backend_alloc(pages, true);
     }
-    // no block found, request new page for requested size class
-    block_header_t *new_block = request_new_page(idx);
-    if (!new_block)
+    if (ptr == NULL)
         return NULL;
-    // allocate from new blocks
-    remove_block_from_free_list(&free_lists[idx], new_block);
-    new_block->free = false;
-    if (new_block->size > size) {
-        split_block(new_block, size);
+
+    page_t *page   = phys_to_page(ptr);
+    page->flags   |= PAGE_KHEAP;
+    page->private  = LARGE_TAG(pages);
+
+    uint64_t flags    = _get_cpu_flags();
+    asm("cli");
+    heap_stats *stats = local_stats();
+    stats->total_allocs++;
+    stats->total_bytes_allocated += pages * PAGE_SIZE;
+    stats->current_pages_used    += pages;
+    _set_cpu_flags(flags);
+
+    return ptr;
+}
+
+static void large_free(void *ptr, size_t pages) {
+    uint64_t flags    = _get_cpu_flags();
+    asm("cli");
+    heap_stats *stats = local_stats();
+    stats->total_frees++;
+    stats->total_bytes_freed  += pages * PAGE_SIZE;
+    stats->current_pages_used -= pages;
+    _set_cpu_flags(flags);
+
+    if (phys_to_page(ptr)->flags & PAGE_HUGE)
+        pmm_free_huge(ptr, pages * PAGE_SIZE);
+    else
+        backend_free(ptr, pages);
+}
+
+// grows or shrinks a large allocation without moving it. Since the tail of
+// a buddy block is given back as soon as it's allocated, the frames right
+// after a large allocation are often free, so growing in place works more
+// often than not
+// @returns false if the frames after it aren't free, or it's a huge frame
+static bool large_resize(void *ptr, page_t *page, size_t new_pages) {
+    size_t pages = LARGE_PAGES(page);
+    if (new_pages == pages)
+        return true;
+    if (page->flags & PAGE_HUGE)
+        return false;
+    if (new_pages > pages && !pmm_extend(ptr, pages, new_pages - pages))
+        return false;
+    if (new_pages < pages)
+        backend_free((uint8_t *)ptr + new_pages * PAGE_SIZE, pages - new_pages);
+
+    page->private = LARGE_TAG(new_pages);
+
+    uint64_t flags    = _get_cpu_flags();
+    asm("cli");
+    heap_stats *stats = local_stats();
+    if (new_pages > pages)
+        stats->total_bytes_allocated += (new_pages - pages) * PAGE_SIZE;
+    else
+        stats->total_bytes_freed += (pages - new_pages) * PAGE_SIZE;
+    stats->current_pages_used += new_pages - pages;
+    _set_cpu_flags(flags);
+
+    return true;
+}
+
+/*
+        Public interface
+*/
+
+void kmalloc_init() {
+    memset(heap_cpus, 0, sizeof(heap_cpus));
+    memset(depots, 0, sizeof(depots));
+
+    for (size_t cpu = 0; cpu <= LIMIT_CPU_MAX; cpu++) {
+        for (size_t cls = 0; cls < KHEAP_CLASS_COUNT; cls++) {
+            heap_cpus[cpu].caches[cls].cls = cls;
+            heap_cpus[cpu].caches[cls].cpu = cpu;
+        }
     }
-    return new_block;
 }
 
-void *kmalloc(size_t size) {
+static void *heap_alloc(size_t size) {
     if (size == 0)
         return NULL;
-    size = ALIGN8(size);
-    if (size > MAX_BLOCK_SIZE) {
-        // Large alloc: allocate whole pages
-        size_t pages =
-            (size + sizeof(block_header_t) + PAGE_SIZE - 1) / PAGE_SIZE;
-        void *ptr = vma_alloc(get_current_ctx(), pages, NULL);
-        if (!ptr)
-            return NULL;
-        // Use block header at start of allocated pages
-        block_header_t *block = (block_header_t *)ptr;
-        block->size           = pages * PAGE_SIZE - sizeof(block_header_t);
-        block->free           = false;
-        block->next           = NULL;
-        stats.total_allocs++;
-        stats.total_bytes_allocated += block->size;
-        stats.current_pages_used    += pages;
-        return block + 1;
-    }
-    block_header_t *block = find_block(size);
-    if (!block)
+
+    if (size > KHEAP_MAX_SMALL)
+        return large_alloc(size, true);
+
+    return small_alloc(size_class(size));
+}
+
+static void *heap_alloc_aligned(size_t size, size_t align) {
+    if (size == 0 || align == 0 || (align & (align - 1)) != 0)
         return NULL;
-    stats.total_allocs++;
-    stats.total_bytes_allocated += block->size;
-    return block + 1;
+
+    if (size <= KHEAP_MAX_SMALL && align <= KHEAP_MAX_SMALL)
+        return small_alloc(size_class(size > align ? size : align));
+    if (align <= PAGE_SIZE)
+        return large_alloc(size, true);
+
+    // a block at least `align` bytes long is aligned to it, and what we don't
+    // need of it goes back right away
+    size_t pages       = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    size_t align_pages = align / PAGE_SIZE;
+    if (pages >= align_pages)
+        return large_alloc(size, true);
+
+    // it's going to be trimmed, so not a huge frame
+    void *ptr = large_alloc(align, false);
+    if (ptr)
+        large_resize(ptr, phys_to_page(ptr), pages);
+
+    return ptr;
+}
+
+static void heap_free(void *ptr, page_t *page) {
+    if (IS_LARGE(page))
+        large_free(ptr, LARGE_PAGES(page));
+    else
+        small_free(page->private, ptr);
+}
+
+void *kmalloc(size_t size) {
+    void *ptr = heap_alloc(size);
+    PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
 void kfree(void *ptr) {
     if (!ptr)
         return;
-    block_header_t *block = ((block_header_t *)ptr) - 1;
-    if (block->free)
-        return;
-    size_t size = block->size;
-    block->free = true;
-    stats.total_frees++;
-    stats.total_bytes_freed += size;
-
-    if (size > MAX_BLOCK_SIZE / 2) {
-        size_t pages =
-            (size + sizeof(block_header_t) + PAGE_SIZE - 1) / PAGE_SIZE;
-        stats.current_pages_used -= pages;
-        vma_free(get_current_ctx(), block, true);
+
+    page_t *page = heap_page(ptr);
+    if (page == NULL) {
+        debugf_warn("Tried to free %p, which kmalloc() didn't hand out\n", ptr);
         return;
     }
 
-    add_block_to_free_list(block);
+    PROFILE_FREE(ptr);
+    heap_free(ptr, page);
 }
 
 void *kcalloc(size_t num, size_t size) {
+    if (size != 0 && num > SIZE_MAX / size)
+        return NULL;
+
     size_t total = num * size;
-    void *ptr    = kmalloc(total);
+    void *ptr    = heap_alloc(total);
     if (ptr)
         memset(ptr, 0, total);
+
+    PROFILE_ALLOC(ptr, total);
+    return ptr;
+}
+
+void *kmalloc_aligned(size_t size, size_t align) {
+    void *ptr = heap_alloc_aligned(size, align);
+    PROFILE_ALLOC(ptr, size);
     return ptr;
 }
 
 void *krealloc(void *ptr, size_t new_size) {
-    if (!ptr)
-        return kmalloc(new_size);
-    if (new_size == 0) {
-        kfree(ptr);
-        return NULL;
+    page_t *page = NULL;
+    if (ptr) {
+        page = heap_page(ptr);
+        if (page == NULL)
+            return NULL;
     }
-    block_header_t *block = ((block_header_t *)ptr) - 1;
-    if (block->size >= new_size)
-        return ptr;
 
-    void *new_ptr = kmalloc(new_size);
-    if (!new_ptr)
+    PROFILE_FREE(ptr);
+
+    void *new_ptr = ptr;
+    if (!ptr) {
+        new_ptr = heap_alloc(new_size);
+    } else if (new_size == 0) {
+        heap_free(ptr, page);
         return NULL;
-    memcpy(new_ptr, ptr, block->size);
-    kfree(ptr);
+    } else {
+        // size classes can't be split, so small objects only stay where they
+        // are if they're already big enough
+        size_t old_size  = alloc_size(page);
+        size_t new_pages = ROUND_UP(new_size, PAGE_SIZE) / PAGE_SIZE;
+        bool in_place    = IS_LARGE(page) ? large_resize(ptr, page, new_pages)
+                                          : old_size >= new_size;
+
+        if (!in_place) {
+            new_ptr = heap_alloc(new_size);
+            if (new_ptr) {
+                memcpy(new_ptr, ptr, old_size);
+                heap_free(ptr, page);
+            } else {
+                // the old allocation is still there
+                PROFILE_ALLOC(ptr, old_size);
+                return NULL;
+            }
+        }
+    }
+
+    PROFILE_ALLOC(new_ptr, new_size);
     return new_ptr;
 }
 
-// Optional: function to get stats pointer
+void kheap_drain_cpu() {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    uint8_t cpu = get_cpu();
+    for (size_t cls = 0; cpu < LIMIT_CPU_MAX && cls < KHEAP_CLASS_COUNT;
+         cls++) {
+        kheap_cache_t *c = &heap_cpus[cpu].caches[cls];
+        cache_flush(c, c->count);
+
+        void *list = atomic_exchange_explicit(&heap_cpus[cpu].remote[cls],
+                                              NULL, memory_order_acquire);
+        if (list)
+            depot_put_list(cls, list);
+    }
+
+    _set_cpu_flags(flags);
+}
+
+size_t kheap_trim() {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    size_t spans = 0;
+    for (size_t cls = 0; cls < KHEAP_CLASS_COUNT; cls++)
+        spans += depot_trim(cls);
+
+    // the per-CPU counters only mean something added together
+    local_stats()->current_pages_used -= spans * KHEAP_SPAN_PAGES;
+
+    _set_cpu_flags(flags);
+    return spans * KHEAP_SPAN_PAGES;
+}
+
 const heap_stats *kmalloc_get_stats(void) {
+    static heap_stats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    for (size_t cpu = 0; cpu <= LIMIT_CPU_MAX; cpu++) {
+        heap_stats *s                = &heap_cpus[cpu].stats;
+        stats.total_allocs          += s->total_allocs;
+        stats.total_frees           += s->total_frees;
+        stats.total_bytes_allocated += s->total_bytes_allocated;
+        stats.total_bytes_freed     += s->total_bytes_freed;
+        stats.current_pages_used    += s->current_pages_used;
+    }
+
     return &stats;
 }
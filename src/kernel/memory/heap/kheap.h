@@ -5,16 +5,35 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define PAGE_SIZE        4096
-#define MAX_PAGES        64
-#define SIZE_CLASS_COUNT 12
+#define PAGE_SIZE 4096
+
+// small allocations are rounded up to a power of two between these two sizes
+#define KHEAP_MIN_SIZE    16
+#define KHEAP_MAX_SMALL   2048
+#define KHEAP_CLASS_COUNT 8
+
+#define KHEAP_SPAN_PAGES 4  // small objects are carved out of runs this big
+#define KHEAP_MAG_SIZE   32 // objects each CPU keeps per size class
+#define KHEAP_MAG_BATCH  16 // objects moved to/from the depot at once
 
 void kmalloc_init();
 
+// small allocations are aligned to their size class, bigger ones to a page
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void *krealloc(void *ptr, size_t new_size);
 void *kcalloc(size_t num, size_t size);
+// @param align a power of two, up to the biggest buddy block
+// @note krealloc() doesn't keep the alignment
+void *kmalloc_aligned(size_t size, size_t align);
+
+// gives the objects the calling CPU has cached, or got back from other CPUs,
+// to the depots
+void kheap_drain_cpu();
+// gives the spans that have no object in use, or cached by a CPU, back to the
+// PMM
+// @returns how many pages were freed
+size_t kheap_trim();
 
 typedef struct heap_stats {
     size_t total_allocs;
@@ -24,6 +43,7 @@ typedef struct heap_stats {
     size_t current_pages_used;
 } heap_stats;
 
+// @returns the counters of all CPUs added together
 const heap_stats *kmalloc_get_stats(void);
 
 #endif // KMALLOC_H
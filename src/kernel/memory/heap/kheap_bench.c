@@ -0,0 +1,215 @@
+/*
+        Kernel heap microbenchmark
+
+        Every CPU first runs KHEAP_BENCH_OPS kmalloc()/kfree() pairs on its own
+   objects, which should never leave its magazines, then allocates a batch of
+   objects that its neighbour frees, so that everything goes through the
+   remote-free queues. Run it with more than one CPU, e.g.
+   `make run QEMU_SMP=8`. A CPU's neighbour is the next one in the order they
+   showed up in, LAPIC IDs don't have to be contiguous.
+
+        Last, the BSP grows a buffer to 1MiB with krealloc() 64 bytes at a
+   time, like fakefs does on every write, and the spans the bench carved are
+   given back to the PMM.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "kheap_bench.h"
+#include "kheap.h"
+
+#include <smp/smp.h>
+#include <tsc/tsc.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <util/string.h>
+
+#include <limits.h>
+
+#include <autoconf.h>
+
+#define KHEAP_BENCH_OPS    100000
+#define KHEAP_BENCH_LIVE   64   // objects each CPU keeps around at once
+#define KHEAP_BENCH_REMOTE 1024 // objects each CPU hands to its neighbour
+
+#define KHEAP_BENCH_APPEND_SIZE  (1024 * 1024)
+#define KHEAP_BENCH_APPEND_CHUNK 64
+
+typedef struct bench_cpu {
+    uint64_t local_cycles;
+    uint64_t remote_alloc_cycles;
+    uint64_t remote_free_cycles;
+    size_t failed;
+
+    void **remote; // what the neighbour is going to free
+    size_t remote_count;
+} bench_cpu_t;
+
+static bench_cpu_t bench_cpus[LIMIT_CPU_MAX];
+
+// the LAPIC IDs of the CPUs that ran bench_local()
+static uint8_t bench_online[LIMIT_CPU_MAX];
+static atomic_uint bench_online_count;
+
+// 16 to 2048 bytes, odd sizes included
+static size_t bench_size(size_t i) {
+    return (16 << (i % 8)) - (i % 3);
+}
+
+static void bench_local(void *arg) {
+    (void)arg;
+
+    uint8_t cpu = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX)
+        return;
+
+    bench_online[atomic_fetch_add(&bench_online_count, 1)] = cpu;
+
+    bench_cpu_t *b               = &bench_cpus[cpu];
+    void *live[KHEAP_BENCH_LIVE] = {0};
+
+    uint64_t start = _get_tsc();
+    for (size_t i = 0; i < KHEAP_BENCH_OPS; i++) {
+        size_t slot = i % KHEAP_BENCH_LIVE;
+        kfree(live[slot]);
+
+        live[slot] = kmalloc(bench_size(i));
+        if (live[slot] == NULL)
+            b->failed++;
+        else
+            *(uint8_t *)live[slot] = cpu;
+    }
+    for (size_t i = 0; i < KHEAP_BENCH_LIVE; i++)
+        kfree(live[i]);
+    b->local_cycles = _get_tsc() - start;
+}
+
+static void bench_remote_alloc(void *arg) {
+    (void)arg;
+
+    uint8_t cpu = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX)
+        return;
+
+    bench_cpu_t *b = &bench_cpus[cpu];
+    b->remote      = kmalloc(KHEAP_BENCH_REMOTE * sizeof(void *));
+    if (b->remote == NULL) {
+        b->failed++;
+        return;
+    }
+
+    uint64_t start = _get_tsc();
+    for (size_t i = 0; i < KHEAP_BENCH_REMOTE; i++) {
+        void *ptr = kmalloc(bench_size(i) / 4);
+        if (ptr == NULL) {
+            b->failed++;
+            continue;
+        }
+
+        b->remote[b->remote_count++] = ptr;
+    }
+    b->remote_alloc_cycles = _get_tsc() - start;
+}
+
+static void bench_remote_free(void *arg) {
+    (void)arg;
+
+    uint8_t cpu = get_cpu();
+    if (cpu >= LIMIT_CPU_MAX)
+        return;
+
+    unsigned int count = atomic_load(&bench_online_count);
+    unsigned int slot  = 0;
+    while (slot < count && bench_online[slot] != cpu)
+        slot++;
+    if (slot == count)
+        return;
+
+    bench_cpu_t *n = &bench_cpus[bench_online[(slot + 1) % count]];
+
+    uint64_t start = _get_tsc();
+    for (size_t i = 0; i < n->remote_count; i++)
+        kfree(n->remote[i]);
+    bench_cpus[cpu].remote_free_cycles = _get_tsc() - start;
+
+    kfree(n->remote);
+    n->remote       = NULL;
+    n->remote_count = 0;
+}
+
+static void bench_drain(void *arg) {
+    (void)arg;
+    kheap_drain_cpu();
+}
+
+static void bench_append() {
+    uint8_t chunk[KHEAP_BENCH_APPEND_CHUNK];
+    memset(chunk, 0x55, sizeof(chunk));
+
+    uint8_t *buf = NULL;
+    size_t moves = 0;
+
+    uint64_t start = _get_tsc();
+    for (size_t len = 0; len < KHEAP_BENCH_APPEND_SIZE;
+         len += KHEAP_BENCH_APPEND_CHUNK) {
+        uint8_t *new_buf = krealloc(buf, len + KHEAP_BENCH_APPEND_CHUNK);
+        if (new_buf == NULL) {
+            kprintf_warn("kheap bench: out of memory after %zu bytes\n", len);
+            kfree(buf);
+            return;
+        }
+
+        if (new_buf != buf)
+            moves++;
+        buf = new_buf;
+        memcpy(buf + len, chunk, KHEAP_BENCH_APPEND_CHUNK);
+    }
+    uint64_t cycles = _get_tsc() - start;
+
+    kfree(buf);
+
+    kprintf_info("kheap bench: 1MiB appended %d bytes at a time, %llu "
+                 "cycles/append, moved %zu times\n",
+                 KHEAP_BENCH_APPEND_CHUNK,
+                 cycles / (KHEAP_BENCH_APPEND_SIZE / KHEAP_BENCH_APPEND_CHUNK),
+                 moves);
+}
+
+void kheap_bench() {
+    const heap_stats *stats = kmalloc_get_stats();
+    size_t allocs_before    = stats->total_allocs;
+    size_t frees_before     = stats->total_frees;
+
+    atomic_store(&bench_online_count, 0);
+    smp_run_on_all(bench_local, NULL);
+    smp_run_on_all(bench_remote_alloc, NULL);
+    smp_run_on_all(bench_remote_free, NULL);
+
+    unsigned int cpus = atomic_load(&bench_online_count);
+    kprintf_info("kheap bench: %u CPUs, %d local ops and %d remote frees "
+                 "each\n",
+                 cpus, KHEAP_BENCH_OPS * 2, KHEAP_BENCH_REMOTE);
+    for (unsigned int i = 0; i < cpus; i++) {
+        bench_cpu_t *b = &bench_cpus[bench_online[i]];
+        kprintf_info("  CPU %u: %llu cycles/op local, %llu cycles/alloc, "
+                     "%llu cycles/remote free, %zu failed\n",
+                     bench_online[i], b->local_cycles / (KHEAP_BENCH_OPS * 2),
+                     b->remote_alloc_cycles / KHEAP_BENCH_REMOTE,
+                     b->remote_free_cycles / KHEAP_BENCH_REMOTE, b->failed);
+    }
+
+    stats = kmalloc_get_stats();
+    size_t allocs = stats->total_allocs - allocs_before;
+    size_t frees  = stats->total_frees - frees_before;
+    if (allocs != frees)
+        kprintf_warn("kheap bench: %zu allocations but %zu frees!\n", allocs,
+                     frees);
+
+    bench_append();
+
+    smp_run_on_all(bench_drain, NULL);
+    kprintf_info("kheap bench: gave %zu pages back to the PMM\n",
+                 kheap_trim());
+}
@@ -0,0 +1,7 @@
+#ifndef KHEAP_BENCH_H
+#define KHEAP_BENCH_H 1
+
+// multi-core kmalloc()/kfree() microbenchmark, needs smp_init() to have run
+void kheap_bench();
+
+#endif
@@ -0,0 +1,292 @@
+/*
+        Kernel heap allocation profiler
+
+        Every kmalloc() is attributed to its call site, the return address of
+   the kmalloc() call. Call sites live in a small open-addressing table that
+   is never shrunk, with their allocation/free counts, how many bytes they
+   currently hold and a histogram of the sizes they ask for.
+
+        To know who to charge a kfree() to, every live allocation has a record
+   in a second table, keyed by its address, with the call site and the size
+   that was asked for. Records are removed by shifting the ones after them
+   back, so lookups never have to skip over tombstones.
+
+        Neither table is allocated from the heap, so the profiler can't recurse
+   into itself. When one fills up, the allocations that don't fit are only
+   counted as dropped.
+
+        Only built with CONFIG_KHEAP_PROFILE: without it, kheap doesn't even
+   call in here.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "kheap_profile.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <cpu.h>
+#include <limits.h>
+#include <spinlock.h>
+#include <tsc/tsc.h>
+
+#include <autoconf.h>
+
+#ifdef CONFIG_KHEAP_PROFILE
+
+#define SITES_MASK  (LIMIT_KHEAP_PROFILE_SITES - 1)
+#define ALLOCS_MASK (LIMIT_KHEAP_PROFILE_ALLOCS - 1)
+
+typedef struct kheap_site {
+    uintptr_t caller; // 0 if the slot is empty
+
+    size_t allocs;
+    size_t frees;
+    size_t live_bytes;
+    size_t peak_bytes;
+    uint64_t first_tsc; // when the site allocated for the first time
+
+    // bucket n counts sizes up to 16 << n bytes, the last one everything else
+    size_t sizes[KHEAP_PROFILE_BUCKETS];
+} kheap_site_t;
+
+typedef struct kheap_alloc_rec {
+    uintptr_t ptr; // 0 if the slot is empty
+    uint32_t size;
+    uint16_t site;
+} kheap_alloc_rec_t;
+
+static kheap_site_t sites[LIMIT_KHEAP_PROFILE_SITES];
+static kheap_alloc_rec_t recs[LIMIT_KHEAP_PROFILE_ALLOCS];
+
+static size_t site_count;
+static size_t rec_count;
+static size_t dropped_sites;
+static size_t dropped_allocs;
+
+static lock_t profile_lock;
+
+static size_t hash(uintptr_t key) {
+    // objects are at least 16 bytes apart
+    return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+static size_t size_bucket(size_t size) {
+    size_t b = 0;
+    while (b < KHEAP_PROFILE_BUCKETS - 1 && ((size_t)16 << b) < size)
+        b++;
+
+    return b;
+}
+
+// @returns the index of the caller's slot, -1 if the table is full
+static int site_get(uintptr_t caller) {
+    size_t s = hash(caller) & SITES_MASK;
+    for (size_t i = 0; i < LIMIT_KHEAP_PROFILE_SITES;
+         i++, s = (s + 1) & SITES_MASK) {
+        if (sites[s].caller == caller)
+            return s;
+
+        if (sites[s].caller == 0) {
+            sites[s].caller     = caller;
+            sites[s].first_tsc = _get_tsc();
+            site_count++;
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+// @returns the index of the record of `ptr`, -1 if there's none
+static int rec_find(uintptr_t ptr) {
+    size_t r = hash(ptr) & ALLOCS_MASK;
+    for (size_t i = 0; i < LIMIT_KHEAP_PROFILE_ALLOCS;
+         i++, r = (r + 1) & ALLOCS_MASK) {
+        if (recs[r].ptr == ptr)
+            return r;
+        if (recs[r].ptr == 0)
+            return -1;
+    }
+
+    return -1;
+}
+
+static bool rec_insert(uintptr_t ptr, size_t size, size_t site) {
+    // past 3/4 full probing gets too slow, and rec_remove() needs at least one
+    // empty slot to stop at
+    if (rec_count >= LIMIT_KHEAP_PROFILE_ALLOCS / 4 * 3)
+        return false;
+
+    size_t r = hash(ptr) & ALLOCS_MASK;
+    for (size_t i = 0; i < LIMIT_KHEAP_PROFILE_ALLOCS;
+         i++, r = (r + 1) & ALLOCS_MASK) {
+        if (recs[r].ptr == 0) {
+            recs[r].ptr  = ptr;
+            recs[r].size = size > UINT32_MAX ? UINT32_MAX : size;
+            recs[r].site = site;
+            rec_count++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// removes a record, moving back the ones after it that would otherwise
+// become unreachable
+static void rec_remove(size_t r) {
+    size_t hole = r;
+    for (size_t i = (r + 1) & ALLOCS_MASK; recs[i].ptr != 0;
+         i = (i + 1) & ALLOCS_MASK) {
+        size_t home = hash(recs[i].ptr) & ALLOCS_MASK;
+
+        // the record can fill the hole if its home slot isn't between the
+        // hole and where it sits now
+        bool reachable = hole <= i ? (home > hole && home <= i)
+                                   : (home > hole || home <= i);
+        if (!reachable) {
+            recs[hole] = recs[i];
+            hole       = i;
+        }
+    }
+
+    recs[hole].ptr = 0;
+    rec_count--;
+}
+
+void kheap_profile_alloc(void *ptr, size_t size, void *caller) {
+    if (ptr == NULL)
+        return;
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&profile_lock);
+
+    int site = site_get((uintptr_t)caller);
+    if (site < 0) {
+        dropped_sites++;
+    } else if (!rec_insert((uintptr_t)ptr, size, site)) {
+        dropped_allocs++;
+    } else {
+        kheap_site_t *s = &sites[site];
+        s->allocs++;
+        s->sizes[size_bucket(size)]++;
+        s->live_bytes += size;
+        if (s->live_bytes > s->peak_bytes)
+            s->peak_bytes = s->live_bytes;
+    }
+
+    spinlock_release(&profile_lock);
+    _set_cpu_flags(flags);
+}
+
+void kheap_profile_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&profile_lock);
+
+    int r = rec_find((uintptr_t)ptr);
+    if (r >= 0) {
+        kheap_site_t *s = &sites[recs[r].site];
+        s->frees++;
+        s->live_bytes -= recs[r].size;
+        rec_remove(r);
+    }
+
+    spinlock_release(&profile_lock);
+    _set_cpu_flags(flags);
+}
+
+/*
+        Reports
+*/
+
+static size_t report_printf(char *buf, size_t size, size_t len,
+                            const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int written = len < size ? npf_vsnprintf(buf + len, size - len, fmt, args)
+                             : npf_vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    return written > 0 ? len + written : len;
+}
+
+// call sites are listed from the one holding the most memory down
+size_t kheap_profile_format(char *buf, size_t size) {
+    static uint16_t order[LIMIT_KHEAP_PROFILE_SITES];
+    size_t len = 0;
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&profile_lock);
+
+    size_t n = 0;
+    for (size_t s = 0; s < LIMIT_KHEAP_PROFILE_SITES; s++) {
+        if (sites[s].caller == 0)
+            continue;
+
+        size_t i = n++;
+        for (; i > 0 && sites[order[i - 1]].live_bytes < sites[s].live_bytes;
+             i--)
+            order[i] = order[i - 1];
+        order[i] = s;
+    }
+
+    // the timer's tick rate depends on who drives it, the TSC's is measured
+    uint64_t now = _get_tsc();
+    uint64_t mhz = tsc_get_freq() / 1000000;
+    len = report_printf(buf, size, len,
+                        "kheap profile: %zu call sites, %zu dropped sites, "
+                        "%zu dropped allocations\n",
+                        site_count, dropped_sites, dropped_allocs);
+
+    for (size_t i = 0; i < n; i++) {
+        kheap_site_t *s  = &sites[order[i]];
+        uint64_t elapsed = mhz ? (now - s->first_tsc) / mhz : 0; // in us
+
+        len = report_printf(buf, size, len,
+                            "%p: %zu live bytes (peak %zu), %zu allocs, "
+                            "%zu frees, %llu allocs/s\n",
+                            (void *)s->caller, s->live_bytes, s->peak_bytes,
+                            s->allocs, s->frees,
+                            elapsed ? s->allocs * 1000000ull / elapsed : 0ull);
+
+        len = report_printf(buf, size, len, "   sizes:");
+        for (size_t b = 0; b < KHEAP_PROFILE_BUCKETS; b++) {
+            if (s->sizes[b] == 0)
+                continue;
+
+            if (b == KHEAP_PROFILE_BUCKETS - 1)
+                len = report_printf(buf, size, len, " >%zu: %zu",
+                                    (size_t)16 << (b - 1), s->sizes[b]);
+            else
+                len = report_printf(buf, size, len, " <=%zu: %zu",
+                                    (size_t)16 << b, s->sizes[b]);
+        }
+        len = report_printf(buf, size, len, "\n");
+    }
+
+    spinlock_release(&profile_lock);
+    _set_cpu_flags(flags);
+
+    return len;
+}
+
+void kheap_profile_dump() {
+    static char report[KHEAP_PROFILE_REPORT_SIZE];
+    static lock_t report_lock;
+
+    spinlock_acquire(&report_lock);
+    size_t len = kheap_profile_format(report, sizeof(report));
+    debugf_impl(report, len < sizeof(report) ? len : sizeof(report) - 1);
+    spinlock_release(&report_lock);
+}
+
+#endif // CONFIG_KHEAP_PROFILE
@@ -0,0 +1,19 @@
+#ifndef KHEAP_PROFILE_H
+#define KHEAP_PROFILE_H 1
+
+#include <stddef.h>
+
+#define KHEAP_PROFILE_BUCKETS     16
+#define KHEAP_PROFILE_REPORT_SIZE 16384
+
+// only available with CONFIG_KHEAP_PROFILE
+
+// @param caller the call site to charge the allocation to
+void kheap_profile_alloc(void *ptr, size_t size, void *caller);
+void kheap_profile_free(void *ptr);
+
+size_t kheap_profile_format(char *buf, size_t size);
+// prints the per call site report over debugcon
+void kheap_profile_dump();
+
+#endif
@@ -0,0 +1,148 @@
+/*
+        Per-CPU allocator
+
+        Every CPU gets an area of LIMIT_PERCPU_SIZE bytes, taken from its own
+   NUMA node. alloc_percpu() reserves the same offset in all of them, so one
+   pointer stands for a whole set of copies: the one it points to is the boot
+   CPU's, and per_cpu_ptr() moves it into any other CPU's area.
+
+        Areas are handed out in whole cache lines, so data belonging to
+   different CPUs, or to different allocations, never shares one. Since every
+   area is laid out the same way, the bookkeeping is done once for all of
+   them.
+
+        Areas are only made for the CPUs in the bootloader's list whose LAPIC
+   ID is below LIMIT_CPU_MAX, the others get NULL from per_cpu_ptr().
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "percpu.h"
+
+#include <kernel.h>
+#include <memory/pmm/numa.h>
+#include <memory/pmm/pmm.h>
+#include <smp/smp.h>
+
+#include <util/string.h>
+#include <util/util.h>
+
+#include <stdio.h>
+
+#include <cpu.h>
+#include <limits.h>
+#include <spinlock.h>
+
+#include <autoconf.h>
+
+#define PERCPU_UNITS (LIMIT_PERCPU_SIZE / CACHE_LINE_SIZE)
+
+static uint8_t *areas[LIMIT_CPU_MAX]; // indexed by LAPIC ID
+static uint8_t *boot_area;            // where alloc_percpu() pointers point
+
+static bool unit_used[PERCPU_UNITS];
+// length in units of the allocation starting at each unit, 0 if none does
+static uint16_t unit_len[PERCPU_UNITS];
+
+static lock_t percpu_lock;
+
+static void area_alloc(uint32_t cpu) {
+    if (cpu >= LIMIT_CPU_MAX || areas[cpu] != NULL)
+        return;
+
+    void *phys = pmm_alloc_pages_node(LIMIT_PERCPU_SIZE / PFRAME_SIZE,
+                                      numa_cpu_node(cpu));
+    if (phys == NULL) {
+        kprintf_warn("Couldn't allocate the per-CPU area of CPU %u\n", cpu);
+        return;
+    }
+
+    areas[cpu] = (uint8_t *)PHYS_TO_VIRTUAL(phys);
+}
+
+void percpu_init() {
+    bootloader_data *bootloader_data = get_bootloader_data();
+    for (uint64_t i = 0; i < bootloader_data->cpu_count; i++)
+        area_alloc(bootloader_data->cpus[i]->lapic_id);
+
+    // in case the bootloader didn't give us a CPU list
+    uint8_t cpu = get_cpu();
+    area_alloc(cpu);
+
+    boot_area = cpu < LIMIT_CPU_MAX ? areas[cpu] : NULL;
+    for (size_t i = 0; boot_area == NULL && i < LIMIT_CPU_MAX; i++)
+        boot_area = areas[i];
+}
+
+void *alloc_percpu(size_t size) {
+    if (boot_area == NULL || size == 0)
+        return NULL;
+
+    size_t units = ROUND_UP(size, CACHE_LINE_SIZE) / CACHE_LINE_SIZE;
+    size_t start = 0;
+    size_t run   = 0;
+
+    spinlock_acquire(&percpu_lock);
+    for (size_t u = 0; u < PERCPU_UNITS && run < units; u++) {
+        if (unit_used[u]) {
+            start = u + 1;
+            run   = 0;
+        } else {
+            run++;
+        }
+    }
+
+    if (run == units) {
+        for (size_t u = start; u < start + units; u++)
+            unit_used[u] = true;
+        unit_len[start] = units;
+    }
+    spinlock_release(&percpu_lock);
+
+    if (run < units) {
+        kprintf_warn("Out of per-CPU memory: couldn't allocate %zu bytes\n",
+                     size);
+        return NULL;
+    }
+
+    size_t offset = start * CACHE_LINE_SIZE;
+    for (size_t cpu = 0; cpu < LIMIT_CPU_MAX; cpu++) {
+        if (areas[cpu])
+            memset(areas[cpu] + offset, 0, units * CACHE_LINE_SIZE);
+    }
+
+    return boot_area + offset;
+}
+
+void free_percpu(void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    size_t offset = (uint8_t *)ptr - boot_area;
+    size_t start  = offset / CACHE_LINE_SIZE;
+    if ((uint8_t *)ptr < boot_area || offset % CACHE_LINE_SIZE != 0 ||
+        start >= PERCPU_UNITS || unit_len[start] == 0) {
+        debugf_warn("Tried to free %p, which alloc_percpu() didn't hand out\n",
+                    ptr);
+        return;
+    }
+
+    spinlock_acquire(&percpu_lock);
+    for (size_t u = start; u < start + unit_len[start]; u++)
+        unit_used[u] = false;
+    unit_len[start] = 0;
+    spinlock_release(&percpu_lock);
+}
+
+void *per_cpu_ptr(void *ptr, uint8_t cpu) {
+    if (ptr == NULL || cpu >= LIMIT_CPU_MAX || areas[cpu] == NULL)
+        return NULL;
+
+    return areas[cpu] + ((uint8_t *)ptr - boot_area);
+}
+
+// @note the result only makes sense for as long as the caller can't be moved
+// to another CPU
+void *this_cpu_ptr(void *ptr) {
+    return per_cpu_ptr(ptr, get_cpu());
+}
@@ -0,0 +1,23 @@
+#ifndef PERCPU_H
+#define PERCPU_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// needs the bootloader's CPU list and numa_init() to have run
+void percpu_init();
+
+// reserves `size` bytes in every CPU's area, starting on a cache line of its
+// own. Every copy is zeroed
+// @returns the boot CPU's copy, NULL if there's no room left (or percpu_init()
+// didn't run yet)
+void *alloc_percpu(size_t size);
+void free_percpu(void *ptr);
+
+// @param ptr what alloc_percpu() returned
+// @returns `cpu`'s copy of `ptr`, NULL if that CPU has no area
+void *per_cpu_ptr(void *ptr, uint8_t cpu);
+void *this_cpu_ptr(void *ptr);
+
+#endif
@@ -1,14 +1,14 @@
 #ifndef FREELIST_H
 #define FREELIST_H 1
 
-#include <stdbool.h>
 #include <stddef.h>
-#include <stdint.h>
 
-typedef struct freelist_node {
-    size_t length; // length is in bytes
+#include "page.h"
 
-    struct freelist_node *next;
-} freelist_node;
+// one list of free blocks per buddy order, linked through their page_t
+typedef struct free_area {
+    page_t *head;
+    size_t count; // how many blocks are on this list
+} free_area_t;
 
 #endif
@@ -0,0 +1,121 @@
+/*
+        Early boot memory allocator
+
+        Until the PMM is up, the bootloader's memory map is all there is.
+   memblock keeps a copy of its usable regions and hands memory out by moving
+   a region's end down, so the page database and anything else needed that
+   early comes from the top of memory, away from the DMA zone.
+
+        pmm_init() takes over what's left of the regions in a single pass
+   with memblock_handover(). Everything memblock gave out stays reserved.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "memblock.h"
+#include "pmm.h"
+
+#include <limine.h>
+
+#include <util/util.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <limits.h>
+
+#include <autoconf.h>
+
+extern struct limine_memmap_response *memmap_response;
+
+static memblock_region_t regions[LIMIT_MEMBLOCK_REGIONS];
+static size_t region_count;
+static uint64_t highest_end; // before any allocation moved it down
+static bool handed_over;
+
+void memblock_init() {
+    region_count = 0;
+    highest_end  = 0;
+    handed_over  = false;
+
+    for (uint64_t i = 0; i < memmap_response->entry_count; i++) {
+        struct limine_memmap_entry *memmap_entry = memmap_response->entries[i];
+
+        if (memmap_entry->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        uint64_t base = ROUND_UP(memmap_entry->base, PFRAME_SIZE);
+        uint64_t end =
+            ROUND_DOWN(memmap_entry->base + memmap_entry->length, PFRAME_SIZE);
+
+        // physical address 0 would look like a failed allocation
+        if (base == 0)
+            base = PFRAME_SIZE;
+
+        if (end <= base)
+            continue;
+
+        // the memory map is sorted, so touching entries can be merged
+        if (region_count > 0 && regions[region_count - 1].end == base) {
+            regions[region_count - 1].end = end;
+            highest_end                   = end;
+            continue;
+        }
+
+        if (region_count == LIMIT_MEMBLOCK_REGIONS) {
+            kprintf_warn("Too many memory regions, ignoring %llx-%llx\n", base,
+                         end);
+            continue;
+        }
+
+        regions[region_count].base = base;
+        regions[region_count].end  = end;
+        region_count++;
+
+        highest_end = end;
+    }
+}
+
+void *memblock_alloc(size_t size, size_t align) {
+    if (handed_over || size == 0)
+        return NULL;
+
+    if (align < PFRAME_SIZE)
+        align = PFRAME_SIZE;
+    size = ROUND_UP(size, PFRAME_SIZE);
+
+    // top-down, low memory is precious to devices
+    for (size_t i = region_count; i > 0; i--) {
+        memblock_region_t *region = &regions[i - 1];
+        if (region->end - region->base < size)
+            continue;
+
+        uint64_t addr = ROUND_DOWN(region->end - size, align);
+        if (addr < region->base)
+            continue;
+
+        // the alignment gap above the allocation is lost, but it's at most
+        // one alignment unit and only ever happens at boot
+        region->end = addr;
+        return (void *)addr;
+    }
+
+    return NULL;
+}
+
+uint64_t memblock_end() {
+    return highest_end;
+}
+
+size_t memblock_region_count() {
+    return region_count;
+}
+
+void memblock_handover(void (*free_range)(uint64_t base, uint64_t end)) {
+    handed_over = true;
+
+    for (size_t i = 0; i < region_count; i++) {
+        if (regions[i].end > regions[i].base)
+            free_range(regions[i].base, regions[i].end);
+    }
+}
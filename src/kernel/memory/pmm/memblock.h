@@ -0,0 +1,28 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a usable range of physical memory, page frame aligned
+typedef struct memblock_region {
+    uint64_t base;
+    uint64_t end;
+} memblock_region_t;
+
+// expects the memory map from the bootloader to be parsed
+void memblock_init();
+
+// @returns the physical address of `size` bytes, NULL if nothing fits or if
+// memory has already been handed over to the PMM
+void *memblock_alloc(size_t size, size_t align);
+
+// @returns the end of the highest usable region
+uint64_t memblock_end();
+size_t memblock_region_count();
+
+// calls `free_range` on every region still free, in address order. memblock
+// can't be used after this
+void memblock_handover(void (*free_range)(uint64_t base, uint64_t end));
+
+#endif
@@ -0,0 +1,234 @@
+/*
+        NUMA topology
+
+        The SRAT tells us which proximity domain every CPU and memory range
+   belongs to, the SLIT how far domains are from each other. Domains are
+   renumbered into nodes 0..numa_node_count() - 1 in the order they show up.
+
+        Without a SRAT everything ends up in node 0.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "numa.h"
+#include "pmm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <uacpi/acpi.h>
+#include <uacpi/tables.h>
+#include <uacpi/uacpi.h>
+
+#include <limits.h>
+
+#include <autoconf.h>
+
+static int node_count = 1;
+static uint32_t node_domains[LIMIT_NUMA_NODES]; // proximity domain of a node
+
+static uint8_t cpu_nodes[LIMIT_CPU_MAX]; // indexed by APIC ID
+
+static numa_memrange_t mem_ranges[LIMIT_NUMA_MEMRANGES];
+static int mem_range_count;
+
+static uint8_t distances[LIMIT_NUMA_NODES][LIMIT_NUMA_NODES];
+static uint8_t fallbacks[LIMIT_NUMA_NODES][LIMIT_NUMA_NODES];
+
+// @returns -1 if there are too many nodes
+static int domain_to_node(uint32_t domain, bool create) {
+    for (int i = 0; i < node_count; i++) {
+        if (node_domains[i] == domain)
+            return i;
+    }
+
+    if (!create || node_count == LIMIT_NUMA_NODES)
+        return -1;
+
+    node_domains[node_count] = domain;
+    return node_count++;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t domain) {
+    int node = domain_to_node(domain, true);
+    if (node < 0 || apic_id >= LIMIT_CPU_MAX) {
+        debugf_warn("Ignoring CPU %u in proximity domain %u\n", apic_id,
+                    domain);
+        return;
+    }
+
+    cpu_nodes[apic_id] = node;
+}
+
+static void parse_srat(struct acpi_srat *srat) {
+    // the first node we find takes the place of the default one
+    node_count = 0;
+
+    void *addr = srat->entries;
+    void *end  = (void *)srat + srat->hdr.length;
+    for (; addr < end; addr += ((struct acpi_entry_hdr *)addr)->length) {
+        struct acpi_entry_hdr *entry = addr;
+        if (entry->length == 0)
+            break;
+
+        switch (entry->type) {
+        case ACPI_SRAT_ENTRY_TYPE_PROCESSOR_AFFINITY: {
+            struct acpi_srat_processor_affinity *cpu = addr;
+            if (!(cpu->flags & ACPI_SRAT_PROCESSOR_ENABLED))
+                break;
+
+            uint32_t domain = cpu->proximity_domain_low |
+                              (cpu->proximity_domain_high[0] << 8) |
+                              (cpu->proximity_domain_high[1] << 16) |
+                              (cpu->proximity_domain_high[2] << 24);
+            add_cpu(cpu->id, domain);
+            break;
+        }
+
+        case ACPI_SRAT_ENTRY_TYPE_X2APIC_AFFINITY: {
+            struct acpi_srat_x2apic_affinity *cpu = addr;
+            if (cpu->flags & ACPI_SRAT_X2APIC_ENABLED)
+                add_cpu(cpu->id, cpu->proximity_domain);
+            break;
+        }
+
+        case ACPI_SRAT_ENTRY_TYPE_MEMORY_AFFINITY: {
+            struct acpi_srat_memory_affinity *mem = addr;
+            if (!(mem->flags & ACPI_SRAT_MEMORY_ENABLED) || mem->length == 0)
+                break;
+
+            int node = domain_to_node(mem->proximity_domain, true);
+            if (node < 0 || mem_range_count == LIMIT_NUMA_MEMRANGES) {
+                debugf_warn("Ignoring memory range %llx-%llx\n", mem->base,
+                            mem->base + mem->length);
+                break;
+            }
+
+            mem_ranges[mem_range_count++] = (numa_memrange_t){
+                .base = mem->base, .length = mem->length, .node = node};
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    if (node_count == 0)
+        node_count = 1;
+}
+
+static void parse_slit(struct acpi_slit *slit) {
+    for (int from = 0; from < node_count; from++) {
+        for (int to = 0; to < node_count; to++) {
+            uint64_t i = node_domains[from];
+            uint64_t j = node_domains[to];
+            if (i >= slit->num_localities || j >= slit->num_localities)
+                continue;
+
+            distances[from][to] = slit->matrix[i * slit->num_localities + j];
+        }
+    }
+}
+
+// whether `a` should come before `b` in the fallback list of `node`
+static bool closer(int node, uint8_t a, uint8_t b) {
+    if (a == node || b == node)
+        return a == node;
+
+    return distances[node][a] < distances[node][b];
+}
+
+static void build_fallbacks() {
+    for (int node = 0; node < node_count; node++) {
+        uint8_t *list = fallbacks[node];
+
+        // insertion sort, nodes at the same distance keep their order
+        for (int i = 0; i < node_count; i++) {
+            int j = i - 1;
+            for (; j >= 0 && closer(node, i, list[j]); j--)
+                list[j + 1] = list[j];
+
+            list[j + 1] = i;
+        }
+    }
+}
+
+void numa_init() {
+    uacpi_table table;
+    if (uacpi_table_find_by_signature(ACPI_SRAT_SIGNATURE, &table) ==
+        UACPI_STATUS_OK) {
+        parse_srat(table.ptr);
+        uacpi_table_unref(&table);
+    } else {
+        kprintf_info("No SRAT found, assuming a single NUMA node\n");
+    }
+
+    for (int from = 0; from < node_count; from++) {
+        for (int to = 0; to < node_count; to++)
+            distances[from][to] =
+                from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+    }
+
+    if (node_count > 1 &&
+        uacpi_table_find_by_signature(ACPI_SLIT_SIGNATURE, &table) ==
+            UACPI_STATUS_OK) {
+        parse_slit(table.ptr);
+        uacpi_table_unref(&table);
+    }
+
+    build_fallbacks();
+
+    kprintf_info("Found %d NUMA node%s\n", node_count,
+                 node_count > 1 ? "s" : "");
+    for (int i = 0; i < mem_range_count; i++) {
+        debugf_debug("Node %hhu: memory %llx-%llx\n", mem_ranges[i].node,
+                     mem_ranges[i].base,
+                     mem_ranges[i].base + mem_ranges[i].length);
+    }
+    for (int from = 0; from < node_count; from++) {
+        debugf_debug("Node %d (domain %u) distances:", from,
+                     node_domains[from]);
+        for (int to = 0; to < node_count; to++)
+            debugf(" %hhu", distances[from][to]);
+        debugf("\n");
+    }
+
+    pmm_numa_init();
+}
+
+int numa_node_count() {
+    return node_count;
+}
+
+int numa_cpu_node(uint8_t cpu) {
+    if (cpu >= LIMIT_CPU_MAX)
+        return 0;
+
+    return cpu_nodes[cpu];
+}
+
+// @returns the node `phys` belongs to, 0 if the SRAT doesn't say
+int numa_addr_node(uint64_t phys) {
+    for (int i = 0; i < mem_range_count; i++) {
+        if (phys >= mem_ranges[i].base &&
+            phys - mem_ranges[i].base < mem_ranges[i].length)
+            return mem_ranges[i].node;
+    }
+
+    return 0;
+}
+
+uint8_t numa_distance(int from, int to) {
+    if (from < 0 || to < 0 || from >= node_count || to >= node_count)
+        return 0;
+
+    return distances[from][to];
+}
+
+const uint8_t *numa_fallback_list(int node) {
+    if (node < 0 || node >= node_count)
+        node = 0;
+
+    return fallbacks[node];
+}
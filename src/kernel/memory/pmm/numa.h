@@ -0,0 +1,29 @@
+#ifndef NUMA_H
+#define NUMA_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMA_NO_NODE (-1) // let the PMM pick the calling CPU's node
+
+#define NUMA_LOCAL_DISTANCE  10
+#define NUMA_REMOTE_DISTANCE 20 // used when there's no SLIT
+
+// memory affinity range from the SRAT
+typedef struct numa_memrange {
+    uint64_t base;
+    uint64_t length;
+    uint8_t node;
+} numa_memrange_t;
+
+// expects that uACPI is initialized
+void numa_init();
+
+int numa_node_count();
+int numa_cpu_node(uint8_t cpu);
+int numa_addr_node(uint64_t phys);
+uint8_t numa_distance(int from, int to);
+// @returns every node, sorted by distance from `node` (`node` itself first)
+const uint8_t *numa_fallback_list(int node);
+
+#endif
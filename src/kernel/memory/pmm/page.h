@@ -0,0 +1,62 @@
+#ifndef PAGE_H
+#define PAGE_H 1
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// page_t flags
+#define PAGE_FREE      (1 << 0) // heads a block on the buddy free lists
+#define PAGE_RESERVED  (1 << 1) // not usable RAM, or the page database itself
+#define PAGE_SLAB      (1 << 2)
+#define PAGE_PAGETABLE (1 << 3)
+#define PAGE_PAGECACHE (1 << 4)
+#define PAGE_DMA       (1 << 5)
+#define PAGE_HUGE      (1 << 6) // first frame of a 2MiB/1GiB huge frame
+#define PAGE_KHEAP     (1 << 7) // part of a kmalloc() span
+
+// who asked for a page frame
+enum page_owner {
+    PAGE_OWNER_NONE = 0,
+    PAGE_OWNER_KERNEL, // default for pmm_alloc_* callers that don't say
+    PAGE_OWNER_PAGING,
+    PAGE_OWNER_VMM,
+    PAGE_OWNER_HEAP,
+    PAGE_OWNER_SCHED,
+    PAGE_OWNER_DRIVER,
+
+    PAGE_OWNER_COUNT
+};
+
+// one descriptor for every page frame, indexed by PFN
+typedef struct page {
+    // list links, used by the buddy allocator while PAGE_FREE is set
+    struct page *next;
+    struct page *prev;
+
+    atomic_uint refcount; // 0 means the frame is free (or cached by the PMM)
+    uint8_t flags;
+    // size of the block this frame is the first one of. 0 for allocations
+    // whose block got its tail trimmed
+    uint8_t order;
+    uint8_t owner; // enum page_owner
+    uint8_t node;  // NUMA node the frame belongs to
+
+    void *private; // for the owner to use as it pleases
+} page_t;
+
+page_t *pfn_to_page(size_t pfn);
+size_t page_to_pfn(page_t *page);
+// @param ptr either a physical or an HHDM address
+page_t *phys_to_page(void *ptr);
+
+// sets the owner and adds `flags` to `pages` frames starting from `ptr`
+void page_tag(void *ptr, size_t pages, uint8_t owner, uint8_t flags);
+
+void page_get(page_t *page);
+// drops a reference to the frame, freeing it when nobody uses it anymore
+// @returns true if the frame was freed
+bool page_put(page_t *page);
+
+#endif
@@ -1,197 +1,1541 @@
 /*
-        Freelist memory allocator/manager
+        Buddy page frame allocator
+
+        Free memory is kept in blocks of 2^order page frames, one free list
+   per order. Allocations split bigger blocks in halves ("buddies") until the
+   requested order is reached, frees merge a block with its buddy for as long
+   as the buddy is free too.
+
+        Every page frame has a page_t descriptor in page_db, indexed by its
+   PFN. The free lists are linked through those descriptors, so free memory
+   itself is never touched by the allocator.
+
+        Single frames go through a small per-CPU cache first, which is refilled
+   from and drained to the buddy allocator in batches, so most allocations
+   never take a zone lock. The caches come from alloc_percpu() once
+   pmm_pcp_init() runs, so each one lives on its CPU's node and cache lines.
+
+        Page frames are handed out zeroed. To keep the memset off the
+   allocation path, pmm_zero_worker() clears free frames ahead of time while
+   the CPU is idle and parks them in a small pool. The pool sits behind the
+   zone lock, so pmm_alloc_page() only pops from it when the per-CPU cache is
+   empty and the lock would be taken anyway. Callers that overwrite the whole
+   frame anyway can skip zeroing altogether with the _nozero variants.
+
+        On NUMA machines every node gets its own zone: free lists, lock and
+   zeroed pool. Allocations start from the calling CPU's node (or the one
+   asked for) and fall back to the others by SLIT distance. Until
+   pmm_numa_init() runs, all memory sits in node 0.
+
+        The page database comes from memblock, the boot time allocator, which
+   then gives the rest of the memory map to the buddy allocator in one go.
+
+        Huge frames (2MiB and 1GiB) are naturally aligned. 2MiB ones are
+   plain order 9 buddy blocks, with a few of them set aside at boot for when
+   memory gets too fragmented. 1GiB ones are bigger than any buddy block and
+   only come from what pmm_init() reserved.
+
+        A separate DMA zone holds frames below 4GiB, set aside at boot for
+   devices that can only address 32 bits. Its frames are marked with
+   PMM_DMA_NODE instead of a NUMA node.
+
+        When a zone runs low on memory, the shrinkers registered by caches
+   built on top of the PMM are asked to give some back. That happens once
+   per trip below the low watermark, the zone has to climb back over the high
+   one before they run again. If an allocation still can't be satisfied,
+   NULL is returned.
+
+        With CONFIG_PMM_LATENCY, allocation and free latencies are recorded
+   per CPU in TSC cycles. Together with the free lists and the page database
+   they make up the report of pmm_stats_format(), readable from the "pmmstat"
+   device or dumped to E9 with pmm_stats_dump().
 
         (C) RepubblicaTech 2024
 */
 
 #include "pmm.h"
+#include "memblock.h"
+#include "numa.h"
 
 #include <kernel.h>
-#include <limine.h>
 
 #include <util/string.h>
 #include <util/util.h>
 
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 
+#include <limits.h>
 #include <spinlock.h>
 
-#include <autoconf.h>
+#include <memory/percpu/percpu.h>
+#include <smp/smp.h>
 
-lock_t PMM_LOCK;
+#include <cpu.h>
+#include <tsc/tsc.h>
+
+#include <autoconf.h>
 
 int usable_entry_count;
 
-extern struct limine_memmap_response *memmap_response;
 extern void _hcf();
 
-freelist_node *fl_head;
+typedef struct pmm_zone {
+    // zone locks are also taken from interrupt context (page faults), so
+    // interrupts stay off while one is held
+    lock_t lock;
+
+    free_area_t free_areas[PMM_MAX_ORDER + 1];
+    size_t free_frames;  // in the free lists
+    size_t total_frames; // usable frames belonging to the node
+
+    // physical addresses of free frames that have already been zeroed
+    uint64_t zero_pool[PMM_ZERO_POOL_SIZE];
+    size_t zero_pool_count;
+
+    uint64_t fallback_allocs;
+
+    // shrinkers get called once free_frames drops below watermark_low, and
+    // are asked to bring it back up to watermark_high
+    size_t watermark_low;
+    size_t watermark_high;
+    atomic_bool shrunk; // set until free_frames is back over watermark_high
+} __attribute__((aligned(CACHE_LINE_SIZE))) pmm_zone_t;
+
+static pmm_zone_t zones[LIMIT_NUMA_NODES];
+static pmm_zone_t dma_zone;
+
+#define PMM_DMA_NODE   0xFF // page_t.node of frames in the DMA zone
+#define DMA_ZONE_LIMIT 0x100000000 // the DMA zone stays below 4GiB
+
+static page_t *page_db;
+static size_t frame_count; // how many frames page_db covers
+
+#define PFN_TO_VIRT(pfn)                                                       \
+    ((void *)PHYS_TO_VIRTUAL((uint64_t)(pfn) * PFRAME_SIZE))
+#define PFN_ZONE(pfn)                                                          \
+    (page_db[pfn].node == PMM_DMA_NODE ? &dma_zone : &zones[page_db[pfn].node])
+
+#define ORDER_PAGES(order) ((size_t)1 << (order))
+
+typedef struct pmm_pcp {
+    size_t count;
+    uint64_t frames[PMM_PCP_SIZE]; // physical addresses, all from our node
+    pmm_pcp_stats_t stats;
+
+#ifdef CONFIG_PMM_LATENCY
+    pmm_lat_hist_t alloc_lat;
+    pmm_lat_hist_t free_lat;
+#endif
+} pmm_pcp_t;
+
+// from alloc_percpu(), so every cache sits on its CPU's node, NULL until
+// pmm_pcp_init()
+static pmm_pcp_t *pcp_caches;
+
+static uint64_t zone_lock(pmm_zone_t *zone) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&zone->lock);
+
+    return flags;
+}
+
+static void zone_unlock(pmm_zone_t *zone, uint64_t flags) {
+    spinlock_release(&zone->lock);
+    _set_cpu_flags(flags);
+}
+
+static int local_node() {
+    return numa_cpu_node(get_cpu());
+}
+
+static void fl_push(pmm_zone_t *zone, size_t pfn, size_t order) {
+    page_t *page      = &page_db[pfn];
+    free_area_t *area = &zone->free_areas[order];
+
+    page->order  = order;
+    page->flags |= PAGE_FREE;
+    page->prev   = NULL;
+    page->next   = area->head;
+    if (area->head)
+        area->head->prev = page;
+    area->head = page;
+    area->count++;
+
+    zone->free_frames += ORDER_PAGES(order);
+    if (zone->free_frames >= zone->watermark_high)
+        atomic_store_explicit(&zone->shrunk, false, memory_order_relaxed);
+}
+
+static void fl_remove(pmm_zone_t *zone, page_t *page) {
+    free_area_t *area = &zone->free_areas[page->order];
+
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        area->head = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    area->count--;
+
+    page->flags       &= ~PAGE_FREE;
+    page->next         = NULL;
+    page->prev         = NULL;
+    zone->free_frames -= ORDER_PAGES(page->order);
+}
+
+// gives a block back to its free list, merging it with its buddy
+static void buddy_free_block(pmm_zone_t *zone, size_t pfn, size_t order) {
+    if (page_db[pfn].flags & PAGE_FREE) {
+        debugf_warn("Double free of page frame %llx\n",
+                    (uint64_t)pfn * PFRAME_SIZE);
+        return;
+    }
+
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy_pfn = pfn ^ ORDER_PAGES(order);
+        if (buddy_pfn >= frame_count ||
+            !(page_db[buddy_pfn].flags & PAGE_FREE) ||
+            page_db[buddy_pfn].order != order ||
+            page_db[buddy_pfn].node != page_db[pfn].node)
+            break;
+
+        fl_remove(zone, &page_db[buddy_pfn]);
+        pfn &= ~ORDER_PAGES(order);
+        order++;
+    }
+
+    fl_push(zone, pfn, order);
+}
+
+// frees an arbitrary range by splitting it into naturally aligned blocks
+static void buddy_free_range(pmm_zone_t *zone, size_t pfn, size_t count) {
+    while (count > 0) {
+        size_t order = 0;
+        while (order < PMM_MAX_ORDER &&
+               (pfn & ORDER_PAGES(order)) == 0 &&
+               ORDER_PAGES(order + 1) <= count)
+            order++;
+
+        buddy_free_block(zone, pfn, order);
+
+        pfn   += ORDER_PAGES(order);
+        count -= ORDER_PAGES(order);
+    }
+}
+
+// @returns the first frame of the free block `pfn` is part of, or
+// `frame_count` if it isn't free
+static size_t buddy_find_block(size_t pfn) {
+    for (size_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        size_t head = pfn & ~(ORDER_PAGES(order) - 1);
+        if ((page_db[head].flags & PAGE_FREE) && page_db[head].order == order)
+            return head;
+    }
+
+    return frame_count;
+}
+
+// takes the frames [pfn, pfn + count) off the free lists, giving back what's
+// left of the blocks they were part of
+// @returns false, without taking anything, if any of them isn't free
+static bool buddy_claim_range(pmm_zone_t *zone, size_t pfn, size_t count) {
+    size_t end = pfn + count;
+    if (end > frame_count)
+        return false;
+
+    for (size_t cur = pfn; cur < end;) {
+        size_t head = buddy_find_block(cur);
+        if (head == frame_count || page_db[head].node != page_db[pfn].node)
+            return false;
+
+        cur = head + ORDER_PAGES(page_db[head].order);
+    }
+
+    for (size_t cur = pfn; cur < end;) {
+        size_t head      = buddy_find_block(cur);
+        size_t block_end = head + ORDER_PAGES(page_db[head].order);
+        size_t claim_end = block_end < end ? block_end : end;
+
+        fl_remove(zone, &page_db[head]);
+        if (cur > head)
+            buddy_free_range(zone, head, cur - head);
+        if (block_end > claim_end)
+            buddy_free_range(zone, claim_end, block_end - claim_end);
+
+        cur = claim_end;
+    }
+
+    return true;
+}
+
+// takes a block of exactly 2^order frames, splitting a bigger one if needed
+static page_t *buddy_alloc_block(pmm_zone_t *zone, size_t order) {
+    size_t cur_order = order;
+    while (cur_order <= PMM_MAX_ORDER &&
+           zone->free_areas[cur_order].head == NULL)
+        cur_order++;
+
+    if (cur_order > PMM_MAX_ORDER)
+        return NULL;
+
+    page_t *block = zone->free_areas[cur_order].head;
+    fl_remove(zone, block);
+
+    // the upper halves go back on the lower order lists
+    size_t pfn = page_to_pfn(block);
+    while (cur_order > order) {
+        cur_order--;
+        fl_push(zone, pfn + ORDER_PAGES(cur_order), cur_order);
+    }
+
+    return block;
+}
+
+/*
+        Huge page frames
+*/
+
+#define HUGE_2M_ORDER 9
+#define HUGE_1G_ORDER 18
+
+typedef struct huge_pool {
+    page_t *head; // chained through page_t.next of the first frame
+    size_t count;
+    size_t reserved; // how many frames the pool should hold when full
+} huge_pool_t;
+
+static lock_t huge_lock;
+static huge_pool_t huge_2m_pool;
+static huge_pool_t huge_1g_pool;
+
+static void huge_pool_push(huge_pool_t *pool, size_t pfn) {
+    page_t *page = &page_db[pfn];
+    page->next   = pool->head;
+    pool->head   = page;
+    pool->count++;
+}
+
+static page_t *huge_pool_pop(huge_pool_t *pool) {
+    page_t *page = pool->head;
+    if (page) {
+        pool->head = page->next;
+        page->next = NULL;
+        pool->count--;
+    }
+
+    return page;
+}
+
+// pulls 1GiB worth of max order blocks starting at `pfn` off the free lists
+// @returns false if any part of the range isn't free
+static bool take_1g_range(pmm_zone_t *zone, size_t pfn) {
+    size_t blocks = ORDER_PAGES(HUGE_1G_ORDER - PMM_MAX_ORDER);
+    for (size_t i = 0; i < blocks; i++) {
+        page_t *page = &page_db[pfn + i * ORDER_PAGES(PMM_MAX_ORDER)];
+        if (!(page->flags & PAGE_FREE) || page->order != PMM_MAX_ORDER)
+            return false;
+    }
+
+    for (size_t i = 0; i < blocks; i++)
+        fl_remove(zone, &page_db[pfn + i * ORDER_PAGES(PMM_MAX_ORDER)]);
+
+    return true;
+}
+
+// sets the huge frames aside, before the buddy allocator gets to split them
+static void huge_reserve() {
+    pmm_zone_t *zone = &zones[0];
+    size_t want_1g   = CONFIG_PMM_HUGE_1G_RESERVE;
+    size_t want_2m   = CONFIG_PMM_HUGE_2M_RESERVE;
+
+    size_t step = ORDER_PAGES(HUGE_1G_ORDER);
+    for (size_t pfn = step;
+         pfn + step <= frame_count && huge_1g_pool.count < want_1g;
+         pfn += step) {
+        if (take_1g_range(zone, pfn))
+            huge_pool_push(&huge_1g_pool, pfn);
+    }
+
+    while (huge_2m_pool.count < want_2m) {
+        page_t *block = buddy_alloc_block(zone, HUGE_2M_ORDER);
+        if (block == NULL)
+            break;
+
+        huge_pool_push(&huge_2m_pool, page_to_pfn(block));
+    }
+
+    huge_1g_pool.reserved = huge_1g_pool.count;
+    huge_2m_pool.reserved = huge_2m_pool.count;
+
+    if (huge_1g_pool.count < want_1g || huge_2m_pool.count < want_2m) {
+        kprintf_warn("Could only reserve %zu 1GiB and %zu 2MiB frames\n",
+                     huge_1g_pool.count, huge_2m_pool.count);
+    }
+}
+
+/*
+        DMA zone
+*/
+
+// moves the largest free blocks below 4GiB from the boot zone to the DMA zone
+static void dma_reserve() {
+    pmm_zone_t *zone = &zones[0];
+    size_t want      = CONFIG_PMM_DMA_ZONE_SIZE * 0x400 / PFRAME_SIZE;
+
+    for (int order = PMM_MAX_ORDER; order >= 0; order--) {
+        page_t *block = zone->free_areas[order].head;
+        while (block && dma_zone.total_frames < want) {
+            page_t *next = block->next;
+            size_t pfn   = page_to_pfn(block);
+
+            if ((uint64_t)(pfn + ORDER_PAGES(order)) * PFRAME_SIZE <=
+                    DMA_ZONE_LIMIT &&
+                ORDER_PAGES(order) <= want - dma_zone.total_frames) {
+                fl_remove(zone, block);
+                zone->total_frames -= ORDER_PAGES(order);
+
+                for (size_t i = 0; i < ORDER_PAGES(order); i++)
+                    page_db[pfn + i].node = PMM_DMA_NODE;
+
+                dma_zone.total_frames += ORDER_PAGES(order);
+                buddy_free_block(&dma_zone, pfn, order);
+            }
+
+            block = next;
+        }
+    }
+
+    if (dma_zone.total_frames < want) {
+        kprintf_warn("DMA zone is only %zu KBytes\n",
+                     dma_zone.total_frames * PFRAME_SIZE / 0x400);
+    }
+}
+
+static void zone_set_watermarks(pmm_zone_t *zone) {
+    zone->watermark_low  = zone->total_frames / PMM_WMARK_LOW_DIV;
+    zone->watermark_high = zone->total_frames / PMM_WMARK_HIGH_DIV;
+}
+
+static size_t pages_to_order(size_t pages) {
+    size_t order = 0;
+    while (ORDER_PAGES(order) < pages)
+        order++;
+
+    return order;
+}
+
+// next frame that memblock_handover() hasn't told us about yet
+static size_t handover_pfn;
+
+static void handover_range(uint64_t base, uint64_t end) {
+    size_t start = base / PFRAME_SIZE;
+    size_t count = (end - base) / PFRAME_SIZE;
+
+    // whatever lies between usable regions stays reserved
+    for (size_t pfn = handover_pfn; pfn < start; pfn++)
+        page_db[pfn].flags = PAGE_RESERVED;
+    handover_pfn = start + count;
+
+    usable_entry_count++;
+    zones[0].total_frames += count;
+    buddy_free_range(&zones[0], start, count);
+}
+
+static void zero_frames(size_t pfn, size_t pages) {
+    void *ptr      = PFN_TO_VIRT(pfn);
+    uint64_t count = pages * PFRAME_SIZE / sizeof(uint64_t);
+
+    asm volatile("rep stosq" : "+D"(ptr), "+c"(count) : "a"(0) : "memory");
+}
 
 void pmm_init() {
-    // array of nodes (used only on initialization)
-    freelist_node *fl_nodes[limine_parsed_data.usable_entry_count];
+    memblock_init();
 
+    // the frame map has to cover the highest usable frame
+    frame_count     = memblock_end() / PFRAME_SIZE;
+    size_t map_size = ROUND_UP(frame_count * sizeof(page_t), PFRAME_SIZE);
+
+    uint64_t db_phys = (uint64_t)memblock_alloc(map_size, PFRAME_SIZE);
+    if (db_phys == 0) {
+        kprintf_panic("No usable region can hold the page database!\n");
+        _hcf();
+    }
+
+    // this is the biggest clear the PMM ever does, map_size is page aligned
+    page_db = (page_t *)PHYS_TO_VIRTUAL(db_phys);
+    zero_frames(db_phys / PFRAME_SIZE, map_size / PFRAME_SIZE);
+
+    // one pass over the page database: gaps get reserved, usable memory goes
+    // to the buddy allocator
     usable_entry_count = 0;
-    for (uint64_t i = 0; i < memmap_response->entry_count; i++) {
-        struct limine_memmap_entry *memmap_entry = memmap_response->entries[i];
+    handover_pfn       = 0;
+    memblock_handover(handover_range);
+    for (size_t pfn = handover_pfn; pfn < frame_count; pfn++)
+        page_db[pfn].flags = PAGE_RESERVED;
 
-        if (memmap_entry->type != LIMINE_MEMMAP_USABLE)
-            continue;
+    // 1GiB frames are the hardest to find, they go first
+    huge_reserve();
+    dma_reserve();
+
+    zone_set_watermarks(&zones[0]);
 
-        usable_entry_count++;
+    kprintf_info("Found %d usable regions\n", usable_entry_count);
+    kprintf_info("%zu free page frames (%zu MBytes)\n", zones[0].free_frames,
+                 (zones[0].free_frames * PFRAME_SIZE) / 0x100000);
+    kprintf_info("Page database: %zu entries (%zu KBytes)\n", frame_count,
+                 map_size / 0x400);
+    kprintf_info("DMA zone: %zu KBytes\n",
+                 dma_zone.total_frames * PFRAME_SIZE / 0x400);
+
+#ifdef CONFIG_PMM_DEBUG
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        debugf_debug("Order %d: %zu free blocks\n", order,
+                     zones[0].free_areas[order].count);
     }
-    // create a freelist entry that points to the start of each usable address
-    // and link them
-    // @note temp is a temporary counter for the fl_nodes array
-    for (uint64_t i = 0, temp = 0; i < memmap_response->entry_count; i++) {
-        struct limine_memmap_entry *memmap_entry = memmap_response->entries[i];
+#endif
+}
 
-        if (memmap_entry->type != LIMINE_MEMMAP_USABLE)
-            continue;
+/*
+        NUMA zones
+*/
 
-        freelist_node *fl_node =
-            (freelist_node *)PHYS_TO_VIRTUAL(memmap_entry->base);
-        fl_node->length = memmap_entry->length;
+// moves every frame to the zone of its node, called by numa_init()
+void pmm_numa_init() {
+    int node_count = numa_node_count();
+    if (node_count < 2)
+        return;
 
-        if (temp == 0)
-            fl_head = fl_node;
+    // nothing but the BSP is running, so its cache is the only one in use
+    pmm_pcp_drain();
 
-        fl_nodes[temp] = fl_node;
+    uint64_t flags[LIMIT_NUMA_NODES];
+    for (int i = 0; i < node_count; i++)
+        flags[i] = zone_lock(&zones[i]);
 
-        temp++;
+    pmm_zone_t *boot_zone = &zones[0];
+    while (boot_zone->zero_pool_count > 0) {
+        uint64_t phys = boot_zone->zero_pool[--boot_zone->zero_pool_count];
+        buddy_free_block(boot_zone, phys / PFRAME_SIZE, 0);
     }
 
-    for (int i = 0; i < usable_entry_count; i++) {
-        if (i < usable_entry_count - 1) {
-            fl_nodes[i]->next = fl_nodes[i + 1];
-        } else {
-            fl_nodes[i]->next = NULL;
+    // take all the free blocks off the boot zone, chaining them together
+    page_t *blocks = NULL;
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        while (boot_zone->free_areas[order].head) {
+            page_t *block = boot_zone->free_areas[order].head;
+            fl_remove(boot_zone, block);
+            block->order = order;
+            block->next  = blocks;
+            blocks       = block;
         }
     }
 
-    kprintf_info("Found %d usable regions\n", usable_entry_count);
+    boot_zone->total_frames = 0;
+    for (size_t pfn = 0; pfn < frame_count; pfn++) {
+        // the DMA zone doesn't care about NUMA
+        if (page_db[pfn].node == PMM_DMA_NODE)
+            continue;
+
+        page_db[pfn].node = numa_addr_node((uint64_t)pfn * PFRAME_SIZE);
+        if (!(page_db[pfn].flags & PAGE_RESERVED))
+            PFN_ZONE(pfn)->total_frames++;
+    }
+
+    // give the blocks back, split wherever a node boundary crosses them
+    while (blocks) {
+        page_t *block = blocks;
+        blocks        = block->next;
+        block->next   = NULL;
+
+        size_t pfn = page_to_pfn(block);
+        size_t end = pfn + ORDER_PAGES(block->order);
+        while (pfn < end) {
+            size_t run = pfn + 1;
+            while (run < end && page_db[run].node == page_db[pfn].node)
+                run++;
+
+            buddy_free_range(PFN_ZONE(pfn), pfn, run - pfn);
+            pfn = run;
+        }
+    }
+
+    for (int i = 0; i < node_count; i++)
+        zone_set_watermarks(&zones[i]);
+
+    for (int i = node_count - 1; i >= 0; i--)
+        zone_unlock(&zones[i], flags[i]);
+
+    for (int i = 0; i < node_count; i++) {
+        kprintf_info("Node %d: %zu page frames (%zu MBytes free)\n", i,
+                     zones[i].total_frames,
+                     (zones[i].free_frames * PFRAME_SIZE) / 0x100000);
+    }
+}
+
+static size_t node_cached_frames(int node) {
+    size_t cached = zones[node].zero_pool_count;
+    for (int cpu = 0; cpu < LIMIT_CPU_MAX; cpu++) {
+        pmm_pcp_t *pcp = per_cpu_ptr(pcp_caches, cpu);
+        if (pcp && numa_cpu_node(cpu) == node)
+            cached += pcp->count;
+    }
+
+    return cached;
+}
+
+void pmm_get_node_stats(int node, pmm_node_stats_t *out) {
+    if (node < 0 || node >= numa_node_count() || out == NULL)
+        return;
 
-    // prints all nodes
-    for (freelist_node *fl_node = fl_head; fl_node != NULL;
-         fl_node                = fl_node->next) {
-        debugf_debug("ENTRY n. %p\n", fl_node);
-        debugf_debug("\tlength: %llx\n", fl_node->length);
-        debugf_debug("\tnext: %p\n", fl_node->next);
+    pmm_zone_t *zone     = &zones[node];
+    out->total_frames    = zone->total_frames;
+    out->free_frames     = zone->free_frames + node_cached_frames(node);
+    out->used_frames     = out->total_frames - out->free_frames;
+    out->fallback_allocs = zone->fallback_allocs;
+}
+
+void pmm_node_dump() {
+    for (int node = 0; node < numa_node_count(); node++) {
+        pmm_node_stats_t stats;
+        pmm_get_node_stats(node, &stats);
+
+        debugf("Node %d: %zu/%zu frames used, %zu free, %llu fallback "
+               "allocations\n",
+               node, stats.used_frames, stats.total_frames, stats.free_frames,
+               stats.fallback_allocs);
     }
 }
 
-// Returns the count of the entries.
-int get_freelist_entry_count() {
-    return usable_entry_count;
+// Returns the count of the free page frames, cached ones included.
+size_t pmm_get_free_frames() {
+    size_t free = dma_zone.free_frames;
+    for (int node = 0; node < numa_node_count(); node++)
+        free += zones[node].free_frames + node_cached_frames(node);
+
+    return free;
+}
+
+// Returns how many free page frames are already zeroed
+size_t pmm_get_zeroed_frames() {
+    size_t zeroed = 0;
+    for (int node = 0; node < numa_node_count(); node++)
+        zeroed += zones[node].zero_pool_count;
+
+    return zeroed;
 }
 
 /*
-        "Refreshes" the list of entries
+        Pre-zeroed page frame pool
+*/
+
+static uint64_t zero_pool_pop(pmm_zone_t *zone) {
+    // no point in taking the lock for an empty pool
+    if (zone->zero_pool_count == 0)
+        return 0;
+
+    uint64_t flags = zone_lock(zone);
+    uint64_t phys  = 0;
+    if (zone->zero_pool_count > 0)
+        phys = zone->zero_pool[--zone->zero_pool_count];
+    zone_unlock(zone, flags);
+
+    return phys;
+}
+
+// gives all the pre-zeroed frames back to the buddy allocator
+static void zero_pool_release(pmm_zone_t *zone) {
+    uint64_t flags = zone_lock(zone);
+    while (zone->zero_pool_count > 0) {
+        uint64_t phys = zone->zero_pool[--zone->zero_pool_count];
+        buddy_free_block(zone, phys / PFRAME_SIZE, 0);
+    }
+    zone_unlock(zone, flags);
+}
 
-        @returns head of nodes
+/*
+        Zeroes up to PMM_ZERO_BATCH free frames of the local node and adds
+   them to its pool. Meant to be called when there's nothing better to do
+   (e.g. the idle loop), returns right away if the pool is already full.
 */
-freelist_node *fl_update_nodes() {
-    usable_entry_count = 0;
-    for (freelist_node *i = fl_head; i != NULL;
-         i                = i->next, usable_entry_count++)
-        ;
+void pmm_zero_worker() {
+    pmm_zone_t *zone = &zones[local_node()];
+
+    for (int i = 0; i < PMM_ZERO_BATCH; i++) {
+        if (zone->zero_pool_count >= PMM_ZERO_POOL_SIZE)
+            return;
+
+        uint64_t flags = zone_lock(zone);
+        page_t *block  = buddy_alloc_block(zone, 0);
+        zone_unlock(zone, flags);
 
-    return fl_head;
+        if (block == NULL)
+            return;
+
+        // the actual zeroing happens without holding the lock
+        size_t pfn = page_to_pfn(block);
+        zero_frames(pfn, 1);
+
+        flags = zone_lock(zone);
+        if (zone->zero_pool_count < PMM_ZERO_POOL_SIZE) {
+            zone->zero_pool[zone->zero_pool_count++] =
+                (uint64_t)pfn * PFRAME_SIZE;
+            pfn = 0;
+        } else {
+            // somebody else filled the pool in the meantime
+            buddy_free_block(zone, pfn, 0);
+        }
+        zone_unlock(zone, flags);
+
+        if (pfn != 0)
+            return;
+    }
 }
 
-int pmm_allocs = 0; // keeping track of how many times pmm_alloc was called
-int pmm_frees  = 0; // keeping track of how many times pmm_free was called
+/*
+        Per-CPU page frame caches
+*/
 
-// Omar, this is a PAGE FRAME allocator no need for custom <bytes> parameter
-void *pmm_alloc_page() {
-    pmm_allocs++;
-#ifdef CONFIG_PMM_DEBUG
-    debugf_debug("--- Allocation n.%d ---\n", pmm_allocs);
-#endif
+// until then single frames come straight from the buddy allocator
+void pmm_pcp_init() {
+    pcp_caches = alloc_percpu(sizeof(pmm_pcp_t));
+}
 
-    void *ptr = NULL;
-    freelist_node *cur_node;
-    for (cur_node = fl_head; cur_node != NULL; cur_node = cur_node->next) {
-#ifdef CONFIG_PMM_DEBUG
-        debugf_debug("Looking for available memory at address %p\n", cur_node);
-#endif
+// returns NULL if the current CPU has no cache of its own
+static pmm_pcp_t *get_pcp() {
+    return this_cpu_ptr(pcp_caches);
+}
+
+// @note interrupts must be disabled
+static void pcp_refill(pmm_pcp_t *pcp) {
+    pmm_zone_t *zone = &zones[local_node()];
 
-        if (cur_node->length >= PFRAME_SIZE)
+    uint64_t flags = zone_lock(zone);
+    while (pcp->count < PMM_PCP_BATCH) {
+        page_t *block = buddy_alloc_block(zone, 0);
+        if (block == NULL)
             break;
 
-// if not, go to the next block
-#ifdef CONFIG_PMM_DEBUG
-        debugf_debug("Not enough memory found at %p. Going on...", cur_node);
-#endif
+        pcp->frames[pcp->count++] = (uint64_t)page_to_pfn(block) * PFRAME_SIZE;
     }
+    zone_unlock(zone, flags);
 
-    // if we've got here and nothing was found, then kernel panic
-    if (cur_node == NULL) {
-        kprintf_panic("OUT OF MEMORY!!\n");
-        _hcf();
+    pcp->stats.refills++;
+}
+
+// every frame goes back to the zone it came from, which isn't the local one
+// for frames cached before pmm_numa_init()
+// @note interrupts must be disabled
+static void pcp_drain(pmm_pcp_t *pcp, size_t frames) {
+    pmm_zone_t *zone = NULL;
+    uint64_t flags   = 0;
+
+    for (; frames > 0 && pcp->count > 0; frames--) {
+        size_t pfn = pcp->frames[--pcp->count] / PFRAME_SIZE;
+        if (PFN_ZONE(pfn) != zone) {
+            if (zone)
+                zone_unlock(zone, flags);
+            zone  = PFN_ZONE(pfn);
+            flags = zone_lock(zone);
+        }
+
+        buddy_free_block(zone, pfn, 0);
     }
 
-#ifdef CONFIG_PMM_DEBUG
-    debugf_debug("allocated %lu byte%sat address %p\n", PFRAME_SIZE,
-                 PFRAME_SIZE > 1 ? "s " : " ", cur_node);
+    if (zone)
+        zone_unlock(zone, flags);
+
+    pcp->stats.drains++;
+}
+
+// @param refill whether to refill the cache from the buddy allocator if it's
+// empty, 0 is returned otherwise
+static uint64_t pcp_alloc(bool refill) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    pmm_pcp_t *pcp = get_pcp();
+    uint64_t phys  = 0;
+    if (pcp) {
+        if (pcp->count > 0) {
+            pcp->stats.hits++;
+        } else if (refill) {
+            pcp->stats.misses++;
+            pcp_refill(pcp);
+        }
+
+        if (pcp->count > 0) {
+            phys = pcp->frames[--pcp->count];
+            pcp->stats.allocs++;
+        }
+    }
+
+    _set_cpu_flags(flags);
+    return phys;
+}
+
+// only frames of the CPU's own node get cached
+static bool pcp_free(uint64_t phys) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    pmm_pcp_t *pcp = get_pcp();
+    if (pcp && PFN_ZONE(phys / PFRAME_SIZE) != &zones[local_node()])
+        pcp = NULL;
+
+    if (pcp) {
+        if (pcp->count == PMM_PCP_SIZE)
+            pcp_drain(pcp, PMM_PCP_BATCH);
+
+        pcp->frames[pcp->count++] = phys;
+        pcp->stats.frees++;
+    }
+
+    _set_cpu_flags(flags);
+    return pcp != NULL;
+}
+
+// counts an allocation or a free that didn't go through the cache, those
+// that did are counted by pcp_alloc() and pcp_free()
+static void pcp_count(bool alloc) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    pmm_pcp_t *pcp = get_pcp();
+    if (pcp && alloc)
+        pcp->stats.allocs++;
+    else if (pcp)
+        pcp->stats.frees++;
+
+    _set_cpu_flags(flags);
+}
+
+// gives all the frames cached by the current CPU back to the buddy allocator
+void pmm_pcp_drain() {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+
+    pmm_pcp_t *pcp = get_pcp();
+    if (pcp && pcp->count > 0)
+        pcp_drain(pcp, pcp->count);
+
+    _set_cpu_flags(flags);
+}
+
+void pmm_pcp_get_stats(uint8_t cpu, pmm_pcp_stats_t *out) {
+    if (out == NULL)
+        return;
+
+    pmm_pcp_t *pcp = per_cpu_ptr(pcp_caches, cpu);
+    if (pcp)
+        *out = pcp->stats;
+    else
+        memset(out, 0, sizeof(*out));
+}
+
+void pmm_pcp_dump() {
+    uint64_t cpu_count = get_bootloader_data()->cpu_count;
+    if (cpu_count == 0)
+        cpu_count = 1;
+
+    for (uint64_t i = 0; i < cpu_count && i < LIMIT_CPU_MAX; i++) {
+        pmm_pcp_t *pcp = per_cpu_ptr(pcp_caches, i);
+        if (pcp == NULL)
+            continue;
+
+        debugf("CPU %llu: %zu/%d cached, %llu hits, %llu misses, %llu refills, "
+               "%llu drains, %llu allocs, %llu frees\n",
+               i, pcp->count, PMM_PCP_SIZE, pcp->stats.hits, pcp->stats.misses,
+               pcp->stats.refills, pcp->stats.drains, pcp->stats.allocs,
+               pcp->stats.frees);
+    }
+}
+
+/*
+        Shrinkers
+*/
+
+static pmm_shrinker_t shrinkers[LIMIT_PMM_SHRINKERS];
+static lock_t shrinker_lock; // also held while the shrinkers run
+
+// @returns false if there's no room for another shrinker
+bool pmm_register_shrinker(pmm_shrinker_t shrinker) {
+    bool registered = false;
+
+    spinlock_acquire(&shrinker_lock);
+    for (int i = 0; i < LIMIT_PMM_SHRINKERS && !registered; i++) {
+        if (shrinkers[i] == NULL) {
+            shrinkers[i] = shrinker;
+            registered   = true;
+        }
+    }
+    spinlock_release(&shrinker_lock);
+
+    return registered;
+}
+
+void pmm_unregister_shrinker(pmm_shrinker_t shrinker) {
+    spinlock_acquire(&shrinker_lock);
+    for (int i = 0; i < LIMIT_PMM_SHRINKERS; i++) {
+        if (shrinkers[i] == shrinker)
+            shrinkers[i] = NULL;
+    }
+    spinlock_release(&shrinker_lock);
+}
+
+// asks the shrinkers for `frames` page frames, until they've given that many
+// @returns how many frames were given back. Nothing is done if shrinkers are
+// already running, be it on another CPU or further up our own call stack
+size_t pmm_shrink(size_t frames) {
+    if (atomic_flag_test_and_set(&shrinker_lock))
+        return 0;
+
+    size_t freed = 0;
+    for (int i = 0; i < LIMIT_PMM_SHRINKERS && freed < frames; i++) {
+        if (shrinkers[i])
+            freed += shrinkers[i](frames - freed);
+    }
+    spinlock_release(&shrinker_lock);
+
+    return freed;
+}
+
+// true if any zone has dropped below its low watermark
+bool pmm_under_pressure() {
+    for (int node = 0; node < numa_node_count(); node++) {
+        if (zones[node].free_frames < zones[node].watermark_low)
+            return true;
+    }
+
+    return false;
+}
+
+
+// takes a block from the first node of `node`'s fallback list that has one
+// @returns the PFN of the block, 0 if no node could satisfy the request
+static size_t zones_alloc_block(int node, size_t order, size_t pages) {
+    const uint8_t *fallback = numa_fallback_list(node);
+
+    for (int i = 0; i < numa_node_count(); i++) {
+        pmm_zone_t *zone = &zones[fallback[i]];
+
+        uint64_t flags = zone_lock(zone);
+        page_t *block  = buddy_alloc_block(zone, order);
+        if (block != NULL) {
+            size_t pfn = page_to_pfn(block);
+
+            // give back the tail of the block that we don't need
+            size_t tail = ORDER_PAGES(order) - pages;
+            if (tail > 0)
+                buddy_free_range(zone, pfn + pages, tail);
+
+            if (i > 0)
+                zone->fallback_allocs++;
+        }
+        zone_unlock(zone, flags);
+
+        if (block != NULL)
+            return page_to_pfn(block);
+    }
+
+    return 0;
+}
+
+// fills in the page database entries of a freshly allocated block. The order
+// is only recorded if all of the block was kept, the frames past `pages` are
+// somebody else's otherwise
+static void mark_allocated(size_t pfn, size_t pages, size_t order) {
+    for (size_t i = 0; i < pages; i++) {
+        page_t *page   = &page_db[pfn + i];
+        page->refcount = 1;
+        page->flags    = 0;
+        page->order    = 0;
+        page->owner    = PAGE_OWNER_KERNEL;
+        page->private  = NULL;
+    }
+    if (pages == ORDER_PAGES(order))
+        page_db[pfn].order = order;
+}
+
+static void mark_free(size_t pfn, size_t pages) {
+    for (size_t i = 0; i < pages; i++) {
+        page_t *page   = &page_db[pfn + i];
+        page->refcount = 0;
+        page->flags    = 0;
+        page->owner    = PAGE_OWNER_NONE;
+        page->private  = NULL;
+    }
+}
+
+// finding this CPU's histogram takes a LAPIC ID read, which is as slow as the
+// rest of a cached allocation, so timing is left out unless asked for
+#ifdef CONFIG_PMM_LATENCY
+static void lat_record(bool alloc, uint64_t start);
+
+#define LAT_START()              _get_tsc()
+#define LAT_RECORD(alloc, start) lat_record(alloc, start)
+#else
+#define LAT_START()              0
+#define LAT_RECORD(alloc, start) (void)(start)
 #endif
 
-    ptr = (void *)(cur_node);
+static void *alloc_frames(size_t pages, bool zero, int node) {
+    uint64_t start = LAT_START();
 
-    if (cur_node->length - PFRAME_SIZE <= 0) {
-        fl_head = fl_head->next;
-    } else {
-        // we'll "increment" that node
-        freelist_node *new_node = (ptr + PFRAME_SIZE);
-        new_node->length        = (cur_node->length - PFRAME_SIZE);
-        new_node->next          = cur_node->next;
-        fl_head                 = new_node;
+    if (pages == 0)
+        return NULL;
+
+    size_t order = pages_to_order(pages);
+    if (order > PMM_MAX_ORDER) {
+        kprintf_warn("Can't allocate %zu contiguous page frames (max is %zu)\n",
+                     pages, ORDER_PAGES(PMM_MAX_ORDER));
+        return NULL;
     }
 
-    fl_update_nodes();
+    if (node < 0 || node >= numa_node_count())
+        node = local_node();
+
+    size_t pfn  = 0;
+    bool cached = pages == 1 && node == local_node();
+
+    // the per-CPU cache takes no lock, so it comes first. Refilling it takes
+    // the zone lock, and so does the zeroed pool: try that one before
+    if (cached)
+        pfn = pcp_alloc(!zero) / PFRAME_SIZE;
+    bool counted = pfn != 0;
+
+    if (pfn == 0 && pages == 1 && zero) {
+        pfn = zero_pool_pop(&zones[node]) / PFRAME_SIZE;
+        if (pfn != 0)
+            zero = false; // already done by pmm_zero_worker()
+    }
+
+    if (pfn == 0 && cached && zero) {
+        pfn     = pcp_alloc(true) / PFRAME_SIZE;
+        counted = pfn != 0;
+    }
+
+    for (int attempt = 0; pfn == 0 && attempt < 3; attempt++) {
+        // frames sitting in the caches might be what's missing to get a block
+        if (attempt == 1) {
+            pmm_pcp_drain();
+            for (int i = 0; i < numa_node_count(); i++)
+                zero_pool_release(&zones[i]);
+        }
+
+        // last resort, someone might give memory back
+        if (attempt == 2) {
+            if (pmm_shrink(ORDER_PAGES(order)) == 0)
+                break;
+
+            // freed single frames end up in our cache
+            pmm_pcp_drain();
+        }
+
+        pfn = zones_alloc_block(node, order, pages);
+    }
+
+    if (pfn == 0) {
+        kprintf_warn("Out of memory: couldn't allocate %zu page frames\n",
+                     pages);
+        return NULL;
+    }
+
+    pmm_zone_t *zone = PFN_ZONE(pfn);
+    if (zone->free_frames < zone->watermark_low &&
+        !atomic_exchange_explicit(&zone->shrunk, true, memory_order_relaxed))
+        pmm_shrink(zone->watermark_high - zone->free_frames);
 
 #ifdef CONFIG_PMM_DEBUG
-    debugf_debug("old head %p is now %p\n", ptr, fl_head);
-    debugf_debug("\tsize: %zx\n", fl_head->length);
-    debugf_debug("\tnext: %p\n", fl_head->next);
+    debugf_debug("allocated %zu page frame%sat address %llx (order %zu)\n",
+                 pages, pages > 1 ? "s " : " ", (uint64_t)pfn * PFRAME_SIZE,
+                 order);
 #endif
 
+    mark_allocated(pfn, pages, order);
+
     // zero out the whole allocated region
-    memset((void *)ptr, 0, PFRAME_SIZE);
+    if (zero)
+        zero_frames(pfn, pages);
+
+    if (!counted)
+        pcp_count(true);
+
+    LAT_RECORD(true, start);
 
-    // we need the physical address of the free entry
-    return (void *)VIRT_TO_PHYSICAL(ptr);
+    // we need the physical address of the block
+    return (void *)((uint64_t)pfn * PFRAME_SIZE);
+}
+
+// Omar, this is a PAGE FRAME allocator no need for custom <bytes> parameter
+void *pmm_alloc_page() {
+    return alloc_frames(1, true, NUMA_NO_NODE);
 }
 
 void *pmm_alloc_pages(size_t pages) {
-    void *ptr = pmm_alloc_page();
-    for (size_t i = 1; i < pages; i++) {
-        pmm_alloc_page();
-    }
+    return alloc_frames(pages, true, NUMA_NO_NODE);
+}
+
+// same as pmm_alloc_page(), but the frame's contents are left as they are
+void *pmm_alloc_page_nozero() {
+    return alloc_frames(1, false, NUMA_NO_NODE);
+}
+
+void *pmm_alloc_pages_nozero(size_t pages) {
+    return alloc_frames(pages, false, NUMA_NO_NODE);
+}
 
-    return ptr;
+// @param node where the frames should come from. Other nodes are used only
+// when `node` has run out of memory
+void *pmm_alloc_page_node(int node) {
+    return alloc_frames(1, true, node);
 }
 
+void *pmm_alloc_pages_node(size_t pages, int node) {
+    return alloc_frames(pages, true, node);
+}
+
+static void release_frames(size_t pfn, size_t pages) {
+    mark_free(pfn, pages);
+
+    if (pages == 1 && pcp_free((uint64_t)pfn * PFRAME_SIZE))
+        return;
+
+    pcp_count(false);
+
+    // the range can cross a node boundary, each zone gets its own part back
+    size_t end = pfn + pages;
+    while (pfn < end) {
+        pmm_zone_t *zone = PFN_ZONE(pfn);
+        size_t run       = pfn + 1;
+        while (run < end && PFN_ZONE(run) == zone)
+            run++;
+
+        uint64_t flags = zone_lock(zone);
+        buddy_free_range(zone, pfn, run - pfn);
+        zone_unlock(zone, flags);
+
+        pfn = run;
+    }
+}
+
+// @param ptr either the physical or the HHDM address of the first frame
 void pmm_free(void *ptr, size_t pages) {
-    pmm_frees++;
-#ifdef CONFIG_PMM_DEBUG
-    debugf_debug("--- Deallocation n.%d ---\n", pmm_frees);
+    uint64_t start = LAT_START();
 
+#ifdef CONFIG_PMM_DEBUG
     debugf_debug("deallocating address range %p-%p\n\n", ptr,
                  ptr + (pages * PFRAME_SIZE));
 #endif
 
-    freelist_node *fl_deallocated = (freelist_node *)PHYS_TO_VIRTUAL(ptr);
-    fl_deallocated->length        = PFRAME_SIZE * pages;
-    fl_deallocated->next          = NULL;
+    size_t pfn = VIRT_TO_PHYSICAL(ptr) / PFRAME_SIZE;
+    if (pfn == 0 || pfn + pages > frame_count) {
+        debugf_warn("Attempted to free invalid range %p (%zu pages)\n", ptr,
+                    pages);
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++) {
+        if (page_db[pfn + i].refcount == 0) {
+            debugf_warn("Double free of page frame %llx\n",
+                        (uint64_t)(pfn + i) * PFRAME_SIZE);
+            return;
+        }
+    }
+
+    release_frames(pfn, pages);
+
+    LAT_RECORD(false, start);
+}
+
+/*
+        Grows an allocation of `pages` frames starting at `ptr` by `extra`
+   frames, if the ones right after it are free. The new frames aren't zeroed.
 
-    // add the node to end of list
+        @returns false if they aren't, the allocation is left as it is then
+*/
+bool pmm_extend(void *ptr, size_t pages, size_t extra) {
+    size_t pfn = VIRT_TO_PHYSICAL(ptr) / PFRAME_SIZE + pages;
+    if (extra == 0)
+        return true;
+    if (pfn + extra > frame_count ||
+        page_db[pfn].node != page_db[pfn - 1].node)
+        return false;
+
+    pmm_zone_t *zone = PFN_ZONE(pfn);
+    uint64_t flags   = zone_lock(zone);
+    bool claimed     = buddy_claim_range(zone, pfn, extra);
+    zone_unlock(zone, flags);
+
+    if (claimed) {
+        mark_allocated(pfn, extra, 0);
+
+        // same owner as the rest of the allocation
+        for (size_t i = 0; i < extra; i++)
+            page_db[pfn + i].owner = page_db[pfn - 1].owner;
+    }
+
+    return claimed;
+}
+
+/*
+        Returns zeroed, physically contiguous frames below 4GiB from the DMA
+   zone. Frames are tagged with PAGE_DMA and can be given back with
+   pmm_free().
+
+        @returns NULL if the DMA zone has no block big enough
+*/
+void *pmm_alloc_dma(size_t pages) {
+    size_t order = pages_to_order(pages);
+    if (pages == 0 || order > PMM_MAX_ORDER)
+        return NULL;
+
+    uint64_t flags = zone_lock(&dma_zone);
+    page_t *block  = buddy_alloc_block(&dma_zone, order);
+    if (block != NULL && ORDER_PAGES(order) > pages) {
+        buddy_free_range(&dma_zone, page_to_pfn(block) + pages,
+                         ORDER_PAGES(order) - pages);
+    }
+    zone_unlock(&dma_zone, flags);
+
+    if (block == NULL) {
+        debugf_warn("No %zu contiguous page frames left in the DMA zone\n",
+                    pages);
+        return NULL;
+    }
+
+    size_t pfn = page_to_pfn(block);
+    mark_allocated(pfn, pages, order);
+    for (size_t i = 0; i < pages; i++) {
+        page_db[pfn + i].flags = PAGE_DMA;
+        page_db[pfn + i].owner = PAGE_OWNER_DRIVER;
+    }
+
+    zero_frames(pfn, pages);
+
+    return (void *)((uint64_t)pfn * PFRAME_SIZE);
+}
+
+/*
+        Returns naturally aligned, physically contiguous and zeroed huge frames.
+   2MiB frames come from the buddy allocator when possible, then from the
+   reserved pool. 1GiB frames only come from the reserved pool.
+
+        @param size either PAGE_2M or PAGE_1G
+        @returns NULL if there are no frames of that size left
+*/
+void *pmm_alloc_huge(size_t size) {
+    huge_pool_t *pool;
+    size_t order;
+    if (size == PAGE_2M) {
+        pool  = &huge_2m_pool;
+        order = HUGE_2M_ORDER;
+    } else if (size == PAGE_1G) {
+        pool  = &huge_1g_pool;
+        order = HUGE_1G_ORDER;
+    } else {
+        kprintf_warn("Invalid huge frame size %zx\n", size);
+        return NULL;
+    }
+
+    size_t pfn = 0;
+    if (order <= PMM_MAX_ORDER)
+        pfn = zones_alloc_block(local_node(), order, ORDER_PAGES(order));
+
+    if (pfn == 0) {
+        uint64_t flags = _get_cpu_flags();
+        asm("cli");
+        spinlock_acquire(&huge_lock);
+
+        page_t *page = huge_pool_pop(pool);
+
+        spinlock_release(&huge_lock);
+        _set_cpu_flags(flags);
+
+        if (page == NULL)
+            return NULL;
+
+        pfn = page_to_pfn(page);
+    }
+
+    mark_allocated(pfn, ORDER_PAGES(order), order);
+    page_db[pfn].flags |= PAGE_HUGE;
+
+    zero_frames(pfn, ORDER_PAGES(order));
+
+    return (void *)((uint64_t)pfn * PFRAME_SIZE);
+}
+
+// @param ptr either the physical or the HHDM address of the huge frame
+void pmm_free_huge(void *ptr, size_t size) {
+    size_t pfn   = VIRT_TO_PHYSICAL(ptr) / PFRAME_SIZE;
+    page_t *page = pfn_to_page(pfn);
+
+    size_t order = size == PAGE_1G ? HUGE_1G_ORDER : HUGE_2M_ORDER;
+    if (page == NULL || !(page->flags & PAGE_HUGE) || page->order != order) {
+        debugf_warn("%p is not a huge frame of size %zx\n", ptr, size);
+        return;
+    }
+
+    mark_free(pfn, ORDER_PAGES(order));
+
+    huge_pool_t *pool = order == HUGE_1G_ORDER ? &huge_1g_pool : &huge_2m_pool;
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&huge_lock);
+
+    // refill the reserve first. 1GiB frames are bigger than any buddy block,
+    // they only ever come from the pool so they always go back there
+    bool pooled = order == HUGE_1G_ORDER || pool->count < pool->reserved;
+    if (pooled)
+        huge_pool_push(pool, pfn);
+
+    spinlock_release(&huge_lock);
+    _set_cpu_flags(flags);
+
+    if (!pooled) {
+        pmm_zone_t *zone = PFN_ZONE(pfn);
+        flags            = zone_lock(zone);
+        buddy_free_block(zone, pfn, order);
+        zone_unlock(zone, flags);
+    }
+}
+
+/*
+        Statistics
+*/
+
+static const char *owner_names[PAGE_OWNER_COUNT] = {
+    "none", "kernel", "paging", "vmm", "heap", "sched", "driver",
+};
+
+// counters are per CPU and updated without locks: a preempted caller can
+// lose a sample now and then, which is fine for statistics
+#ifdef CONFIG_PMM_LATENCY
+static void lat_record(bool alloc, uint64_t start) {
+    uint64_t cycles = _get_tsc() - start;
+
+    pmm_pcp_t *pcp = get_pcp();
+    if (pcp == NULL)
+        return;
+
+    pmm_lat_hist_t *hist = alloc ? &pcp->alloc_lat : &pcp->free_lat;
+
+    size_t bucket = 0;
+    while (bucket < PMM_LAT_BUCKETS - 1 &&
+           cycles >= ((uint64_t)1 << (bucket + PMM_LAT_SHIFT)))
+        bucket++;
+
+    hist->buckets[bucket]++;
+    hist->total_cycles += cycles;
+    if (cycles > hist->max_cycles)
+        hist->max_cycles = cycles;
+}
+#endif
+
+// snprintf() that appends at `len`, counting what didn't fit like it does
+static size_t stats_printf(char *buf, size_t size, size_t len,
+                           const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int written = len < size ? npf_vsnprintf(buf + len, size - len, fmt, args)
+                             : npf_vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    return written > 0 ? len + written : len;
+}
+
+static size_t stats_format_zone(char *buf, size_t size, size_t len,
+                                const char *name, pmm_zone_t *zone) {
+    len = stats_printf(buf, size, len,
+                       "%s: %zu/%zu frames free, watermarks %zu/%zu\n", name,
+                       zone->free_frames, zone->total_frames,
+                       zone->watermark_low, zone->watermark_high);
+
+    len = stats_printf(buf, size, len, "  blocks per order:");
+    for (size_t order = 0; order <= PMM_MAX_ORDER; order++)
+        len = stats_printf(buf, size, len, " %zu",
+                           zone->free_areas[order].count);
+
+    return stats_printf(buf, size, len, "\n");
+}
+
+#ifdef CONFIG_PMM_LATENCY
+static size_t stats_format_lat(char *buf, size_t size, size_t len,
+                               const char *name, bool alloc) {
+    pmm_lat_hist_t sum = {0};
+    for (size_t i = 0; i < LIMIT_CPU_MAX; i++) {
+        pmm_pcp_t *pcp = per_cpu_ptr(pcp_caches, i);
+        if (pcp == NULL)
+            continue;
+
+        pmm_lat_hist_t *hist = alloc ? &pcp->alloc_lat : &pcp->free_lat;
+
+        for (size_t b = 0; b < PMM_LAT_BUCKETS; b++)
+            sum.buckets[b] += hist->buckets[b];
+        sum.total_cycles += hist->total_cycles;
+        if (hist->max_cycles > sum.max_cycles)
+            sum.max_cycles = hist->max_cycles;
+    }
+
+    uint64_t calls = 0;
+    for (size_t b = 0; b < PMM_LAT_BUCKETS; b++)
+        calls += sum.buckets[b];
+
+    len = stats_printf(buf, size, len,
+                       "%s latency: %llu calls, avg %llu, max %llu cycles\n",
+                       name, calls, calls ? sum.total_cycles / calls : 0,
+                       sum.max_cycles);
+
+    for (size_t b = 0; b < PMM_LAT_BUCKETS; b++) {
+        if (sum.buckets[b] == 0)
+            continue;
+
+        if (b == PMM_LAT_BUCKETS - 1)
+            len = stats_printf(buf, size, len, "  >= %llu: %llu\n",
+                               (uint64_t)1 << (b + PMM_LAT_SHIFT - 1),
+                               sum.buckets[b]);
+        else
+            len = stats_printf(buf, size, len, "  < %llu: %llu\n",
+                               (uint64_t)1 << (b + PMM_LAT_SHIFT),
+                               sum.buckets[b]);
+    }
+
+    return len;
+}
+#endif
+
+// the page database is walked without taking any lock, so the numbers can be
+// slightly off while other CPUs allocate
+size_t pmm_stats_format(char *buf, size_t size) {
+    size_t len = 0;
+    char name[16];
+
+    for (int i = 0; i < numa_node_count(); i++) {
+        snprintf(name, sizeof(name), "node %d", i);
+        len = stats_format_zone(buf, size, len, name, &zones[i]);
+    }
+    if (dma_zone.total_frames > 0)
+        len = stats_format_zone(buf, size, len, "dma", &dma_zone);
+
+    size_t owned[PAGE_OWNER_COUNT] = {0};
+    size_t run = 0, largest_run = 0;
+    for (size_t pfn = 0; pfn < frame_count;) {
+        page_t *page = &page_db[pfn];
+
+        if (page->flags & PAGE_FREE) {
+            size_t order = page->order > PMM_MAX_ORDER ? 0 : page->order;
+            run += ORDER_PAGES(order);
+            pfn += ORDER_PAGES(order);
+            if (run > largest_run)
+                largest_run = run;
+            continue;
+        }
+
+        run = 0;
+        if (page->refcount > 0 && page->owner < PAGE_OWNER_COUNT)
+            owned[page->owner]++;
+        pfn++;
+    }
+
+    // the per-CPU counters, added together
+    pmm_pcp_stats_t calls = {0};
+    for (size_t i = 0; i < LIMIT_CPU_MAX; i++) {
+        pmm_pcp_t *pcp = per_cpu_ptr(pcp_caches, i);
+        if (pcp == NULL)
+            continue;
+
+        calls.allocs += pcp->stats.allocs;
+        calls.frees  += pcp->stats.frees;
+        calls.hits   += pcp->stats.hits;
+        calls.misses += pcp->stats.misses;
+    }
+
+    len = stats_printf(buf, size, len,
+                       "%llu allocations (%llu cache hits, %llu misses), "
+                       "%llu frees\n",
+                       calls.allocs, calls.hits, calls.misses, calls.frees);
+
+    len = stats_printf(buf, size, len,
+                       "largest free run: %zu frames (%zu KBytes)\n",
+                       largest_run, largest_run * PFRAME_SIZE / 1024);
+
+    len = stats_printf(buf, size, len, "frames in use by:");
+    for (size_t i = PAGE_OWNER_KERNEL; i < PAGE_OWNER_COUNT; i++)
+        len = stats_printf(buf, size, len, " %s=%zu", owner_names[i],
+                           owned[i]);
+    len = stats_printf(buf, size, len, "\n");
+
+    len = stats_printf(buf, size, len,
+                       "huge pools: %zu/%zu 2MiB, %zu/%zu 1GiB\n",
+                       huge_2m_pool.count, huge_2m_pool.reserved,
+                       huge_1g_pool.count, huge_1g_pool.reserved);
+
+#ifdef CONFIG_PMM_LATENCY
+    len = stats_format_lat(buf, size, len, "alloc", true);
+    len = stats_format_lat(buf, size, len, "free", false);
+#endif
+
+    return len;
+}
+
+void pmm_stats_dump() {
+    static char report[PMM_STATS_REPORT_SIZE];
+    static lock_t report_lock;
+
+    spinlock_acquire(&report_lock);
+    size_t len = pmm_stats_format(report, sizeof(report));
+    debugf_impl(report, len < sizeof(report) ? len : sizeof(report) - 1);
+    spinlock_release(&report_lock);
+}
+
+/*
+        Page database
+*/
+
+// @returns NULL if the frame isn't covered by the page database
+page_t *pfn_to_page(size_t pfn) {
+    if (pfn >= frame_count)
+        return NULL;
+
+    return &page_db[pfn];
+}
+
+size_t page_to_pfn(page_t *page) {
+    return page - page_db;
+}
+
+page_t *phys_to_page(void *ptr) {
+    return pfn_to_page(VIRT_TO_PHYSICAL(ptr) / PFRAME_SIZE);
+}
+
+void page_tag(void *ptr, size_t pages, uint8_t owner, uint8_t flags) {
+    size_t pfn = VIRT_TO_PHYSICAL(ptr) / PFRAME_SIZE;
+    for (size_t i = 0; i < pages && pfn + i < frame_count; i++) {
+        page_db[pfn + i].owner  = owner;
+        page_db[pfn + i].flags |= flags;
+    }
+}
+
+void page_get(page_t *page) {
+    atomic_fetch_add(&page->refcount, 1);
+}
+
+bool page_put(page_t *page) {
+    if (page->refcount == 0) {
+        debugf_warn("Page frame %llx has no references to drop\n",
+                    (uint64_t)page_to_pfn(page) * PFRAME_SIZE);
+        return false;
+    }
 
-    freelist_node *fl_last = NULL;
-    for (fl_last = fl_head; fl_last->next != NULL; fl_last = fl_last->next)
-        ;
+    if (atomic_fetch_sub(&page->refcount, 1) != 1)
+        return false;
 
-    fl_last->next = fl_deallocated;
+    release_frames(page_to_pfn(page), 1);
+    return true;
 }
@@ -8,6 +8,65 @@
 
 #define PFRAME_SIZE 0x1000 // each page frame is 4KB wide
 
+// largest buddy block is 2^PMM_MAX_ORDER page frames (4MiB)
+#define PMM_MAX_ORDER 10
+
+// huge page frame sizes, see pmm_alloc_huge()
+#define PAGE_2M 0x200000
+#define PAGE_1G 0x40000000
+
+// per-CPU page frame caches ("magazines")
+#define PMM_PCP_SIZE  64 // frames cached per CPU
+#define PMM_PCP_BATCH 16 // frames moved at once from/to the buddy allocator
+
+// pool of pre-zeroed page frames, filled by pmm_zero_worker()
+#define PMM_ZERO_POOL_SIZE 256 // frames kept zeroed per node (1MiB)
+#define PMM_ZERO_BATCH     8   // frames zeroed per pmm_zero_worker() call
+
+// watermarks as fractions of a zone's frames, see pmm_register_shrinker()
+#define PMM_WMARK_LOW_DIV  128 // ~0.8%
+#define PMM_WMARK_HIGH_DIV 64  // ~1.6%
+
+// gives memory back to the PMM when it's running low. Shrinkers run with
+// interrupts in whatever state the allocating caller left them, so they must
+// not wait on locks that might be held around an allocation
+// @param frames how many page frames the PMM would like to get back
+// @returns how many page frames were actually freed
+typedef size_t (*pmm_shrinker_t)(size_t frames);
+
+typedef struct pmm_pcp_stats {
+    uint64_t hits;    // single frame allocations served by the cache
+    uint64_t misses;  // single frame allocations that found the cache empty
+    uint64_t refills; // batches pulled from the buddy allocator
+    uint64_t drains;  // batches given back to the buddy allocator
+
+    // every allocation and free made on the CPU, cached or not. Those made
+    // before pmm_pcp_init() aren't counted
+    uint64_t allocs;
+    uint64_t frees;
+} pmm_pcp_stats_t;
+
+typedef struct pmm_node_stats {
+    size_t total_frames;
+    size_t free_frames; // cached ones included
+    size_t used_frames;
+    uint64_t fallback_allocs; // allocations served here for another node
+} pmm_node_stats_t;
+
+// latency histograms: bucket i counts the calls that took less than
+// 2^(i + PMM_LAT_SHIFT) TSC cycles, the last one also the slower ones
+#define PMM_LAT_BUCKETS 16
+#define PMM_LAT_SHIFT   7
+
+// big enough for pmm_stats_format() on any machine we support
+#define PMM_STATS_REPORT_SIZE 4096
+
+typedef struct pmm_lat_hist {
+    uint64_t buckets[PMM_LAT_BUCKETS];
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+} pmm_lat_hist_t;
+
 extern struct bootloader_data limine_parsed_data;
 #define HHDM_OFFSET limine_parsed_data.hhdm_offset
 
@@ -21,8 +80,49 @@ extern struct bootloader_data limine_parsed_data;
 
 void pmm_init();
 
+// all pmm_alloc_* functions return NULL when memory runs out
 void *pmm_alloc_page();
+// returns `pages` physically contiguous page frames
 void *pmm_alloc_pages(size_t pages);
+// for frames that are going to be overwritten entirely anyway
+void *pmm_alloc_page_nozero();
+void *pmm_alloc_pages_nozero(size_t pages);
+// prefer frames from a NUMA node other than the calling CPU's one
+void *pmm_alloc_page_node(int node);
+void *pmm_alloc_pages_node(size_t pages, int node);
 void pmm_free(void *ptr, size_t pages);
+// grows an allocation in place, if the frames after it are free
+bool pmm_extend(void *ptr, size_t pages, size_t extra);
+
+// frames below 4GiB, for devices that can't address more than that
+void *pmm_alloc_dma(size_t pages);
+
+void *pmm_alloc_huge(size_t size);
+void pmm_free_huge(void *ptr, size_t size);
+
+size_t pmm_get_free_frames();
+size_t pmm_get_zeroed_frames();
+
+void pmm_zero_worker();
+
+bool pmm_register_shrinker(pmm_shrinker_t shrinker);
+void pmm_unregister_shrinker(pmm_shrinker_t shrinker);
+size_t pmm_shrink(size_t frames);
+bool pmm_under_pressure();
+
+void pmm_numa_init();
+void pmm_get_node_stats(int node, pmm_node_stats_t *out);
+void pmm_node_dump();
+
+// needs percpu_init() to have run
+void pmm_pcp_init();
+void pmm_pcp_drain();
+void pmm_pcp_get_stats(uint8_t cpu, pmm_pcp_stats_t *out);
+void pmm_pcp_dump();
+
+// writes a human readable report of the allocator's state into `buf`
+// @returns the length of the full report, like snprintf()
+size_t pmm_stats_format(char *buf, size_t size);
+void pmm_stats_dump();
 
 #endif
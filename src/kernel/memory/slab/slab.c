@@ -0,0 +1,449 @@
+/*
+        Slab allocator
+
+        Every cache hands out objects of a single size. Objects are carved
+   out of slabs, runs of 2^order page frames taken straight from the PMM and
+   accessed through the HHDM. Each slab starts with its descriptor, followed
+   by the objects, and keeps its free objects on a list linked through the
+   objects themselves.
+
+        Slabs sit on one of three lists: partial ones are allocated from
+   first, then empty ones, and full ones are left alone. A cache only keeps
+   a few empty slabs around, the rest goes back to the PMM as soon as it
+   empties, and the PMM can ask for the kept ones too when it runs low.
+
+        The space left over at the end of a slab is used to shift the first
+   object by a different amount of cache lines in every new slab ("colouring"),
+   so that objects at the same index in different slabs don't all compete for
+   the same cache sets.
+
+        Every frame of a slab has PAGE_SLAB set, and page_t.private pointing
+   to the slab, which is how kmem_cache_free() finds it.
+
+        (C) RepubblicaTech 2024
+*/
+
+#include "slab.h"
+
+#include <memory/pmm/pmm.h>
+
+#include <util/string.h>
+#include <util/util.h>
+
+#include <stdio.h>
+
+#include <cpu.h>
+#include <spinlock.h>
+
+#include <autoconf.h>
+
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+
+    kmem_cache_t *cache;
+    void *free; // first free object
+    size_t inuse;
+} slab_t;
+
+struct kmem_cache {
+    char name[KMEM_CACHE_NAME_MAX];
+    size_t size;        // what the user asked for
+    size_t stride;      // distance between two objects
+    size_t align;
+    size_t free_offset; // where the free list link is inside an object
+    kmem_ctor_t ctor;
+
+    size_t order;
+    size_t objects_per_slab;
+    size_t first_offset; // of the first object, without colouring
+    size_t colour_step;
+    size_t colour_count;
+    size_t colour_next;
+
+    // cache locks are also taken from interrupt context, so interrupts stay
+    // off while one is held
+    lock_t lock;
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+    size_t empty_count;
+
+    kmem_cache_stats_t stats;
+
+    struct kmem_cache *next; // in cache_list
+};
+
+// caches are slab objects too
+static kmem_cache_t cache_cache;
+
+static kmem_cache_t *cache_list;
+static lock_t cache_list_lock;
+
+static uint64_t cache_lock(kmem_cache_t *cache) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&cache->lock);
+
+    return flags;
+}
+
+static void cache_unlock(kmem_cache_t *cache, uint64_t flags) {
+    spinlock_release(&cache->lock);
+    _set_cpu_flags(flags);
+}
+
+static void slab_list_push(slab_t **head, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(slab_t **head, slab_t *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+#define FREE_LINK(cache, obj)                                                  \
+    (*(void **)((uint8_t *)(obj) + (cache)->free_offset))
+
+// works out how objects are laid out in a slab
+// @returns false if not even one object fits in the biggest slab
+static bool cache_layout(kmem_cache_t *cache) {
+    size_t obj_size = cache->size;
+
+    // the constructed state has to survive while the object is free, so the
+    // link goes past its end
+    if (cache->ctor) {
+        cache->free_offset = ROUND_UP(obj_size, sizeof(void *));
+        obj_size           = cache->free_offset + sizeof(void *);
+    } else {
+        cache->free_offset = 0;
+        if (obj_size < sizeof(void *))
+            obj_size = sizeof(void *);
+    }
+
+    cache->stride       = ROUND_UP(obj_size, cache->align);
+    cache->first_offset = ROUND_UP(sizeof(slab_t), cache->align);
+
+    size_t avail = 0;
+    for (cache->order = 0; cache->order <= KMEM_SLAB_MAX_ORDER;
+         cache->order++) {
+        avail = (PFRAME_SIZE << cache->order) - cache->first_offset;
+        cache->objects_per_slab = avail / cache->stride;
+        if (cache->objects_per_slab >= KMEM_SLAB_MIN_OBJECTS)
+            break;
+    }
+
+    if (cache->order > KMEM_SLAB_MAX_ORDER) {
+        cache->order = KMEM_SLAB_MAX_ORDER;
+        if (cache->objects_per_slab == 0)
+            return false;
+    }
+
+    cache->colour_step = cache->align > CACHE_LINE_SIZE ? cache->align
+                                                        : CACHE_LINE_SIZE;
+    cache->colour_count =
+        (avail - cache->objects_per_slab * cache->stride) / cache->colour_step +
+        1;
+    cache->colour_next = 0;
+
+    return true;
+}
+
+static void cache_setup(kmem_cache_t *cache, const char *name, size_t size,
+                        size_t align, kmem_ctor_t ctor) {
+    memset(cache, 0, sizeof(kmem_cache_t));
+    strncpy(cache->name, name, KMEM_CACHE_NAME_MAX - 1);
+    cache->size  = size;
+    cache->align = align;
+    cache->ctor  = ctor;
+}
+
+// allocates and fills in a new slab, that is not on any list yet
+static slab_t *cache_grow(kmem_cache_t *cache, size_t colour) {
+    size_t pages = (size_t)1 << cache->order;
+    void *frames = pmm_alloc_pages_nozero(pages);
+    if (frames == NULL)
+        return NULL;
+
+    page_tag(frames, pages, PAGE_OWNER_HEAP, PAGE_SLAB);
+
+    slab_t *slab = (slab_t *)PHYS_TO_VIRTUAL(frames);
+    slab->next   = NULL;
+    slab->prev   = NULL;
+    slab->cache  = cache;
+    slab->inuse  = 0;
+
+    page_t *page = phys_to_page(frames);
+    for (size_t i = 0; i < pages; i++)
+        page[i].private = slab;
+
+    // chain the objects in address order, the last one links to NULL
+    uint8_t *obj = (uint8_t *)slab + cache->first_offset +
+                   colour * cache->colour_step;
+    slab->free   = obj;
+    for (size_t i = 0; i < cache->objects_per_slab; i++) {
+        if (cache->ctor)
+            cache->ctor(obj);
+
+        uint8_t *next         = obj + cache->stride;
+        FREE_LINK(cache, obj) = i + 1 < cache->objects_per_slab ? next : NULL;
+        obj                   = next;
+    }
+
+    return slab;
+}
+
+static size_t slab_release(slab_t *slab) {
+    size_t pages = (size_t)1 << slab->cache->order;
+    pmm_free(slab, pages);
+
+    return pages;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint64_t flags = cache_lock(cache);
+
+    slab_t *slab = cache->partial;
+    if (slab == NULL && cache->empty) {
+        slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        slab_list_push(&cache->partial, slab);
+        cache->empty_count--;
+    }
+
+    if (slab == NULL) {
+        // the PMM might call shrinkers, and those take cache locks
+        size_t colour      = cache->colour_next;
+        cache->colour_next = (colour + 1) % cache->colour_count;
+        cache_unlock(cache, flags);
+
+        slab = cache_grow(cache, colour);
+        if (slab == NULL)
+            return NULL;
+
+        flags = cache_lock(cache);
+        slab_list_push(&cache->partial, slab);
+        cache->stats.slabs++;
+    }
+
+    void *obj  = slab->free;
+    slab->free = FREE_LINK(cache, obj);
+    slab->inuse++;
+
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->stats.objects_inuse++;
+    cache->stats.allocs++;
+    cache_unlock(cache, flags);
+
+    return obj;
+}
+
+// zeroing wipes what the constructor set up, so it runs again afterwards
+void *kmem_cache_zalloc(kmem_cache_t *cache) {
+    void *obj = kmem_cache_alloc(cache);
+    if (obj) {
+        memset(obj, 0, cache->size);
+        if (cache->ctor)
+            cache->ctor(obj);
+    }
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (obj == NULL)
+        return;
+
+    page_t *page = phys_to_page(obj);
+    slab_t *slab = page && (page->flags & PAGE_SLAB) ? page->private : NULL;
+    if (slab == NULL || slab->cache != cache) {
+        debugf_warn("Object %p doesn't belong to cache %s\n", obj,
+                    cache->name);
+        return;
+    }
+
+    slab_t *to_release = NULL;
+
+    uint64_t flags = cache_lock(cache);
+    FREE_LINK(cache, obj) = slab->free;
+    slab->free            = obj;
+
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    slab->inuse--;
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty_count < KMEM_SLAB_EMPTY_MAX) {
+            slab_list_push(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            to_release = slab;
+            cache->stats.slabs--;
+        }
+    }
+
+    cache->stats.objects_inuse--;
+    cache->stats.frees++;
+    cache_unlock(cache, flags);
+
+    if (to_release)
+        slab_release(to_release);
+}
+
+// @note the cache lock must be held
+static slab_t *cache_take_empty(kmem_cache_t *cache) {
+    slab_t *empty = cache->empty;
+
+    cache->stats.slabs -= cache->empty_count;
+    cache->empty        = NULL;
+    cache->empty_count  = 0;
+
+    return empty;
+}
+
+static size_t release_slabs(slab_t *slab) {
+    size_t freed = 0;
+    while (slab) {
+        slab_t *next  = slab->next;
+        freed        += slab_release(slab);
+        slab          = next;
+    }
+
+    return freed;
+}
+
+size_t kmem_cache_shrink(kmem_cache_t *cache) {
+    uint64_t flags = cache_lock(cache);
+    slab_t *empty  = cache_take_empty(cache);
+    cache_unlock(cache, flags);
+
+    return release_slabs(empty);
+}
+
+// PMM shrinker: allocations can happen with any lock held, so busy caches
+// are skipped rather than waited on
+static size_t slab_shrinker(size_t frames) {
+    if (atomic_flag_test_and_set(&cache_list_lock))
+        return 0;
+
+    size_t freed = 0;
+    for (kmem_cache_t *cache = cache_list; cache && freed < frames;
+         cache = cache->next) {
+        uint64_t flags = _get_cpu_flags();
+        asm("cli");
+
+        slab_t *empty = NULL;
+        if (!atomic_flag_test_and_set(&cache->lock)) {
+            empty = cache_take_empty(cache);
+            spinlock_release(&cache->lock);
+        }
+        _set_cpu_flags(flags);
+
+        freed += release_slabs(empty);
+    }
+    spinlock_release(&cache_list_lock);
+
+    return freed;
+}
+
+void kmem_cache_init() {
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t),
+                sizeof(void *), NULL);
+    cache_layout(&cache_cache);
+    cache_list = &cache_cache;
+
+    if (!pmm_register_shrinker(slab_shrinker))
+        kprintf_warn("Couldn't register the slab shrinker\n");
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                kmem_ctor_t ctor) {
+    if (size == 0)
+        return NULL;
+
+    if (align == 0)
+        align = sizeof(void *);
+    if (align & (align - 1)) {
+        debugf_warn("Cache %s: alignment %zu is not a power of 2\n", name,
+                    align);
+        return NULL;
+    }
+
+    kmem_cache_t *cache = kmem_cache_alloc(&cache_cache);
+    if (cache == NULL)
+        return NULL;
+
+    cache_setup(cache, name, size, align, ctor);
+    if (!cache_layout(cache)) {
+        debugf_warn("Cache %s: %zu bytes objects don't fit in a slab\n", name,
+                    size);
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    spinlock_acquire(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list  = cache;
+    spinlock_release(&cache_list_lock);
+
+    return cache;
+}
+
+// objects still in use are leaked, along with their slabs
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (cache == NULL || cache == &cache_cache)
+        return;
+
+    spinlock_acquire(&cache_list_lock);
+    kmem_cache_t **link = &cache_list;
+    while (*link && *link != cache)
+        link = &(*link)->next;
+    if (*link)
+        *link = cache->next;
+    spinlock_release(&cache_list_lock);
+
+    if (cache->stats.objects_inuse > 0) {
+        kprintf_warn("Cache %s destroyed with %zu objects still in use\n",
+                     cache->name, cache->stats.objects_inuse);
+    }
+
+    kmem_cache_shrink(cache);
+    kmem_cache_free(&cache_cache, cache);
+}
+
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *out) {
+    if (cache == NULL || out == NULL)
+        return;
+
+    *out = cache->stats;
+}
+
+void kmem_cache_dump() {
+    spinlock_acquire(&cache_list_lock);
+    for (kmem_cache_t *cache = cache_list; cache; cache = cache->next) {
+        debugf("%-24s %5zu bytes (%5zu), %3zu objs/slab (order %zu), %zu "
+               "slabs, %zu objects in use\n",
+               cache->name, cache->size, cache->stride,
+               cache->objects_per_slab, cache->order, cache->stats.slabs,
+               cache->stats.objects_inuse);
+    }
+    spinlock_release(&cache_list_lock);
+}
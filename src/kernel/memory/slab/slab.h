@@ -0,0 +1,52 @@
+#ifndef SLAB_H
+#define SLAB_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KMEM_CACHE_NAME_MAX 32
+
+// slabs are at most 2^KMEM_SLAB_MAX_ORDER page frames
+#define KMEM_SLAB_MAX_ORDER 3
+// smallest amount of objects a slab should hold, if the max order allows it
+#define KMEM_SLAB_MIN_OBJECTS 8
+// empty slabs a cache keeps around before giving them back to the PMM
+#define KMEM_SLAB_EMPTY_MAX 1
+
+typedef struct kmem_cache kmem_cache_t;
+
+// called once for every object when its slab gets created, not on every
+// allocation: objects should be freed back in their constructed state
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct kmem_cache_stats {
+    size_t slabs;
+    size_t objects_inuse;
+    uint64_t allocs;
+    uint64_t frees;
+} kmem_cache_stats_t;
+
+void kmem_cache_init();
+
+// @param align 0 for pointer alignment
+// @param ctor optional
+// @returns NULL if objects are too big for a slab or there's no memory
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                kmem_ctor_t ctor);
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+// same as kmem_cache_alloc(), but the object is zeroed before the cache's
+// constructor (if any) runs on it
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+// gives all the empty slabs of `cache` back to the PMM
+// @returns how many page frames were freed
+size_t kmem_cache_shrink(kmem_cache_t *cache);
+
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *out);
+void kmem_cache_dump();
+
+#endif
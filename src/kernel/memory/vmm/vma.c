@@ -2,73 +2,81 @@
 
 #include <stdio.h>
 
+#include <memory/pmm/page.h>
 #include <memory/pmm/pmm.h>
 #include <paging/paging.h>
 
 #include "util/string.h"
 #include "util/util.h"
 
+#include <cpu.h>
 #include <spinlock.h>
 
 #include <autoconf.h>
 
 // @param phys optional parameter, maps the newly allocated virtual address to
-// such physical address
+// such physical address. Without it the region is demand paged: it gets
+// zeroed page frames one at a time, as it's touched
+// @returns NULL if the VMM ran out of memory
 void *vma_alloc(vmm_context_t *ctx, size_t pages, void *phys) {
+    if (pages == 0)
+        return NULL;
 
-    void *ptr = NULL;
+    uint64_t vmo_flags = ctx->flags | VMO_ALLOCATED;
+    if (phys == NULL)
+        vmo_flags |= VMO_DEMAND;
 
-    virtmem_object_t *cur_vmo = ctx->root_vmo;
-    virtmem_object_t *new_vmo;
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&ctx->lock);
 
-    for (; cur_vmo != NULL; cur_vmo = cur_vmo->next) {
-#ifdef CONFIG_VMM_DEBUG
-        debugf_debug("Checking for available memory\n");
-        vmo_dump(cur_vmo);
-#endif
+    // best fit, so that big gaps stay big
+    virtmem_object_t *prev    = vmo_find_gap(ctx, pages);
+    virtmem_object_t *new_vmo = NULL;
+    if (prev != NULL) {
+        new_vmo = vmo_init(prev->base + prev->len * PFRAME_SIZE, pages,
+                           vmo_flags);
+        if (new_vmo != NULL)
+            vmo_link(ctx, prev, new_vmo);
+    }
 
-        if ((cur_vmo->len >= pages) && (BIT_GET(cur_vmo->flags, 8) == 0)) {
+    spinlock_release(&ctx->lock);
+    _set_cpu_flags(flags);
 
-#ifdef CONFIG_VMM_DEBUG
-            debugf_debug("Well, we've got enough memory :D\n");
-#endif
-            break;
-        }
+    if (new_vmo == NULL) {
+        if (prev == NULL)
+            kprintf_warn("VMM ran out of virtual memory: couldn't find %zu "
+                         "free pages\n",
+                         pages);
+        return NULL;
+    }
 
 #ifdef CONFIG_VMM_DEBUG
-        debugf_debug("Current VMO is either too small or already "
-                     "allocated. Skipping...\n");
+    debugf_debug("VMO %p created after %p\n", new_vmo, prev);
+    vmo_dump(new_vmo);
 #endif
-        if (!cur_vmo->next) {
-            uint64_t offset = (uint64_t)(cur_vmo->len * PFRAME_SIZE);
-            new_vmo         = vmo_init(cur_vmo->base + offset, pages,
-                                       cur_vmo->flags & ~(VMO_ALLOCATED));
-            cur_vmo->next   = new_vmo;
-            new_vmo->prev   = cur_vmo;
-#ifdef CONFIG_VMM_DEBUG
-            debugf_debug("VMO %p created successfully. Proceeding to next "
-                         "iteration\n",
-                         new_vmo);
-#endif
-        }
-    }
 
-    if (cur_vmo == NULL) {
-        kprintf_panic("VMM ran out of memory and is not able to request it "
-                      "from the PMM.\n");
-        _hcf();
-    }
+    void *ptr      = (void *)(new_vmo->base);
+    uint64_t *pml4 = (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table);
 
-    cur_vmo = split_vmo_at(cur_vmo, pages);
-    FLAG_SET(cur_vmo->flags, VMO_ALLOCATED);
+    // no memory for the page tables: take back whatever got mapped
+    if (phys != NULL &&
+        !map_region_to_page(pml4, (uint64_t)phys, (uint64_t)ptr,
+                            (uint64_t)(pages * PFRAME_SIZE),
+                            vmo_to_page_flags(new_vmo->flags))) {
+        kprintf_warn("Out of memory for mapping %zu pages\n", pages);
+        unmap_region(pml4, (uint64_t)ptr, pages * PFRAME_SIZE);
 
-    ptr = (void *)(cur_vmo->base);
+        flags = _get_cpu_flags();
+        asm("cli");
+        spinlock_acquire(&ctx->lock);
+        vmo_unlink(ctx, new_vmo);
+        spinlock_release(&ctx->lock);
+        _set_cpu_flags(flags);
 
-    void *phys_to_map = phys != NULL ? phys : pmm_alloc_pages(pages);
-    map_region_to_page((uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table),
-                       (uint64_t)phys_to_map, (uint64_t)ptr,
-                       (uint64_t)(pages * PFRAME_SIZE),
-                       vmo_to_page_flags(cur_vmo->flags));
+        vmo_free(new_vmo);
+        return NULL;
+    }
 
 #ifdef CONFIG_VMM_DEBUG
     debugf_debug("Returning pointer %p\n", ptr);
@@ -78,27 +86,23 @@ void *vma_alloc(vmm_context_t *ctx, size_t pages, void *phys) {
 }
 
 // @param free do you want to give back the physical address of `ptr` back to
-// the PMM? (this will zero out that region on next allocation)
+// the PMM? (this will zero out that region on next allocation). Demand paged
+// regions always give their frames back, nobody else knows about them, and so
+// do the ones a clone shares with its source
 void vma_free(vmm_context_t *ctx, void *ptr, bool free) {
 
 #ifdef CONFIG_VMM_DEBUG
     debugf_debug("Deallocating pointer %p\n", ptr);
 #endif
 
-    virtmem_object_t *cur_vmo = ctx->root_vmo;
-    for (; cur_vmo != NULL; cur_vmo = cur_vmo->next) {
-#ifdef CONFIG_VMM_DEBUG
-        vmo_dump(cur_vmo);
-#endif
-        if ((uint64_t)ptr == cur_vmo->base) {
-            break;
-        }
-#ifdef CONFIG_VMM_DEBUG
-        debugf_debug("Pointer and vmo->base don't match. Skipping\n");
-#endif
-    }
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&ctx->lock);
 
-    if (cur_vmo == NULL) {
+    virtmem_object_t *vmo = vmo_find(ctx, (uint64_t)ptr);
+    if (vmo == NULL || vmo->base != (uint64_t)ptr || vmo == ctx->root_vmo) {
+        spinlock_release(&ctx->lock);
+        _set_cpu_flags(flags);
 #ifdef CONFIG_VMM_DEBUG
         debugf_debug(
             "Tried to deallocate a non-existing pointer. Quitting...\n");
@@ -106,35 +110,147 @@ void vma_free(vmm_context_t *ctx, void *ptr, bool free) {
         return;
     }
 
-    FLAG_UNSET(cur_vmo->flags, VMO_ALLOCATED);
+    vmo_unlink(ctx, vmo);
 
-    // find the physical address of the VMO
-    uint64_t phys = pg_virtual_to_phys(
-        (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table), cur_vmo->base);
-    if (free)
-        pmm_free((void *)phys, cur_vmo->len);
-    unmap_region((uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table), cur_vmo->base,
-                 (cur_vmo->len * PFRAME_SIZE));
+    spinlock_release(&ctx->lock);
+    _set_cpu_flags(flags);
 
-    virtmem_object_t *to_dealloc = cur_vmo;
-    virtmem_object_t *d_next     = to_dealloc->next;
-    virtmem_object_t *d_prev     = to_dealloc->prev;
-
-    if (cur_vmo == ctx->root_vmo) {
-        ctx->root_vmo       = ctx->root_vmo->next;
-        ctx->root_vmo->prev = NULL;
+    if (vmo->flags & (VMO_DEMAND | VMO_SHARED)) {
+        vmo_release_frames(ctx, vmo);
     } else {
-        cur_vmo = d_next;
-        if (d_next)
-            d_next->prev = d_prev;
-        if (d_prev)
-            d_prev->next = d_next;
+        // find the physical address of the VMO
+        uint64_t phys = pg_virtual_to_phys(
+            (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table), vmo->base);
+        // the frames can only go once no TLB has them anymore
+        unmap_region((uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table), vmo->base,
+                     (vmo->len * PFRAME_SIZE));
+        if (free)
+            vmo_free_frames(phys, vmo->len);
     }
 
 #ifdef CONFIG_VMM_DEBUG
-    debugf_debug("Region %llx destroyed\n", to_dealloc->base);
+    debugf_debug("Region %llx destroyed\n", vmo->base);
 #endif
 
-    size_t vmo_size_aligned = ROUND_UP(sizeof(virtmem_object_t), PFRAME_SIZE);
-    pmm_free(to_dealloc, vmo_size_aligned / PFRAME_SIZE);
+    vmo_free(vmo);
+}
+
+// maps a fresh frame at `page`, if nobody did already
+// @note `ctx->lock` must be held
+static bool demand_map(vmm_context_t *ctx, virtmem_object_t *vmo,
+                       uint64_t page) {
+    uint64_t *pml4 = (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table);
+
+    // another CPU might have got here first
+    uint64_t *entry = pg_find_entry(pml4, page);
+    if (entry != NULL && (*entry & PMLE_PRESENT))
+        return true;
+
+    void *frame = pmm_alloc_page();
+    if (frame != NULL) {
+        page_tag(frame, 1, PAGE_OWNER_VMM, 0);
+
+        // the entry wasn't present, so there's nothing to flush and nobody
+        // to wait for while holding the lock
+        if (map_phys_to_page(pml4, (uint64_t)frame, page,
+                             vmo_to_page_flags(vmo->flags)))
+            return true;
+
+        // no memory for the page tables
+        pmm_free(frame, 1);
+    }
+
+    kprintf_warn("Out of memory for demand paging %llx\n", page);
+    return false;
+}
+
+// called by the page fault handler for faults on non-present pages
+bool vma_fault(vmm_context_t *ctx, uint64_t addr, bool write, bool user) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&ctx->lock);
+
+    virtmem_object_t *vmo = vmo_find(ctx, addr);
+
+    bool allowed = vmo != NULL && (vmo->flags & VMO_DEMAND) &&
+                   (!write || (vmo->flags & VMO_RW)) &&
+                   (!user || (vmo->flags & VMO_USER));
+    bool handled =
+        allowed && demand_map(ctx, vmo, ROUND_DOWN(addr, PFRAME_SIZE));
+
+    spinlock_release(&ctx->lock);
+    _set_cpu_flags(flags);
+
+    return handled;
+}
+
+// gives the context a page of its own in place of one it shares. The entry
+// that changed is added to `batch`, and the frame the context let go of is
+// left in `*shared` for the caller to put once the batch is committed
+// @note `ctx->lock` must be held
+static bool cow_copy(vmm_context_t *ctx, uint64_t page, tlb_batch_t *batch,
+                     page_t **shared) {
+    uint64_t *pml4  = (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table);
+    uint64_t *entry = pg_find_entry(pml4, page);
+    if (entry == NULL || !(*entry & PMLE_PRESENT))
+        return false;
+
+    // another CPU might have got here first
+    if (!(*entry & PMLE_COW))
+        return (*entry & PMLE_WRITE) != 0;
+
+    uint64_t phys     = PG_GET_ADDR(*entry);
+    uint64_t pg_flags = (PG_FLAGS(*entry) & ~PMLE_COW) | PMLE_WRITE;
+    page_t *frame     = phys_to_page((void *)phys);
+
+    // if everybody else already made their own copy, the frame is all ours
+    if (frame->refcount == 1) {
+        *entry = phys | pg_flags;
+        tlb_batch_add(batch, page, PFRAME_SIZE);
+        return true;
+    }
+
+    void *copy = pmm_alloc_page_nozero();
+    if (copy == NULL) {
+        kprintf_warn("Out of memory for copying %llx on write\n", page);
+        return false;
+    }
+    page_tag(copy, 1, PAGE_OWNER_VMM, 0);
+
+    memcpy((void *)PHYS_TO_VIRTUAL(copy), (void *)PHYS_TO_VIRTUAL(phys),
+           PFRAME_SIZE);
+    *entry = (uint64_t)copy | pg_flags;
+    tlb_batch_add(batch, page, PFRAME_SIZE);
+    *shared = frame;
+
+    return true;
+}
+
+// called by the page fault handler for writes to present pages
+bool vma_cow_fault(vmm_context_t *ctx, uint64_t addr, bool user) {
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&ctx->lock);
+
+    virtmem_object_t *vmo = vmo_find(ctx, addr);
+
+    tlb_batch_t batch;
+    tlb_batch_begin(&batch, ctx->pml4_table);
+    page_t *shared = NULL;
+
+    bool allowed = vmo != NULL && (vmo->flags & VMO_DEMAND) &&
+                   (vmo->flags & VMO_RW) && (!user || (vmo->flags & VMO_USER));
+    bool handled = allowed && cow_copy(ctx, ROUND_DOWN(addr, PFRAME_SIZE),
+                                       &batch, &shared);
+
+    spinlock_release(&ctx->lock);
+    _set_cpu_flags(flags);
+
+    // not under the lock, the other CPUs in this context could be spinning on
+    // it with interrupts off
+    tlb_batch_commit(&batch);
+    if (shared != NULL)
+        page_put(shared);
+
+    return handled;
 }
@@ -9,4 +9,10 @@
 void *vma_alloc(vmm_context_t *ctx, size_t pages, void *phys);
 void vma_free(vmm_context_t *ctx, void *ptr, bool free);
 
+// @returns false if `addr` isn't in a demand paged VMO that allows the access,
+// or there's no memory to map it
+bool vma_fault(vmm_context_t *ctx, uint64_t addr, bool write, bool user);
+// @returns false if `addr` isn't on a copy-on-write page of a writable VMO
+bool vma_cow_fault(vmm_context_t *ctx, uint64_t addr, bool user);
+
 #endif
\ No newline at end of file
@@ -1,11 +1,16 @@
 
+#include <memory/pmm/page.h>
+#include <memory/slab/slab.h>
 #include <memory/vmm/vma.h>
 #include <memory/vmm/vmm.h>
 #include <paging/paging.h>
+#include <smp/smp.h>
+#include <smp/tlb.h>
 
 #include <stdint.h>
 #include <stdio.h>
 
+#include <limits.h>
 #include <spinlock.h>
 
 #include <util/string.h>
@@ -17,14 +22,37 @@
 
 #include <cpu.h>
 
-vmm_context_t *current_vmm_ctx;
+// the context CPUs are in until they switch to another one, the kernel's
+static vmm_context_t *default_ctx;
+// indexed by LAPIC ID
+static vmm_context_t *cpu_ctx[LIMIT_CPU_MAX];
+
+static kmem_cache_t *ctx_cache;
+static kmem_cache_t *vmo_cache;
+
+#define VMO_END(vmo) ((vmo)->base + (vmo)->len * PFRAME_SIZE)
+
+// @returns the context of the page tables `cpu` is using
+vmm_context_t *get_cpu_ctx(uint8_t cpu) {
+    if (cpu < LIMIT_CPU_MAX && cpu_ctx[cpu] != NULL)
+        return cpu_ctx[cpu];
+
+    return default_ctx;
+}
 
 vmm_context_t *get_current_ctx() {
-    return current_vmm_ctx;
+    return get_cpu_ctx(get_cpu());
 }
 
+// @note only tells the VMM which context this CPU is in, loading its page
+// tables right after is up to the caller
 void vmm_switch_ctx(vmm_context_t *new_ctx) {
-    current_vmm_ctx = new_ctx;
+    if (default_ctx == NULL)
+        default_ctx = new_ctx;
+
+    uint8_t cpu = get_cpu();
+    if (cpu < LIMIT_CPU_MAX)
+        cpu_ctx[cpu] = new_ctx;
 }
 
 // imagine making a function to print stuff that you're going to barely use LMAO
@@ -34,32 +62,226 @@ void vmo_dump(virtmem_object_t *vmo) {
     debugf_debug("\tbase: %llx\n", vmo->base);
     debugf_debug("\tlen %zu\n", vmo->len);
     debugf_debug("\tflags: %llb\n", vmo->flags);
+    debugf_debug("\tgap: %zu\n", vmo->gap);
     debugf_debug("\tnext: %p\n", vmo->next);
 }
 
 // @param length IT'S IN PAGESSSS
 virtmem_object_t *vmo_init(uint64_t base, size_t length, uint64_t flags) {
-
-    size_t vmosize_aligned = ROUND_UP(sizeof(virtmem_object_t), PFRAME_SIZE);
-    virtmem_object_t *vmo  = (virtmem_object_t *)PHYS_TO_VIRTUAL(
-        pmm_alloc_pages(vmosize_aligned / PFRAME_SIZE));
+    virtmem_object_t *vmo = kmem_cache_zalloc(vmo_cache);
+    if (vmo == NULL)
+        return NULL;
 
     vmo->base  = base;
     vmo->len   = length;
     vmo->flags = flags;
 
+    return vmo;
+}
+
+void vmo_free(virtmem_object_t *vmo) {
+    kmem_cache_free(vmo_cache, vmo);
+}
+
+static void put_frames(page_t **pages, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (pages[i] != NULL)
+            page_put(pages[i]);
+    }
+}
+
+// pages that were never touched have nothing to give back, and the ones
+// shared with a clone stay around until the clone lets go of them too. A
+// shared VMO only has references to the frames marked with PMLE_SHARED
+void vmo_release_frames(vmm_context_t *ctx, virtmem_object_t *vmo) {
+    pg_cursor_t cur;
+    pg_cursor_init(&cur, ctx->pml4_table);
+
+    // a frame can only go once no TLB has it anymore
+    page_t *pages[LIMIT_TLB_FLUSH_PAGES];
+    size_t count = 0;
+
+    for (size_t i = 0; i < vmo->len; i++) {
+        uint64_t virt   = vmo->base + i * PFRAME_SIZE;
+        uint64_t *entry = pg_cursor_find(&cur, virt);
+        if (entry == NULL || !(*entry & PMLE_PRESENT))
+            continue;
+
+        bool ref = !(vmo->flags & VMO_SHARED) || (*entry & PMLE_SHARED);
+        pages[count++] = ref ? phys_to_page((void *)PG_GET_ADDR(*entry)) : NULL;
+        *entry         = 0x0;
+        tlb_batch_add(&cur.batch, virt, PFRAME_SIZE);
+
+        if (count == LIMIT_TLB_FLUSH_PAGES) {
+            pg_cursor_flush(&cur);
+            put_frames(pages, count);
+            count = 0;
+        }
+    }
+
+    // the entries are all clear, this just frees the tables
+    pg_cursor_unmap(&cur, vmo->base, vmo->len * PFRAME_SIZE);
+    pg_cursor_flush(&cur);
+    put_frames(pages, count);
+}
+
+// the frames of a VMO that maps memory handed to vma_alloc() might be mapped
+// by a clone too, the ones it still uses stay around until it lets go
+void vmo_free_frames(uint64_t phys, size_t pages) {
+    bool shared = false;
+    for (size_t i = 0; i < pages && !shared; i++) {
+        page_t *page = phys_to_page((void *)(phys + i * PFRAME_SIZE));
+        shared       = page != NULL && page->refcount > 1;
+    }
+
+    if (!shared) {
+        pmm_free((void *)phys, pages);
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++) {
+        page_t *page = phys_to_page((void *)(phys + i * PFRAME_SIZE));
+        if (page != NULL)
+            page_put(page);
+    }
+}
+
+/*
+        VMO trees
+
+        A context keeps its VMOs in two AVL trees: one sorted by address, to
+   find the VMO an address is in, and one sorted by the size of the free gap
+   that follows each VMO, to find the gap that fits a new VMO best. Free
+   space isn't tracked anywhere else, it's just what's between two VMOs.
+   Lookups, allocations and frees are all O(log n), no matter how many VMOs
+   the context has.
+*/
+
+static int addr_cmp(const AVLLink *a, const AVLLink *b) {
+    uint64_t base_a = container_of(a, virtmem_object_t, addr_link)->base;
+    uint64_t base_b = container_of(b, virtmem_object_t, addr_link)->base;
+
+    return base_a < base_b ? -1 : base_a > base_b;
+}
+
+static int gap_cmp(const AVLLink *a, const AVLLink *b) {
+    virtmem_object_t *vmo_a = container_of(a, virtmem_object_t, gap_link);
+    virtmem_object_t *vmo_b = container_of(b, virtmem_object_t, gap_link);
+
+    if (vmo_a->gap != vmo_b->gap)
+        return vmo_a->gap < vmo_b->gap ? -1 : 1;
+
+    return vmo_a->base < vmo_b->base ? -1 : vmo_a->base > vmo_b->base;
+}
+
+// VMOs without a gap after them stay out of the gap tree
+static void gap_insert(vmm_context_t *ctx, virtmem_object_t *vmo) {
+    if (vmo->gap > 0)
+        avl_link_insert(&ctx->gap_tree, &vmo->gap_link, gap_cmp);
+}
+
+static void gap_remove(vmm_context_t *ctx, virtmem_object_t *vmo) {
+    if (vmo->gap > 0)
+        avl_link_remove(&ctx->gap_tree, &vmo->gap_link);
+}
+
+// @param prev NULL to make `vmo` the first one
+void vmo_link(vmm_context_t *ctx, virtmem_object_t *prev,
+              virtmem_object_t *vmo) {
+    virtmem_object_t *next = prev ? prev->next : ctx->root_vmo;
+    uint64_t limit         = next ? next->base : VMM_SPACE_END;
+
+    vmo->prev = prev;
+    vmo->next = next;
+    if (next)
+        next->prev = vmo;
+
+    if (prev) {
+        gap_remove(ctx, prev);
+        prev->gap  = (vmo->base - VMO_END(prev)) / PFRAME_SIZE;
+        prev->next = vmo;
+        gap_insert(ctx, prev);
+    } else {
+        ctx->root_vmo = vmo;
+    }
+
+    vmo->gap = (limit - VMO_END(vmo)) / PFRAME_SIZE;
+    avl_link_insert(&ctx->vmo_tree, &vmo->addr_link, addr_cmp);
+    gap_insert(ctx, vmo);
+}
+
+void vmo_unlink(vmm_context_t *ctx, virtmem_object_t *vmo) {
+    virtmem_object_t *prev = vmo->prev;
+
+    gap_remove(ctx, vmo);
+    avl_link_remove(&ctx->vmo_tree, &vmo->addr_link);
+
+    if (vmo->next)
+        vmo->next->prev = prev;
+
+    if (prev) {
+        gap_remove(ctx, prev);
+        prev->gap  += vmo->len + vmo->gap;
+        prev->next  = vmo->next;
+        gap_insert(ctx, prev);
+    } else {
+        ctx->root_vmo = vmo->next;
+    }
+
     vmo->next = NULL;
     vmo->prev = NULL;
+}
 
-    return vmo;
+virtmem_object_t *vmo_find(vmm_context_t *ctx, uint64_t addr) {
+    AVLLink *link = ctx->vmo_tree;
+    while (link) {
+        virtmem_object_t *vmo = container_of(link, virtmem_object_t, addr_link);
+
+        if (addr < vmo->base)
+            link = link->left;
+        else if (addr >= VMO_END(vmo))
+            link = link->right;
+        else
+            return vmo;
+    }
+
+    return NULL;
+}
+
+virtmem_object_t *vmo_find_gap(vmm_context_t *ctx, size_t pages) {
+    virtmem_object_t *best = NULL;
+
+    AVLLink *link = ctx->gap_tree;
+    while (link) {
+        virtmem_object_t *vmo = container_of(link, virtmem_object_t, gap_link);
+
+        if (vmo->gap >= pages) {
+            best = vmo;
+            link = link->left;
+        } else {
+            link = link->right;
+        }
+    }
+
+    return best;
+}
+
+extern void _hcf();
+
+void vmm_caches_init() {
+    ctx_cache = kmem_cache_create("vmm_ctx", sizeof(vmm_context_t), 0, NULL);
+    vmo_cache = kmem_cache_create("vmo", sizeof(virtmem_object_t), 0, NULL);
+    if (ctx_cache == NULL || vmo_cache == NULL) {
+        kprintf_panic("Couldn't create the VMM caches!\n");
+        _hcf();
+    }
 }
 
 // @note We will not care if `pml4` is 0x0 :^)
 vmm_context_t *vmm_ctx_init(uint64_t *pml4, uint64_t flags) {
-
-    size_t vmcsize_aligned = ROUND_UP(sizeof(virtmem_object_t), PFRAME_SIZE);
-    vmm_context_t *ctx     = (vmm_context_t *)PHYS_TO_VIRTUAL(
-        pmm_alloc_pages(vmcsize_aligned / PFRAME_SIZE));
+    vmm_context_t *ctx = kmem_cache_zalloc(ctx_cache);
+    if (ctx == NULL)
+        return NULL;
 
     /*
     For some reason UEFI gives out region 0x0-0x1000 as usable :/
@@ -69,14 +291,22 @@ vmm_context_t *vmm_ctx_init(uint64_t *pml4, uint64_t flags) {
     */
 
     ctx->pml4_table = pml4;
-    ctx->root_vmo   = vmo_init(0x1000, 1, flags);
+    ctx->flags      = flags;
+
+    // page 0 never gets handed out, so that NULL dereferences keep faulting
+    virtmem_object_t *guard = vmo_init(0, VMM_SPACE_START / PFRAME_SIZE, 0);
+    if (guard == NULL) {
+        kmem_cache_free(ctx_cache, ctx);
+        return NULL;
+    }
+    vmo_link(ctx, NULL, guard);
 
     return ctx;
 }
 
 void vmm_ctx_destroy(vmm_context_t *ctx) {
 
-    if (VIRT_TO_PHYSICAL(ctx->pml4_table) == (uint64_t)cpu_get_cr(3)) {
+    if (VIRT_TO_PHYSICAL(ctx->pml4_table) == PG_GET_ADDR(cpu_get_cr(3))) {
         kprintf_warn("Attempted to destroy a pagemap that's currently in use. "
                      "Skipping\n");
         return;
@@ -86,59 +316,159 @@ void vmm_ctx_destroy(vmm_context_t *ctx) {
     for (virtmem_object_t *i = ctx->root_vmo; i != NULL;) {
         virtmem_object_t *next = i->next;
 
-        // Only free physical memory if the VMO is mapped
-        if (i->flags & VMO_PRESENT) {
-            uint64_t phys = pg_virtual_to_phys(ctx->pml4_table, i->base);
+        // Only free physical memory if the VMO is mapped, and it's ours
+        if (i->flags & (VMO_DEMAND | VMO_SHARED)) {
+            vmo_release_frames(ctx, i);
+        } else if (i->flags & VMO_PRESENT) {
+            uint64_t phys = pg_virtual_to_phys(
+                (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table), i->base);
             if (phys) {
-                pmm_free((void *)PHYS_TO_VIRTUAL(phys), i->len);
+                vmo_free_frames(phys, i->len);
             }
         }
 
         // Free the VMO structure itself
-        pmm_free(i,
-                 ROUND_UP(sizeof(virtmem_object_t), PFRAME_SIZE) / PFRAME_SIZE);
+        vmo_free(i);
         i = next;
     }
 
-    // Unmap all pages in the page tables
-    for (int pml4_idx = 0; pml4_idx < 512; pml4_idx++) {
-        uint64_t *pml4 = (uint64_t *)PHYS_TO_VIRTUAL(ctx->pml4_table);
-        if (!(pml4[pml4_idx] & PMLE_PRESENT)) {
-            continue;
-        }
+    tlb_forget(ctx->pml4_table);
+
+    // Free whatever is left in the page tables, and the tables themselves.
+    // The higher half is the kernel's, every context shares its tables
+    pg_cursor_t cur;
+    pg_cursor_init(&cur, ctx->pml4_table);
+    pg_cursor_unmap(&cur, 0, LOWER_HALF_END);
+    pg_cursor_flush(&cur);
+
+    // Free the PML4 table and the context
+    pmm_free(ctx->pml4_table, 1);
+    ctx->pml4_table = NULL;
+
+    kmem_cache_free(ctx_cache, ctx);
+}
 
-        uint64_t *pdpt = (uint64_t *)PHYS_TO_VIRTUAL(pml4[pml4_idx] & ~0xFFF);
-        for (int pdpt_idx = 0; pdpt_idx < 512; pdpt_idx++) {
-            if (!(pdpt[pdpt_idx] & PMLE_PRESENT)) {
+/*
+        Cloning
+
+        A clone gets the kernel half of the PML4 from its source and a copy of
+   the lower half, which costs one page table entry per mapped page and no
+   copying of their contents. Pages of demand paged VMOs end up mapped
+   read-only in both contexts, marked with PMLE_COW and referenced once by
+   each. vma_cow_fault() gives a context its own copy when it writes to one.
+   Any other VMO maps physical memory somebody handed to vma_alloc(), the
+   clone shares it as it is. Frames the PMM handed out get a reference and
+   PMLE_SHARED in the clone's entry, so that they outlive whichever context
+   frees them first. MMIO and reserved memory have nobody to free them.
+*/
+
+// source entries that get write protected are added to `batch`
+// @returns false if there's no memory for the clone's page tables. The pages
+// cloned until then are in the clone already
+static bool clone_vmo_pages(tlb_batch_t *batch, uint64_t *dst_pml4,
+                            uint64_t *src_pml4, virtmem_object_t *vmo) {
+    // nobody is using the clone yet, there's nothing to invalidate in there
+    for (size_t i = 0; i < vmo->len; i++) {
+        uint64_t virt = vmo->base + i * PFRAME_SIZE;
+
+        if (!(vmo->flags & VMO_DEMAND)) {
+            // the source might use huge pages, the clone gets 4KiB ones
+            uint64_t shared = get_page_entry(src_pml4, virt) & ~PMLE_SHARED;
+            if (!(shared & PMLE_PRESENT))
                 continue;
+
+            uint64_t *dst = pg_create_entry(dst_pml4, virt);
+            if (dst == NULL)
+                return false;
+
+            page_t *page = phys_to_page((void *)PG_GET_ADDR(shared));
+            if (page != NULL && page->refcount > 0) {
+                page_get(page);
+                shared |= PMLE_SHARED;
             }
 
-            uint64_t *pd = (uint64_t *)PHYS_TO_VIRTUAL(pdpt[pdpt_idx] & ~0xFFF);
-            for (int pd_idx = 0; pd_idx < 512; pd_idx++) {
-                if (!(pd[pd_idx] & PMLE_PRESENT)) {
-                    continue;
-                }
+            *dst = shared;
+            continue;
+        }
 
-                uint64_t *pt = (uint64_t *)PHYS_TO_VIRTUAL(pd[pd_idx] & ~0xFFF);
+        uint64_t *entry = pg_find_entry(src_pml4, virt);
+        if (entry == NULL || !(*entry & PMLE_PRESENT))
+            continue;
 
-                // Free the page table
-                pmm_free((void *)pt, 1);
-            }
+        uint64_t *dst = pg_create_entry(dst_pml4, virt);
+        if (dst == NULL)
+            return false;
 
-            // Free the page directory
-            pmm_free((void *)pd, 1);
+        page_get(phys_to_page((void *)PG_GET_ADDR(*entry)));
+        if (*entry & PMLE_WRITE) {
+            *entry = (*entry & ~PMLE_WRITE) | PMLE_COW;
+            tlb_batch_add(batch, virt, PFRAME_SIZE);
         }
 
-        // Free the PDPT
-        pmm_free((void *)pdpt, 1);
+        *dst = *entry;
     }
 
-    // Free the PML4 table and the context
-    pmm_free(ctx->pml4_table, 1);
-    size_t vmcsize_aligned = ROUND_UP(sizeof(virtmem_object_t), PFRAME_SIZE);
-    pmm_free(ctx, vmcsize_aligned / PFRAME_SIZE);
+    return true;
+}
 
-    ctx->pml4_table = NULL;
+vmm_context_t *vmm_ctx_clone(vmm_context_t *src) {
+    uint64_t *pml4 = pmm_alloc_page();
+    if (pml4 == NULL)
+        return NULL;
+    page_tag(pml4, 1, PAGE_OWNER_PAGING, PAGE_PAGETABLE);
+
+    vmm_context_t *ctx = vmm_ctx_init(pml4, src->flags);
+    if (ctx == NULL) {
+        pmm_free(pml4, 1);
+        return NULL;
+    }
+
+    uint64_t *src_pml4 = (uint64_t *)PHYS_TO_VIRTUAL(src->pml4_table);
+    uint64_t *dst_pml4 = (uint64_t *)PHYS_TO_VIRTUAL(pml4);
+    for (int i = PMLT_ENTRIES / 2; i < PMLT_ENTRIES; i++)
+        dst_pml4[i] = src_pml4[i];
+
+    bool complete = true;
+    tlb_batch_t batch;
+    tlb_batch_begin(&batch, src_pml4);
+
+    uint64_t flags = _get_cpu_flags();
+    asm("cli");
+    spinlock_acquire(&src->lock);
+
+    virtmem_object_t *last = ctx->root_vmo;
+    for (virtmem_object_t *i = src->root_vmo->next; i != NULL; i = i->next) {
+        virtmem_object_t *vmo = vmo_init(i->base, i->len, i->flags);
+        if (vmo == NULL) {
+            complete = false;
+            break;
+        }
+        if (!(i->flags & VMO_DEMAND))
+            vmo->flags |= VMO_SHARED;
+
+        vmo_link(ctx, last, vmo);
+        last = vmo;
+
+        // vmm_ctx_destroy() takes back what made it into the clone
+        if (!clone_vmo_pages(&batch, dst_pml4, src_pml4, i)) {
+            complete = false;
+            break;
+        }
+    }
+
+    spinlock_release(&src->lock);
+    _set_cpu_flags(flags);
+
+    // other CPUs in the source context might still be allowed to write. Not
+    // under the lock, they could be spinning on it with interrupts off
+    tlb_batch_commit(&batch);
+
+    if (!complete) {
+        vmm_ctx_destroy(ctx);
+        return NULL;
+    }
+
+    return ctx;
 }
 
 uint64_t vmo_to_page_flags(uint64_t vmo_flags) {
@@ -167,45 +497,6 @@ uint64_t page_to_vmo_flags(uint64_t pg_flags) {
     return vmo_flags;
 }
 
-// @param len after how many pages should we split the VMO
-virtmem_object_t *split_vmo_at(virtmem_object_t *src_vmo, size_t where) {
-    virtmem_object_t *new_vmo;
-
-    if (src_vmo->len - where <= 0) {
-        return src_vmo; // we are not going to split it
-    }
-
-    size_t offset = (uint64_t)(where * PFRAME_SIZE);
-    new_vmo =
-        vmo_init(src_vmo->base + offset, src_vmo->len - where, src_vmo->flags);
-    /*
-    src_vmo		  new_vmo
-    [     [                        ]
-    0	  0+len					   X
-    */
-
-#ifdef CONFIG_VMM_DEBUG
-    debugf_debug("VMO %p has been split at (virt)%llx\n", src_vmo,
-                 src_vmo->base + offset);
-#endif
-
-    src_vmo->len = where;
-
-    if (src_vmo->next != NULL) {
-        new_vmo->next = src_vmo->next;
-        src_vmo->next = new_vmo;
-        new_vmo->prev = src_vmo;
-    }
-
-    /*
-    src_vmo		  new_vmo
-    [     ]<-->[                        ]-->...
-    0	       0+len					X
-    */
-
-    return src_vmo;
-}
-
 void pagemap_copy_to(uint64_t *non_kernel_pml4) {
 
     uint64_t *k_pml4 = (uint64_t *)PHYS_TO_VIRTUAL(get_kernel_pml4());
@@ -223,9 +514,9 @@ void pagemap_copy_to(uint64_t *non_kernel_pml4) {
 
 // Assumes the CTX has been initialized with vmm_ctx_init()
 void vmm_init(vmm_context_t *ctx) {
-    for (virtmem_object_t *i = ctx->root_vmo; i != NULL; i = i->next) {
-        // every VMO will have the same flags as the root one
-        i->flags = ctx->root_vmo->flags;
+    for (virtmem_object_t *i = ctx->root_vmo->next; i != NULL; i = i->next) {
+        // every VMO will have the same flags as the context, the guard aside
+        i->flags = ctx->flags | (i->flags & (VMO_ALLOCATED | VMO_DEMAND));
 
         // mapping will be done on vma_alloc
     }
@@ -8,19 +8,41 @@
 
 #include <paging/paging.h>
 
+#include <spinlock.h>
+#include <structures/avltree.h>
+
+// virtual addresses handed out by vma_alloc(), the lower half minus page 0
+#define VMM_SPACE_START 0x1000
+#define VMM_SPACE_END   0x800000000000
+
 typedef struct virtmem_object_t {
     uint64_t base;
     size_t len; // length is in pages (4KiB blocks)!!
     uint64_t flags;
 
+    // neighbours by address
     struct virtmem_object_t *next;
     struct virtmem_object_t *prev;
+
+    size_t gap; // free pages between the end of this VMO and the next one
+
+    AVLLink addr_link; // in vmm_context_t.vmo_tree, sorted by base
+    AVLLink gap_link;  // in vmm_context_t.gap_tree, if gap isn't 0
 } virtmem_object_t;
 
 typedef struct vmm_context_t {
     uint64_t *pml4_table;
 
+    // lowest VMO, a guard covering page 0 that's never handed out
     virtmem_object_t *root_vmo;
+
+    AVLLink *vmo_tree;
+    AVLLink *gap_tree; // sorted by gap, then by base
+
+    uint64_t flags; // of the VMOs vma_alloc() creates
+
+    // taken from the page fault handler too, keep interrupts off
+    lock_t lock;
 } vmm_context_t;
 
 // VMO flags
@@ -29,21 +51,51 @@ typedef struct vmm_context_t {
 #define VMO_USER    (1 << 2)
 // this flag get's set when the VMO gets allocated
 #define VMO_ALLOCATED (1 << 8)
+// no memory behind it until it's touched, see vma_fault()
+#define VMO_DEMAND (1 << 9)
+// maps frames of the context it was cloned from, see vmm_ctx_clone()
+#define VMO_SHARED (1 << 10)
 
 // VMO "macro"flags
 #define VMO_KERNEL    VMO_PRESENT
 #define VMO_KERNEL_RW VMO_RW | VMO_KERNEL
 #define VMO_USER_RW   VMO_PRESENT | VMO_RW | VMO_USER
 
+vmm_context_t *get_cpu_ctx(uint8_t cpu);
 vmm_context_t *get_current_ctx();
 void vmm_switch_ctx(vmm_context_t *new_ctx);
 
 virtmem_object_t *vmo_init(uint64_t base, size_t length, uint64_t flags);
+void vmo_free(virtmem_object_t *vmo);
 void vmo_dump(virtmem_object_t *vmo);
-virtmem_object_t *split_vmo_at(virtmem_object_t *src_vmo, size_t len);
+// unmaps the pages of a demand paged or shared VMO and drops its references
+// to their frames
+void vmo_release_frames(vmm_context_t *ctx, virtmem_object_t *vmo);
+// frees the `pages` frames starting from `phys` that a VMO was handed
+void vmo_free_frames(uint64_t phys, size_t pages);
+
+// the following expect `ctx->lock` to be held
+
+// puts `vmo` in the context right after `prev`, into the gap that follows it
+void vmo_link(vmm_context_t *ctx, virtmem_object_t *prev,
+              virtmem_object_t *vmo);
+// takes `vmo` out of the context, its pages go to the gap before it
+void vmo_unlink(vmm_context_t *ctx, virtmem_object_t *vmo);
+
+// @returns the VMO `addr` is in, NULL if there's none
+virtmem_object_t *vmo_find(vmm_context_t *ctx, uint64_t addr);
+// @returns the VMO followed by the smallest gap that's at least `pages` long
+// (the lowest one on ties), NULL if there's none
+virtmem_object_t *vmo_find_gap(vmm_context_t *ctx, size_t pages);
+
+// creates the caches contexts and VMOs come from, before any vmm_ctx_init()
+void vmm_caches_init();
 
 vmm_context_t *vmm_ctx_init(uint64_t *pml4, uint64_t flags);
 void vmm_ctx_destroy(vmm_context_t *ctx);
+// @returns a new context with the same VMOs as `src` and the same kernel half,
+// NULL if there's no memory for it
+vmm_context_t *vmm_ctx_clone(vmm_context_t *src);
 
 uint64_t vmo_to_page_flags(uint64_t vmo_flags);
 uint64_t page_to_vmo_flags(uint64_t pg_flags);
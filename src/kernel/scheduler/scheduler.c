@@ -6,32 +6,49 @@
 #include <fs/vfs/vfs.h>
 #include <gdt/gdt.h>
 #include <interrupts/isr.h>
+#include <cpu.h>
 #include <kernel.h>
 #include <spinlock.h>
 
 #include <memory/heap/kheap.h>
+#include <memory/percpu/percpu.h>
+#include <memory/pmm/pmm.h>
+#include <memory/slab/slab.h>
 #include <memory/vmm/vmm.h>
 #include <paging/paging.h>
 
 #include <smp/smp.h>
+#include <smp/tlb.h>
 #include <util/assert.h>
 #include <util/string.h>
 
 #include <autoconf.h>
 
+extern vmm_context_t *kernel_vmm_ctx;
+
 scheduler_manager_t *scheduler_manager;
 
+static kmem_cache_t *proc_cache;
+
 void idle(void) {
-    for (;;)
-        ;
+    for (;;) {
+        // nothing to run, get some page frames zeroed in the meantime
+        pmm_zero_worker();
+        asm volatile("pause");
+    }
 }
 
+// @returns NULL if there's no memory for the process
 proc_t *create_idle_process(uint8_t core) {
-    proc_t *idle_proc       = kmalloc(sizeof(proc_t));
+    proc_t *idle_proc = kmem_cache_alloc(proc_cache);
+    if (idle_proc == NULL)
+        return NULL;
+
     idle_proc->pid          = scheduler_manager->next_pid++;
     idle_proc->whoami.user  = 0;
     idle_proc->whoami.group = 0;
     idle_proc->pml4         = get_kernel_pml4();
+    idle_proc->vmm_ctx      = kernel_vmm_ctx;
 
     asm volatile("movq %%rsp, %0" : "=r"(idle_proc->regs.rsp));
     idle_proc->regs.rsp -= PROC_STACK_SIZE;
@@ -59,6 +76,12 @@ proc_t *create_idle_process(uint8_t core) {
 }
 
 void scheduler_init() {
+    proc_cache = kmem_cache_create("proc", sizeof(proc_t), 0, NULL);
+    if (proc_cache == NULL) {
+        kprintf_panic("Couldn't create the process cache!\n");
+        _hcf();
+    }
+
     scheduler_manager = kmalloc(sizeof(scheduler_manager_t));
 
     bootloader_data *bootloader_data = get_bootloader_data();
@@ -72,9 +95,15 @@ void scheduler_init() {
     scheduler_manager->load_balance_interval = 0;
     scheduler_manager->last_load_balance     = 0;
 
+    // run queues are hammered by their own core only, keep them on separate
+    // cache lines (and on the core's own node)
+    core_scheduler_t *scheds = alloc_percpu(sizeof(core_scheduler_t));
     for (size_t i = 0; i < scheduler_manager->core_count; i++) {
-        scheduler_manager->core_schedulers[i] =
-            kmalloc(sizeof(core_scheduler_t));
+        core_scheduler_t *sched = per_cpu_ptr(scheds, i);
+        if (sched == NULL)
+            sched = kmalloc_aligned(sizeof(core_scheduler_t), CACHE_LINE_SIZE);
+
+        scheduler_manager->core_schedulers[i] = sched;
         // lapic_timer_init(); we maybe just init this outside of scheduler
         scheduler_init_cpu(i);
     }
@@ -92,6 +121,11 @@ void scheduler_init_cpu(uint8_t core) {
     scheduler_manager->core_schedulers[core]->current_proc = NULL;
     scheduler_manager->core_schedulers[core]->idle_proc =
         create_idle_process(core);
+    if (scheduler_manager->core_schedulers[core]->idle_proc == NULL) {
+        kprintf_panic("Couldn't create the idle process of CPU %hhu!\n",
+                      core);
+        _hcf();
+    }
     scheduler_manager->core_schedulers[core]->run_queue_head     = NULL;
     scheduler_manager->core_schedulers[core]->run_queue_tail     = NULL;
     scheduler_manager->core_schedulers[core]->run_queue_size     = 0;
@@ -104,6 +138,7 @@ void scheduler_init_cpu(uint8_t core) {
     spinlock_release(&scheduler_manager->core_schedulers[core]->lock);
 }
 
+// @returns NULL if there's no memory for the process
 proc_t *scheduler_add(void (*entry_point)(), int flags) {
     asm("cli");
 
@@ -118,18 +153,24 @@ proc_t *scheduler_add(void (*entry_point)(), int flags) {
         }
     }
 
-    proc_t *proc = kmalloc(sizeof(proc_t));
-    proc->pid    = scheduler_manager->next_pid;
-    scheduler_manager->next_pid++;
-    proc->whoami.user  = 0;
-    proc->whoami.group = 0;
+    proc_t *proc = kmem_cache_alloc(proc_cache);
+    if (proc == NULL) {
+        asm("sti");
+        return NULL;
+    }
+
     if (flags & SCHED_PROC_KERNEL_PAGE_MAP) {
-        proc->pml4 = get_kernel_pml4();
+        proc->vmm_ctx = kernel_vmm_ctx;
     } else {
-        proc->pml4 = (uint64_t *)pmm_alloc_page();
-        pagemap_copy_to(proc->pml4);
-        copy_range_to_pagemap(proc->pml4, get_kernel_pml4(), 0x1000, 0x10000);
+        // the kernel's memory gets shared copy-on-write
+        proc->vmm_ctx = vmm_ctx_clone(kernel_vmm_ctx);
+        if (proc->vmm_ctx == NULL) {
+            kmem_cache_free(proc_cache, proc);
+            asm("sti");
+            return NULL;
+        }
     }
+    proc->pml4 = (uint64_t *)VIRT_TO_PHYSICAL(proc->vmm_ctx->pml4_table);
 
     memset(&proc->regs, 0, sizeof(registers_t));
 
@@ -141,11 +182,24 @@ proc_t *scheduler_add(void (*entry_point)(), int flags) {
         asm volatile("movq %%rsp, %0" : "=r"(proc->regs.rsp));
         proc->regs.rsp -= PROC_STACK_SIZE;
     } else {
-        proc->regs.rsp =
-            ((uint64_t)PHYS_TO_VIRTUAL(pmm_alloc_pages(PROC_STACK_PAGES))) +
-            (PROC_STACK_SIZE);
+        void *stack = pmm_alloc_pages_nozero(PROC_STACK_PAGES);
+        if (stack == NULL) {
+            if (!(flags & SCHED_PROC_KERNEL_PAGE_MAP))
+                vmm_ctx_destroy(proc->vmm_ctx);
+            kmem_cache_free(proc_cache, proc);
+            asm("sti");
+            return NULL;
+        }
+        page_tag(stack, PROC_STACK_PAGES, PAGE_OWNER_SCHED, 0);
+
+        proc->regs.rsp = PHYS_TO_VIRTUAL(stack) + PROC_STACK_SIZE;
     }
 
+    proc->pid = scheduler_manager->next_pid;
+    scheduler_manager->next_pid++;
+    proc->whoami.user  = 0;
+    proc->whoami.group = 0;
+
     proc->regs.rbp    = proc->regs.rsp;
     proc->regs.rflags = 0x202;
     proc->regs.rip    = (uint64_t)entry_point;
@@ -232,15 +286,24 @@ proc_t *get_current_process() {
     return sched->current_proc;
 }
 
+// a CR3 load costs the TLB entries of the lower half even with PCIDs, and
+// processes sharing the kernel's context don't need one to switch
+static void switch_address_space(proc_t *proc) {
+    vmm_switch_ctx(proc->vmm_ctx);
+    if (VIRT_TO_PHYSICAL(proc->pml4) != PG_GET_ADDR(cpu_get_cr(3)))
+        tlb_switch(proc->pml4);
+}
+
 void scheduler_switch_context(proc_t *proc, registers_t *current_regs) {
     memcpy(&proc->regs, current_regs, sizeof(registers_t));
-    _load_pml4(proc->pml4);
+    switch_address_space(proc);
 }
 
 void scheduler_schedule(void *ctx) {
     asm("cli");
-    _load_pml4(get_kernel_pml4());
 
+    // the kernel half is the same in every context, no need to leave the
+    // current one until the next process is picked
     core_scheduler_t *sched = scheduler_manager->core_schedulers[get_cpu()];
 
     registers_t *regs = ctx;
@@ -270,13 +333,13 @@ void scheduler_schedule(void *ctx) {
 
         sched->current_proc = next_proc;
         memcpy(regs, &next_proc->regs, sizeof(registers_t));
-        _load_pml4(next_proc->pml4);
+        switch_address_space(next_proc);
     } else {
         if (sched->current_proc != sched->idle_proc) {
             sched->current_proc    = sched->idle_proc;
             sched->idle_proc->next = NULL; // Ensure idle proc's next is NULL
             memcpy(regs, &sched->idle_proc->regs, sizeof(registers_t));
-            _load_pml4(sched->idle_proc->pml4);
+            switch_address_space(sched->idle_proc);
         }
     }
 
@@ -30,6 +30,7 @@ typedef struct proc {
 
     registers_t regs;
     uint64_t *pml4;
+    struct vmm_context_t *vmm_ctx; // the one `pml4` belongs to
 
     uint64_t time_slice;
     int sched_flags;
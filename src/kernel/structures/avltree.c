@@ -1,7 +1,12 @@
 #include "avltree.h"
 #include <memory/heap/kheap.h>
+#include <memory/slab/slab.h>
 #include <util/string.h>
 
+#include <stdio.h>
+
+static kmem_cache_t *node_cache;
+
 // Helper function to get the maximum of two integers
 static int max(int a, int b) {
     return (a > b) ? a : b;
@@ -63,6 +68,16 @@ static AVLNode *left_rotate(AVLNode *x) {
     return y;
 }
 
+extern void _hcf();
+
+void avl_init() {
+    node_cache = kmem_cache_create("avl_node", sizeof(AVLNode), 0, NULL);
+    if (node_cache == NULL) {
+        kprintf_panic("Couldn't create the AVL node cache!\n");
+        _hcf();
+    }
+}
+
 // Create a new AVL tree
 AVLTree *avl_create(AVLComparator compare) {
     AVLTree *tree = kmalloc(sizeof(AVLTree));
@@ -80,7 +95,7 @@ static void free_node(AVLNode *node) {
         return;
     free_node(node->left);
     free_node(node->right);
-    kfree(node);
+    kmem_cache_free(node_cache, node);
 }
 
 // Destroy the entire AVL tree
@@ -96,7 +111,7 @@ static AVLNode *insert_node(AVLTree *tree, AVLNode *node, void *key,
                             void *value, AVLNode *parent) {
     // 1. Perform standard BST insertion
     if (!node) {
-        AVLNode *new_node = kmalloc(sizeof(AVLNode));
+        AVLNode *new_node = kmem_cache_alloc(node_cache);
         if (!new_node)
             return NULL;
 
@@ -230,7 +245,7 @@ static AVLNode *remove_node(AVLTree *tree, AVLNode *root, void *key) {
                 // Copy the contents of the non-empty child
                 *root = *temp;
             }
-            kfree(temp);
+            kmem_cache_free(node_cache, temp);
         } else {
             // Node with two children: Get the inorder successor
             AVLNode *temp = find_min(root->right);
@@ -348,4 +363,148 @@ AVLNode *avl_next(AVLNode *node) {
 // Get value of a node
 void *avl_node_value(AVLNode *node) {
     return node ? node->value : NULL;
-}
\ No newline at end of file
+}
+/*
+        Intrusive variant
+
+        Links are embedded in the objects they sort and keep a pointer to
+   their parent, so insertion and removal never allocate and walk back up to
+   the root without recursion, fixing heights and rotating on the way.
+   Searching is left to the users, who know what they're looking for better
+   than a comparator would.
+*/
+
+static int link_height(AVLLink *link) {
+    return link ? link->height : 0;
+}
+
+static void link_update_height(AVLLink *link) {
+    link->height = 1 + max(link_height(link->left), link_height(link->right));
+}
+
+// puts `new` where `old` was under `parent`
+static void link_replace_child(AVLLink **root, AVLLink *parent, AVLLink *old,
+                               AVLLink *new) {
+    if (!parent)
+        *root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+// @returns the link that took `x`'s place
+static AVLLink *link_left_rotate(AVLLink **root, AVLLink *x) {
+    AVLLink *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    link_replace_child(root, x->parent, x, y);
+
+    y->left   = x;
+    x->parent = y;
+
+    link_update_height(x);
+    link_update_height(y);
+    return y;
+}
+
+// @returns the link that took `y`'s place
+static AVLLink *link_right_rotate(AVLLink **root, AVLLink *y) {
+    AVLLink *x = y->left;
+
+    y->left = x->right;
+    if (x->right)
+        x->right->parent = y;
+
+    x->parent = y->parent;
+    link_replace_child(root, y->parent, y, x);
+
+    x->right  = y;
+    y->parent = x;
+
+    link_update_height(y);
+    link_update_height(x);
+    return x;
+}
+
+// fixes heights and balance from `link` up to the root
+static void link_rebalance(AVLLink **root, AVLLink *link) {
+    while (link) {
+        link_update_height(link);
+
+        int balance = link_height(link->left) - link_height(link->right);
+        if (balance > 1) {
+            if (link_height(link->left->left) <
+                link_height(link->left->right))
+                link_left_rotate(root, link->left);
+            link = link_right_rotate(root, link);
+        } else if (balance < -1) {
+            if (link_height(link->right->right) <
+                link_height(link->right->left))
+                link_right_rotate(root, link->right);
+            link = link_left_rotate(root, link);
+        }
+
+        link = link->parent;
+    }
+}
+
+void avl_link_insert(AVLLink **root, AVLLink *link,
+                     AVLLinkComparator compare) {
+    AVLLink *parent = NULL;
+    AVLLink **slot  = root;
+    while (*slot) {
+        parent = *slot;
+        slot   = compare(link, parent) < 0 ? &parent->left : &parent->right;
+    }
+
+    link->left   = NULL;
+    link->right  = NULL;
+    link->parent = parent;
+    link->height = 1;
+    *slot        = link;
+
+    link_rebalance(root, parent);
+}
+
+void avl_link_remove(AVLLink **root, AVLLink *link) {
+    AVLLink *fix;
+
+    if (link->left && link->right) {
+        // the inorder successor takes the link's place
+        AVLLink *succ = link->right;
+        while (succ->left)
+            succ = succ->left;
+
+        if (succ->parent == link) {
+            fix = succ;
+        } else {
+            fix       = succ->parent;
+            fix->left = succ->right;
+            if (succ->right)
+                succ->right->parent = fix;
+
+            succ->right         = link->right;
+            link->right->parent = succ;
+        }
+
+        succ->left         = link->left;
+        link->left->parent = succ;
+
+        succ->parent = link->parent;
+        link_replace_child(root, link->parent, link, succ);
+    } else {
+        AVLLink *child = link->left ? link->left : link->right;
+        if (child)
+            child->parent = link->parent;
+
+        link_replace_child(root, link->parent, link, child);
+        fix = link->parent;
+    }
+
+    link_rebalance(root, fix);
+}
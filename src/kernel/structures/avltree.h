@@ -20,6 +20,9 @@ typedef struct AVLTree {
     AVLComparator compare;
 } AVLTree;
 
+// creates the cache nodes come from, before any avl_insert()
+void avl_init();
+
 AVLTree *avl_create(AVLComparator compare);
 void avl_destroy(AVLTree *tree);
 
@@ -33,4 +36,22 @@ AVLNode *avl_first(AVLTree *tree);
 AVLNode *avl_next(AVLNode *node);
 void *avl_node_value(AVLNode *node);
 
+// intrusive variant, for objects that can't afford a node allocation: embed
+// an AVLLink in them and get back to them with container_of()
+typedef struct AVLLink {
+    struct AVLLink *left;
+    struct AVLLink *right;
+    struct AVLLink *parent;
+    int height; // of the subtree rooted here, 1 for a leaf
+} AVLLink;
+
+typedef int (*AVLLinkComparator)(const AVLLink *a, const AVLLink *b);
+
+#define container_of(ptr, type, member)                                        \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// links comparing equal to one already in the tree go after it
+void avl_link_insert(AVLLink **root, AVLLink *link, AVLLinkComparator compare);
+void avl_link_remove(AVLLink **root, AVLLink *link);
+
 #endif
\ No newline at end of file
@@ -4,6 +4,27 @@
 #define LIMIT_SCHEUDLER_PROC_MAX 1024
 #define LIMIT_FD_PROC_MAX        1024
 
+// highest LAPIC ID (+ 1) that gets its own per-CPU data
+#define LIMIT_CPU_MAX 64
+// bytes of alloc_percpu() memory every CPU gets, a multiple of a page
+#define LIMIT_PERCPU_SIZE 16384
+
+#define LIMIT_NUMA_NODES     8
+#define LIMIT_NUMA_MEMRANGES 32 // SRAT memory affinity entries we keep track of
+
+#define LIMIT_MEMBLOCK_REGIONS 128 // usable memory map entries at boot
+#define LIMIT_PMM_SHRINKERS    16
+
+// TLB shootdowns: past this many pages a whole flush is cheaper than invlpg
+#define LIMIT_TLB_FLUSH_PAGES  32
+#define LIMIT_TLB_BATCH_RANGES 8  // a batch flushes everything past these
+#define LIMIT_TLB_QUEUE_RANGES 32 // same for a CPU's flush queue
+#define LIMIT_TLB_PCIDS        8  // a CPU recycles these among address spaces
+
+// both have to be powers of two
+#define LIMIT_KHEAP_PROFILE_SITES  512   // kmalloc() call sites
+#define LIMIT_KHEAP_PROFILE_ALLOCS 16384 // live allocations
+
 #define PROC_STACK_PAGES 4
 #define PROC_STACK_SIZE  (1 * PFRAME_SIZE)
 